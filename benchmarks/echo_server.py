@@ -0,0 +1,29 @@
+# Stand-in server for coroutines.lox: listens on a Unix socket and answers
+# every line with the same line, after a delay that plays the part of a slow
+# backend.
+# python3 echo_server.py [socket path] [delay in ms]
+import asyncio
+import os
+import sys
+
+path = sys.argv[1] if len(sys.argv) > 1 else "/tmp/lox_echo.sock"
+delay = float(sys.argv[2]) / 1000 if len(sys.argv) > 2 else 0.01
+
+
+async def serve(reader, writer):
+    while line := await reader.readline():
+        await asyncio.sleep(delay)
+        writer.write(line)
+        await writer.drain()
+    writer.close()
+
+
+async def main():
+    if os.path.exists(path):
+        os.remove(path)
+    server = await asyncio.start_unix_server(serve, path, backlog=4096)
+    async with server:
+        await server.serve_forever()
+
+
+asyncio.run(main())
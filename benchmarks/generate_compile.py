@@ -0,0 +1,30 @@
+# Writes a compile benchmark with the given number of functions to stdout.
+# 120 functions give compile.lox; 20000 give a script of about 7MB.
+import sys
+
+count = int(sys.argv[1]) if len(sys.argv) > 1 else 120
+out = sys.stdout
+out.write("var start = clock();\nvar total = 0;\n\n")
+for k in range(count):
+    out.write(f"""fun work{k}(n, step) {{
+	var sum = 0;
+	var label = "work{k}";
+	var i = 0;
+	while (i < n) {{
+		if (i / 2 == i * 0.5 and !(i < {k % 7})) {{
+			sum = sum + i * step - {k};
+		}}
+		else {{
+			sum = sum - (i + {k}) / step;
+		}}
+		i = i + 1;
+	}}
+	for (var j = 0; j < {3 + k % 5}; j = j + 1) {{
+		sum = sum + len(label) * j;
+	}}
+	return sum + n * {k} - -step;
+}}
+total = total + work{k}({1 + k % 10}, {1 + k % 3});
+
+""")
+out.write("print total;\nprint clock() - start;\n")
@@ -0,0 +1,273 @@
+#include "cache.h"
+#include "mapped_file.h"
+#include "vm.h"
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <vector>
+
+#define CACHE_MAGIC 0x43584f4c // "LOXC" as a little endian word
+#define FNV_OFFSET_BASIS 0xcbf29ce484222325
+
+static uint64_t fnv1a(uint64_t hash, const void* data, size_t size)
+{
+	const uint8_t* bytes = (const uint8_t*)data;
+	for (size_t i = 0; i < size; i++) {
+		hash ^= bytes[i];
+		hash *= 0x100000001b3;
+	}
+	return hash;
+}
+
+// Changes whenever an opcode is added, removed, renumbered or changes its
+// operand bytes, so a cache never outlives the instruction set it was
+// written for.
+static uint64_t instructionSetHash()
+{
+	static const char names[] =
+#define OPCODE_NAME(op, operands) #op "/" #operands " "
+		OPCODE_LIST(OPCODE_NAME)
+#undef OPCODE_NAME
+#define OPCODE_NAME(op) #op " "
+		REG_OPCODE_LIST(OPCODE_NAME)
+#undef OPCODE_NAME
+		;
+	return fnv1a(FNV_OFFSET_BASIS, names, sizeof(names));
+}
+
+uint64_t hashSource(std::string_view source, int optimizationLevel, bool registers)
+{
+#ifdef VM_NO_SUPERINSTRUCTIONS
+	uint8_t fused = 0;
+#else
+	uint8_t fused = 1;
+#endif
+	uint8_t options[] = { (uint8_t)optimizationLevel, (uint8_t)registers, fused };
+	uint64_t hash = fnv1a(FNV_OFFSET_BASIS, source.data(), source.size());
+	return fnv1a(hash, options, sizeof(options));
+}
+
+class CacheHeader {
+public:
+	uint32_t magic;
+	uint32_t version;
+	uint64_t instructionSet;
+	uint64_t source; // hashSource of the script the chunks came from
+	uint64_t payload; // fnv1a of everything after the header
+};
+
+// Everything is written in the host's byte order; the magic number tells a
+// file from a machine with the other order apart.
+class CacheWriter {
+public:
+	std::vector<uint8_t> bytes;
+
+	void writeBytes(const void* data, size_t size) {
+		const uint8_t* start = (const uint8_t*)data;
+		bytes.insert(bytes.end(), start, start + size);
+	}
+
+	template<typename T>
+	void write(T value) {
+		writeBytes(&value, sizeof(T));
+	}
+
+	void writeString(const std::string& string) {
+		write<uint32_t>(string.size());
+		writeBytes(string.data(), string.size());
+	}
+
+	template<typename T>
+	void writeVector(const std::vector<T>& vector) {
+		write<uint32_t>(vector.size());
+		writeBytes(vector.data(), vector.size() * sizeof(T));
+	}
+};
+
+// Reads stop (ok turns false) instead of running past the end of the file.
+class CacheReader {
+public:
+	const uint8_t* position;
+	const uint8_t* end;
+	bool ok = true;
+
+	CacheReader(const uint8_t* data, size_t size) : position(data), end(data + size) {}
+
+	bool take(size_t size) {
+		if (!ok || (size_t)(end - position) < size) {
+			ok = false;
+		}
+		return ok;
+	}
+
+	template<typename T>
+	T read() {
+		T value{};
+		if (take(sizeof(T))) {
+			memcpy(&value, position, sizeof(T));
+			position += sizeof(T);
+		}
+		return value;
+	}
+
+	std::string readString() {
+		uint32_t size = read<uint32_t>();
+		if (!take(size)) return "";
+		std::string string((const char*)position, size);
+		position += size;
+		return string;
+	}
+
+	template<typename T>
+	void readVector(std::vector<T>* vector) {
+		uint32_t count = read<uint32_t>();
+		if (!take((size_t)count * sizeof(T))) return;
+		vector->resize(count);
+		memcpy(vector->data(), position, (size_t)count * sizeof(T));
+		position += (size_t)count * sizeof(T);
+	}
+};
+
+typedef enum {
+	CONSTANT_BITS, // numbers, nil and booleans are stored as their Value bits
+	CONSTANT_STRING,
+} CacheConstant;
+
+bool loadBytecodeCache(VM* vm, const std::string& path, uint64_t hash)
+{
+	if (vm->vm_function_table.size() > 1 || vm->vm_global_names.size() != 0) {
+		return false;
+	}
+	MappedFile file;
+	if (!file.open(path)) {
+		return false;
+	}
+	CacheReader reader((const uint8_t*)file.data, file.size);
+	CacheHeader header = reader.read<CacheHeader>();
+	if (!reader.ok || header.magic != CACHE_MAGIC || header.version != CACHE_FORMAT_VERSION ||
+		header.instructionSet != instructionSetHash() || header.source != hash ||
+		header.payload != fnv1a(FNV_OFFSET_BASIS, reader.position, reader.end - reader.position)) {
+		return false;
+	}
+
+	// natives are called by index, so the table must not have changed either
+	uint32_t nativeCount = reader.read<uint32_t>();
+	if (nativeCount != vm->vm_native_functions.size()) {
+		return false;
+	}
+	for (NativeFunction& native : vm->vm_native_functions) {
+		if (reader.readString() != native.name) return false;
+	}
+
+	std::vector<std::string> globals(reader.read<uint32_t>());
+	for (std::string& name : globals) {
+		name = reader.readString();
+	}
+
+	std::vector<std::shared_ptr<Chunk>> chunks(reader.read<uint32_t>());
+	for (int index = 0; index < (int)chunks.size() && reader.ok; index++) {
+		// main is chunk 0; 10 is the id the compiler gives function chunks
+		std::shared_ptr<Chunk> chunk = std::make_shared<Chunk>(index == 0 ? 0 : 10);
+		std::string name = reader.readString();
+		chunk->function = FunctionObject(name, reader.read<int32_t>());
+		chunk->function.index = index;
+		chunk->maxStack = reader.read<int32_t>();
+		chunk->registerCount = reader.read<int32_t>();
+		reader.readVector(&chunk->opcodes);
+		uint32_t constantCount = reader.read<uint32_t>();
+		for (uint32_t i = 0; i < constantCount && reader.ok; i++) {
+			if (reader.read<uint8_t>() == CONSTANT_STRING) {
+				chunk->AddConstant(Value(chunk->heap.allocateString(reader.readString())));
+			}
+			else {
+				Value value;
+				value.bits = reader.read<uint64_t>();
+				chunk->AddConstant(value);
+			}
+		}
+		reader.readVector(&chunk->lines);
+		reader.readVector(&chunk->registerCode);
+		reader.readVector(&chunk->registerLines);
+		chunks[index] = chunk;
+	}
+	if (!reader.ok || reader.position != reader.end || chunks.empty()) {
+		return false;
+	}
+
+	for (std::string& name : globals) {
+		vm->vm_global_names.resolve(name);
+	}
+	vm->vm_function_table.clear();
+	for (std::shared_ptr<Chunk>& chunk : chunks) {
+		vm->vm_functions[chunk->function.funcName] = chunk;
+		vm->vm_function_table.push_back(chunk.get());
+	}
+	return true;
+}
+
+bool writeBytecodeCache(VM* vm, const std::string& path, uint64_t hash)
+{
+	CacheWriter payload;
+	payload.write<uint32_t>(vm->vm_native_functions.size());
+	for (NativeFunction& native : vm->vm_native_functions) {
+		payload.writeString(native.name);
+	}
+	payload.write<uint32_t>(vm->vm_global_names.size());
+	for (std::string& name : vm->vm_global_names.names) {
+		payload.writeString(name);
+	}
+	payload.write<uint32_t>(vm->vm_function_table.size());
+	for (Chunk* chunk : vm->vm_function_table) {
+		payload.writeString(chunk->function.funcName);
+		payload.write<int32_t>(chunk->function.arity);
+		payload.write<int32_t>(chunk->maxStack);
+		payload.write<int32_t>(chunk->registerCount);
+		payload.writeVector(chunk->opcodes);
+		payload.write<uint32_t>(chunk->constants.size());
+		for (Value& constant : chunk->constants) {
+			if (constant.isString()) {
+				payload.write<uint8_t>(CONSTANT_STRING);
+				payload.writeString(constant.returnString());
+			}
+			else {
+				payload.write<uint8_t>(CONSTANT_BITS);
+				payload.write<uint64_t>(constant.bits);
+			}
+		}
+		payload.writeVector(chunk->lines);
+		payload.writeVector(chunk->registerCode);
+		payload.writeVector(chunk->registerLines);
+	}
+
+	CacheHeader header;
+	header.magic = CACHE_MAGIC;
+	header.version = CACHE_FORMAT_VERSION;
+	header.instructionSet = instructionSetHash();
+	header.source = hash;
+	header.payload = fnv1a(FNV_OFFSET_BASIS, payload.bytes.data(), payload.bytes.size());
+
+	// written aside and renamed into place, so a run never maps half a file
+#ifdef MAPPED_FILE_POSIX
+	std::string temporary = path + "." + std::to_string(getpid()) + ".tmp";
+#else
+	std::string temporary = path + ".tmp";
+#endif
+	{
+		std::ofstream out(temporary, std::ios::binary | std::ios::trunc);
+		out.write((const char*)&header, sizeof(header));
+		out.write((const char*)payload.bytes.data(), payload.bytes.size());
+		if (!out) {
+			out.close();
+			std::remove(temporary.c_str());
+			return false;
+		}
+	}
+#ifndef MAPPED_FILE_POSIX
+	std::remove(path.c_str());
+#endif
+	if (std::rename(temporary.c_str(), path.c_str()) != 0) {
+		std::remove(temporary.c_str());
+		return false;
+	}
+	return true;
+}
@@ -0,0 +1,27 @@
+#pragma once
+#ifndef clox_cache_h
+#include <cstdint>
+#include <string>
+#include <string_view>
+
+// Bytecode cache. After a script compiles, every chunk (opcodes, constants,
+// line tables, register code and function metadata) is written to a file
+// next to the source, stamped with a hash of the source text and the options
+// that shape the code. A later run whose hash matches maps the file and loads
+// the chunks from it instead of compiling. The file also records the format
+// version and the opcode lists it was written with, so a cache left behind by
+// a different build is ignored and rewritten.
+#define CACHE_FORMAT_VERSION 1
+
+class VM;
+
+uint64_t hashSource(std::string_view source, int optimizationLevel, bool registers);
+
+// Only loads into a VM that has not compiled anything yet. Returns false,
+// leaving the VM untouched, when the file is missing, stale or damaged.
+bool loadBytecodeCache(VM* vm, const std::string& path, uint64_t hash);
+
+// Failing to write (a read only directory, say) just means no cache.
+bool writeBytecodeCache(VM* vm, const std::string& path, uint64_t hash);
+
+#endif // !clox_cache_h
@@ -0,0 +1,118 @@
+#include "channel.h"
+#include <thread>
+
+static std::atomic<Channel*> channels[CHANNELS_MAX];
+static std::atomic<int> channelCount(0);
+
+Channel::Channel(size_t capacity)
+{
+	size_t size = 2;
+	while (size < capacity) {
+		size *= 2;
+	}
+	cells = std::make_unique<ChannelCell[]>(size);
+	for (size_t i = 0; i < size; i++) {
+		cells[i].sequence.store(i, std::memory_order_relaxed);
+	}
+	mask = size - 1;
+	sendPosition.store(0, std::memory_order_relaxed);
+	receivePosition.store(0, std::memory_order_relaxed);
+	closed.store(false, std::memory_order_relaxed);
+}
+
+// A cell is free for the sender at position when its sequence is position,
+// and holds a value for the receiver at position when it is position + 1.
+bool Channel::trySend(Value value)
+{
+	size_t position = sendPosition.load(std::memory_order_relaxed);
+	ChannelCell* cell;
+	for (;;) {
+		cell = &cells[position & mask];
+		size_t sequence = cell->sequence.load(std::memory_order_acquire);
+		intptr_t difference = (intptr_t)sequence - (intptr_t)position;
+		if (difference == 0) {
+			if (sendPosition.compare_exchange_weak(position, position + 1, std::memory_order_relaxed)) break;
+		}
+		else if (difference < 0) {
+			return false;
+		}
+		else {
+			position = sendPosition.load(std::memory_order_relaxed);
+		}
+	}
+	cell->value = value;
+	cell->sequence.store(position + 1, std::memory_order_release);
+	return true;
+}
+
+bool Channel::tryReceive(Value* value)
+{
+	size_t position = receivePosition.load(std::memory_order_relaxed);
+	ChannelCell* cell;
+	for (;;) {
+		cell = &cells[position & mask];
+		size_t sequence = cell->sequence.load(std::memory_order_acquire);
+		intptr_t difference = (intptr_t)sequence - (intptr_t)(position + 1);
+		if (difference == 0) {
+			if (receivePosition.compare_exchange_weak(position, position + 1, std::memory_order_relaxed)) break;
+		}
+		else if (difference < 0) {
+			return false;
+		}
+		else {
+			position = receivePosition.load(std::memory_order_relaxed);
+		}
+	}
+	*value = cell->value;
+	// free again for the sender one lap later
+	cell->sequence.store(position + mask + 1, std::memory_order_release);
+	return true;
+}
+
+static void backOff(int* attempts)
+{
+	if (++*attempts > CHANNEL_SPINS) {
+		std::this_thread::yield();
+	}
+}
+
+bool Channel::send(Value value)
+{
+	for (int attempts = 0; !closed.load(std::memory_order_acquire); backOff(&attempts)) {
+		if (trySend(value)) return true;
+	}
+	return false;
+}
+
+bool Channel::receive(Value* value)
+{
+	for (int attempts = 0;; backOff(&attempts)) {
+		if (tryReceive(value)) return true;
+		// what was sent before the close is still received
+		if (closed.load(std::memory_order_acquire)) return tryReceive(value);
+	}
+}
+
+void Channel::close()
+{
+	closed.store(true, std::memory_order_release);
+}
+
+int createChannel(size_t capacity)
+{
+	int index = channelCount.fetch_add(1);
+	if (index >= CHANNELS_MAX) {
+		channelCount.store(CHANNELS_MAX);
+		return -1;
+	}
+	channels[index].store(new Channel(capacity), std::memory_order_release);
+	return index;
+}
+
+Channel* findChannel(Value id)
+{
+	if (!id.isNumber()) return nullptr;
+	double index = id.returnDouble();
+	if (!(index >= 0 && index < CHANNELS_MAX) || index != (int)index) return nullptr;
+	return channels[(int)index].load(std::memory_order_acquire);
+}
@@ -0,0 +1,60 @@
+#pragma once
+#ifndef clox_channel_h
+#include "value.h"
+#include <atomic>
+#include <cstddef>
+#include <memory>
+
+// Channels carry values between isolates (see program.h) without a lock.
+// Scripts name a channel by its index in a table shared by every isolate, and
+// use it through the natives channel, send, receive, tryReceive and close.
+// Numbers, booleans and nil are sent as they are. A string or array is copied
+// once into an object of its own when it is sent, and the receiving isolate's
+// heap takes that object over, so no heap ever holds another heap's objects.
+
+#define CHANNELS_MAX 65536
+#define CHANNEL_CAPACITY_MAX (1 << 24)
+// failed attempts before a blocked send or receive starts giving up its time slice
+#define CHANNEL_SPINS 64
+
+class ChannelCell {
+public:
+	std::atomic<size_t> sequence;
+	Value value;
+};
+
+// A bounded queue for any number of senders and receivers (Vyukov's bounded
+// MPMC queue). A sender claims the next cell with a compare and swap on
+// sendPosition and hands the value over through the cell's sequence number,
+// and a receiver does the same on receivePosition, so senders only contend
+// with senders and receivers with receivers.
+class Channel {
+public:
+	std::unique_ptr<ChannelCell[]> cells;
+	size_t mask;
+	alignas(64) std::atomic<size_t> sendPosition;
+	alignas(64) std::atomic<size_t> receivePosition;
+	alignas(64) std::atomic<bool> closed;
+
+	// capacity is rounded up to a power of two, and at least 2
+	Channel(size_t capacity);
+
+	// False when the channel is full.
+	bool trySend(Value value);
+	// False when the channel is empty.
+	bool tryReceive(Value* value);
+	// Waits while the channel is full. False once it is closed.
+	bool send(Value value);
+	// Waits while the channel is empty. False once it is closed and empty.
+	bool receive(Value* value);
+	void close();
+};
+
+// Channels live until the process exits, so an index stays valid in every
+// isolate that has it. Returns -1 once CHANNELS_MAX channels exist.
+int createChannel(size_t capacity);
+
+// nullptr when id is not the index of a channel.
+Channel* findChannel(Value id);
+
+#endif // !clox_channel_h
@@ -1,49 +1,168 @@
 #pragma once
 #include "value.h"
 #include <vector>
+#include <memory>
 #include <cinttypes>
 #include "objects.h"
 #include "tokens.h"
 #include "locals.h"
+#include "regcode.h"
+#include "jit.h"
+
+// X-macro list of every opcode in encoding order, with the number of operand
+// bytes that follow it in the code stream. The VM builds its dispatch table
+// from the same list so the two can never disagree. Operands are big endian;
+// the _LONG forms take a two byte index where the short form takes one byte.
+#define OPCODE_LIST(X) \
+	X(OP_RETURN, 0) \
+	X(OP_RETURN_VALUE, 0) \
+	X(OP_CONSTANT, 1) \
+	X(OP_CONSTANT_LONG, 2) \
+	X(OP_NIL, 0) \
+	X(OP_TRUE, 0) \
+	X(OP_FALSE, 0) \
+	X(OP_NOT, 0) \
+	X(OP_EQUAL, 0) \
+	X(OP_GREATER, 0) \
+	X(OP_LESS, 0) \
+	X(OP_NEGATE, 0) \
+	X(OP_ADD, 0) \
+	X(OP_SUB, 0) \
+	X(OP_MUL, 0) \
+	X(OP_DIV, 0) \
+	X(OP_PRINT, 0) \
+	X(OP_POP, 0) \
+	X(OP_DEFINE_GLOBAL, 1) \
+	X(OP_DEFINE_GLOBAL_LONG, 2) \
+	X(OP_GET_GLOBAL, 1) \
+	X(OP_GET_GLOBAL_LONG, 2) \
+	X(OP_SET_GLOBAL, 1) \
+	X(OP_SET_GLOBAL_LONG, 2) \
+	X(OP_GET_LOCAL, 1) \
+	X(OP_GET_LOCAL_LONG, 2) \
+	X(OP_SET_LOCAL, 1) \
+	X(OP_SET_LOCAL_LONG, 2) \
+	X(OP_JUMP_IF_FALSE, 2) \
+	X(OP_JUMP, 2) \
+	X(OP_LOOP, 2) \
+	X(OP_CALL, 1) \
+	X(OP_CALL_LONG, 2) \
+	X(OP_CALL_NATIVE, 1) \
+	X(OP_TAIL_CALL, 1) \
+	X(OP_TAIL_CALL_LONG, 2) \
+	X(OP_ADD_NUM, 0) \
+	X(OP_ADD_STR, 0) \
+	X(OP_SUB_NUM, 0) \
+	X(OP_MUL_NUM, 0) \
+	X(OP_DIV_NUM, 0) \
+	X(OP_EQUAL_NUM, 0) \
+	X(OP_GREATER_NUM, 0) \
+	X(OP_LESS_NUM, 0) \
+	X(OP_GET_LOCAL_CONSTANT, 2) \
+	X(OP_GET_GLOBAL_CONSTANT, 2) \
+	X(OP_ADD_LOCAL_LOCAL, 2) \
+	X(OP_INCREMENT_LOCAL, 2) \
+	X(OP_INCREMENT_GLOBAL, 2) \
+	X(OP_SET_LOCAL_POP, 1) \
+	X(OP_SET_GLOBAL_POP, 1) \
+	X(OP_JUMP_IF_LESS, 2) \
+	X(OP_JUMP_IF_NOT_LESS, 2) \
+	X(OP_JUMP_IF_GREATER, 2) \
+	X(OP_JUMP_IF_NOT_GREATER, 2) \
+	X(OP_JUMP_IF_EQUAL, 2) \
+	X(OP_JUMP_IF_NOT_EQUAL, 2)
+
 typedef enum {
-	OP_RETURN,
-	OP_RETURN_VALUE,
-	OP_CONSTANT,
-	OP_NIL,
-	OP_TRUE,
-	OP_FALSE,
-	OP_NOT,
-	OP_EQUAL,
-	OP_GREATER,
-	OP_LESS,
-	OP_NEGATE,
-	OP_ADD,
-	OP_SUB,
-	OP_MUL,
-	OP_DIV,
-	OP_PRINT,
-	OP_POP,
-	OP_DEFINE_GLOBAL,
-	OP_GET_GLOBAL,
-	OP_SET_GLOBAL,
-	OP_GET_LOCAL,
-	OP_SET_LOCAL,
-	OP_JUMP_IF_FALSE,
-	OP_JUMP,
-	OP_LOOP,
-	OP_CALL,
+#define OPCODE_ENUM(op, operands) op,
+	OPCODE_LIST(OPCODE_ENUM)
+#undef OPCODE_ENUM
 } OpCode;
 
+static const int opcodeOperandBytes[] = {
+#define OPCODE_OPERANDS(op, operands) operands,
+	OPCODE_LIST(OPCODE_OPERANDS)
+#undef OPCODE_OPERANDS
+};
+
+// Maps an opcode taking a one byte operand to its two byte form.
+inline int longOpcode(int opcode) {
+	switch (opcode) {
+	case OP_CONSTANT: return OP_CONSTANT_LONG;
+	case OP_DEFINE_GLOBAL: return OP_DEFINE_GLOBAL_LONG;
+	case OP_GET_GLOBAL: return OP_GET_GLOBAL_LONG;
+	case OP_SET_GLOBAL: return OP_SET_GLOBAL_LONG;
+	case OP_GET_LOCAL: return OP_GET_LOCAL_LONG;
+	case OP_SET_LOCAL: return OP_SET_LOCAL_LONG;
+	case OP_CALL: return OP_CALL_LONG;
+	case OP_TAIL_CALL: return OP_TAIL_CALL_LONG;
+	default: return opcode;
+	}
+}
+
+// The _NUM and _STR forms are never emitted by the compiler. The VM rewrites a
+// generic arithmetic or comparison opcode into one of them in place once it
+// has seen the operand types, and back again when the guard misses.
+inline int genericOpcode(int opcode) {
+	switch (opcode) {
+	case OP_ADD_NUM:
+	case OP_ADD_STR: return OP_ADD;
+	case OP_SUB_NUM: return OP_SUB;
+	case OP_MUL_NUM: return OP_MUL;
+	case OP_DIV_NUM: return OP_DIV;
+	case OP_EQUAL_NUM: return OP_EQUAL;
+	case OP_GREATER_NUM: return OP_GREATER;
+	case OP_LESS_NUM: return OP_LESS;
+	default: return opcode;
+	}
+}
+
+// Superinstructions (OP_GET_LOCAL_CONSTANT onwards) are only produced by
+// fuseSuperinstructions. The ones with two operands take two one byte
+// indexes, first the slot and then the second slot or constant.
+inline bool isForwardJump(int opcode) {
+	switch (opcode) {
+	case OP_JUMP:
+	case OP_JUMP_IF_FALSE:
+	case OP_JUMP_IF_LESS:
+	case OP_JUMP_IF_NOT_LESS:
+	case OP_JUMP_IF_GREATER:
+	case OP_JUMP_IF_NOT_GREATER:
+	case OP_JUMP_IF_EQUAL:
+	case OP_JUMP_IF_NOT_EQUAL:
+		return true;
+	default:
+		return false;
+	}
+}
+
+// Line numbers are run length encoded: one entry per run of bytes that came
+// from the same source line.
+class LineStart {
+public:
+	int offset;
+	int line;
+};
 
 class Chunk{
 public:
-	std::vector<int> opcodes;
+	std::vector<uint8_t> opcodes;
 	std::vector<Value> constants;
-	std::vector<int> lines;
+	ObjectHeap heap = ObjectHeap(1); // owns the string constants of this chunk
+	std::vector<LineStart> lines;
 	FunctionObject function;
 	std::vector<std::unique_ptr<Local>>locals = {};
 	int localCount;
 	int scopeDepth;
+	int maxStack = 0; // deepest stack use of one frame, from Compiler::computeMaxStack
+	std::vector<RegInstruction> registerCode; // empty unless compiled for the register VM
+	std::vector<int> registerLines; // source line of each register instruction
+	int registerCount = 0;
+	std::unique_ptr<JitCode> jit; // machine code once the function is hot
+	JitFunction jitEntry = nullptr; // cleared again if the machine code keeps deoptimizing
+	int callCount = 0; // counts up to JIT_CALL_THRESHOLD
+	int loopCount = 0; // back jumps, counts up to JIT_LOOP_THRESHOLD
+	bool jitAttempted = false;
+	int deoptimizations = 0;
 	int id;
 
 	Chunk(int id) {
@@ -58,14 +177,60 @@ public:
 	}
 
 	
-	void WriteChunk(int opcode,int line) {
-		opcodes.push_back(opcode);
-		lines.push_back(line);
+	void WriteChunk(uint8_t byte,int line) {
+		opcodes.push_back(byte);
+		if (lines.empty() || lines.back().line != line) {
+			lines.push_back({ (int)opcodes.size() - 1, line });
+		}
+	}
+
+	int getLine(int offset) {
+		int low = 0;
+		int high = lines.size() - 1;
+		while (low < high) {
+			int mid = (low + high + 1) / 2;
+			if (lines[mid].offset > offset) {
+				high = mid - 1;
+			}
+			else {
+				low = mid;
+			}
+		}
+		return lines.empty() ? 0 : lines[low].line;
+	}
+
+	int instructionLength(int offset) {
+		return 1 + opcodeOperandBytes[opcodes[offset]];
+	}
+
+	// Offset a jump or loop instruction at offset lands on, -1 for anything else.
+	int jumpTarget(int offset) {
+		int opcode = opcodes[offset];
+		if (opcode != OP_LOOP && !isForwardJump(opcode)) return -1;
+		int distance = (opcodes[offset + 1] << 8) | opcodes[offset + 2];
+		return opcode == OP_LOOP ? offset + 3 - distance : offset + 3 + distance;
 	}
 
 	int AddConstant(Value constant) {
 		constants.push_back(constant);
 		return constants.size()-1;
 	}
+
+	// A chunk to run this one's code in another VM. Running writes to the
+	// bytecode (quickening) and to the JIT state, so the copy has its own of
+	// both; its string constants are still the objects in this chunk's heap,
+	// which must outlive the copy.
+	std::shared_ptr<Chunk> runnableCopy() const {
+		std::shared_ptr<Chunk> copy = std::make_shared<Chunk>(id);
+		copy->opcodes = opcodes;
+		copy->constants = constants;
+		copy->lines = lines;
+		copy->function = function;
+		copy->maxStack = maxStack;
+		copy->registerCode = registerCode;
+		copy->registerLines = registerLines;
+		copy->registerCount = registerCount;
+		return copy;
+	}
 };
 
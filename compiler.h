@@ -1,9 +1,13 @@
 #pragma once
 #include <string>
 #include <vector>
-#include <functional>
 #include <unordered_map>
-#include <map>
+#include <array>
+#include <charconv>
+#include <climits>
+#include <iostream>
+#include <cstring>
+#include <string_view>
 #include "chunk.h"
 #include "tokens.h"
 #include "parser.h"
@@ -11,89 +15,193 @@
 #include "objects.h"
 #include "locals.h"
 #include "native_functions.h"
+#include "globals.h"
+#include "optimizer.h"
+#include "parallel.h"
 
 class Compiler {
 public:
-	const char* source;
+	std::string_view source; // tokens point into it, so it must outlive the compiler
 	Chunk* compiling_chunk;
 	std::shared_ptr<Chunk> compiling_chunk_shared;
 	Scanner scanner;
 	Parser parser;
 	bool had_error = 0;
-	std::map<TokenType, ParseRule> parser_rules_map;
 	std::unordered_map<std::string, std::shared_ptr<Chunk>>* functions;
-	std::unordered_map<std::string, NativeFunction>* native_functions;
-
-	Compiler(const char* source, std::unordered_map<std::string, std::shared_ptr<Chunk>>*vm_functions,std::unordered_map<std::string,NativeFunction>* native_functions) :parser(source, &scanner) {
+	std::vector<Chunk*>* function_table;
+	std::vector<NativeFunction>* native_functions;
+	GlobalTable* globals;
+	int optimizationLevel = 0;
+	bool registerBackend = false; // also translate every chunk to register code
+	OptimizerStats optimizerStats;
+	int lastCall = -1; // offset of the last OP_CALL emitted into compiling_chunk
+	int warnings = 0; // problems reported without failing the compilation
+	std::ostream* messages = &std::cout; // where the warnings go
+	int threads = 1; // more than one compiles function bodies in parallel (parallel.cpp)
+	// Set on the compilers parallel.cpp runs. The main compile declares the
+	// functions in functionSpans and skips their bodies; a body compile only
+	// reads the tables and sees the functions declared up to its own.
+	std::vector<FunctionSpan>* functionSpans = nullptr;
+	size_t nextSpan = 0;
+	bool spansMatched = true;
+	bool readOnlyTables = false;
+	bool missingGlobal = false; // a body used a global the main compile did not resolve
+	int functionLimit = INT_MAX;
+
+	Compiler(std::string_view source, std::unordered_map<std::string, std::shared_ptr<Chunk>>*vm_functions, std::vector<Chunk*>* function_table, std::vector<NativeFunction>* native_functions, GlobalTable* globals) :parser(source.data(), &scanner) {
 		this->source = source;
+		this->globals = globals;
 		this->functions = vm_functions;
+		this->function_table = function_table;
 		this->native_functions = native_functions;
 		this->compiling_chunk = functions->at("main").get();
-		this->scanner.start = source;
-		this->scanner.current = source;
-		this->scanner.line = 0;
-		parser_rules_map[TOKEN_LEFT_PAREN] = { std::bind(&Compiler::grouping, this), NULL, PREC_NONE};
-		parser_rules_map[TOKEN_RIGHT_PAREN] = { NULL,NULL,PREC_NONE };
-		parser_rules_map[TOKEN_LEFT_BRACE] = { NULL,     NULL,   PREC_NONE };
-		parser_rules_map[TOKEN_RIGHT_BRACE] = { NULL,     NULL,   PREC_NONE };
-		parser_rules_map[TOKEN_COMMA] = { NULL,     NULL,   PREC_NONE };
-		parser_rules_map[TOKEN_DOT] = { NULL,     NULL,   PREC_NONE };
-		parser_rules_map[TOKEN_MINUS] = { std::bind(&Compiler::unary,this), std::bind(&Compiler::binary,this), PREC_TERM };
-		parser_rules_map[TOKEN_PLUS] = { NULL, std::bind(&Compiler::binary,this), PREC_TERM };
-		parser_rules_map[TOKEN_SEMICOLON] = { NULL,     NULL,   PREC_NONE };
-		parser_rules_map[TOKEN_SLASH] = { NULL, std::bind(&Compiler::binary,this), PREC_FACTOR };
-		parser_rules_map[TOKEN_STAR] = { NULL, std::bind(&Compiler::binary,this), PREC_FACTOR };
-		parser_rules_map[TOKEN_BANG] = { std::bind(&Compiler::unary,this),     NULL,   PREC_NONE};
-		parser_rules_map[TOKEN_BANG_EQUAL] = { NULL,     NULL,   PREC_NONE };
-		parser_rules_map[TOKEN_EQUAL] = { NULL,     NULL,   PREC_NONE };
-		parser_rules_map[TOKEN_EQUAL_EQUAL] = { NULL,     NULL,   PREC_NONE };
-		parser_rules_map[TOKEN_GREATER] = { NULL,     NULL,   PREC_NONE };
-		parser_rules_map[TOKEN_GREATER_EQUAL] = { NULL,     NULL,   PREC_NONE };
-		parser_rules_map[TOKEN_LESS] = { NULL,     NULL,   PREC_NONE };
-		parser_rules_map[TOKEN_LESS_EQUAL] = { NULL,     NULL,   PREC_NONE };
-		parser_rules_map[TOKEN_IDENTIFIER] = { std::bind(&Compiler::variable,this),     NULL,   PREC_NONE};
-		parser_rules_map[TOKEN_STRING] = { NULL,     NULL,   PREC_NONE };
-		parser_rules_map[TOKEN_NUMBER] = { std::bind(&Compiler::number,this),   NULL,   PREC_NONE };
-		parser_rules_map[TOKEN_AND] = { NULL,std::bind(&Compiler::and_,this),PREC_AND};
-		parser_rules_map[TOKEN_CLASS] = { NULL,     NULL,   PREC_NONE };
-		parser_rules_map[TOKEN_ELSE] = { NULL,     NULL,   PREC_NONE };
-		parser_rules_map[TOKEN_FALSE] = { NULL,     NULL,   PREC_NONE };
-		parser_rules_map[TOKEN_FOR] = { NULL,     NULL,   PREC_NONE };
-		parser_rules_map[TOKEN_FUN] = { NULL,     NULL,   PREC_NONE };
-		parser_rules_map[TOKEN_IF] = { NULL,     NULL,   PREC_NONE };
-		parser_rules_map[TOKEN_NIL] = { NULL,     NULL,   PREC_NONE };
-		parser_rules_map[TOKEN_OR] = { NULL,     std::bind(&Compiler::or_,this),    PREC_OR };
-		parser_rules_map[TOKEN_PRINT] = { NULL,     NULL,   PREC_NONE };
-		parser_rules_map[TOKEN_RETURN] = { NULL,     NULL,   PREC_NONE };
-		parser_rules_map[TOKEN_SUPER] = { NULL,     NULL,   PREC_NONE };
-		parser_rules_map[TOKEN_THIS] = { NULL,     NULL,   PREC_NONE };
-		parser_rules_map[TOKEN_TRUE] = { NULL,     NULL,   PREC_NONE };
-		parser_rules_map[TOKEN_VAR] = { NULL,     NULL,   PREC_NONE };
-		parser_rules_map[TOKEN_WHILE] = { NULL,     NULL,   PREC_NONE };
-		parser_rules_map[TOKEN_ERROR] = { NULL,     NULL,   PREC_NONE };
-		parser_rules_map[TOKEN_EOF] = { NULL,     NULL,   PREC_NONE };
-		parser_rules_map[TOKEN_TRUE] = { std::bind(&Compiler::literal,this),  NULL,   PREC_NONE };
-		parser_rules_map[TOKEN_FALSE] = { std::bind(&Compiler::literal,this),  NULL,   PREC_NONE };
-		parser_rules_map[TOKEN_NIL] = { std::bind(&Compiler::literal,this),  NULL,   PREC_NONE };
-		parser_rules_map[TOKEN_BANG_EQUAL] = { NULL, std::bind(&Compiler::binary,this), PREC_EQUALITY };
-		parser_rules_map[TOKEN_EQUAL_EQUAL] = { NULL,      std::bind(&Compiler::binary,this), PREC_EQUALITY };
-		parser_rules_map[TOKEN_GREATER] = { NULL,     std::bind(&Compiler::binary,this), PREC_COMPARISON };
-		parser_rules_map[TOKEN_GREATER_EQUAL] = { NULL,      std::bind(&Compiler::binary,this), PREC_COMPARISON };
-		parser_rules_map[TOKEN_LESS] = { NULL, std::bind(&Compiler::binary,this), PREC_COMPARISON };
-		parser_rules_map[TOKEN_LESS_EQUAL] = { NULL, std::bind(&Compiler::binary,this), PREC_COMPARISON };
-		parser_rules_map[TOKEN_STRING] = { std::bind(&Compiler::string, this), NULL, PREC_NONE };
+		this->scanner.reset(source);
 	}
 
 
 	bool compile() {
+		if (threads > 1 && compileInParallel(this)) {
+			return true;
+		}
 		parser.advance();
 		while (!match(TOKEN_EOF)) {
 			declaration();
 		}
+		if (this->compiling_chunk != functions->at("main").get()) {
+			parser.error("Expect 'return' at the end of function.");
+			this->compiling_chunk = functions->at("main").get();
+		}
 		emitByte(OP_RETURN);
+		endChunk();
 		return !(this->parser.had_error);
 	}
 
+	// Runs once a chunk is fully emitted. Building with VM_NO_SUPERINSTRUCTIONS
+	// leaves the code exactly as the compiler emitted it. A chunk with a
+	// compile error is never run and may still hold unpatched jumps, so it is
+	// left alone.
+	void endChunk() {
+		Chunk* chunk = this->compiling_chunk;
+		if (this->parser.had_error) return;
+		ChunkCounts counts;
+		counts.name = chunk->function.funcName;
+		counts.compiled = countInstructions(chunk);
+		if (optimizationLevel >= 1) {
+			optimizeChunk(chunk, &optimizerStats);
+		}
+		counts.optimized = countInstructions(chunk);
+		if (registerBackend) {
+			// translated before fusion, the translator only knows the plain opcodes
+			std::vector<int> depths;
+			computeMaxStack(chunk, &depths);
+			translateToRegisters(chunk, depths, *function_table);
+		}
+		counts.registers = chunk->registerCode.size();
+#ifndef VM_NO_SUPERINSTRUCTIONS
+		fuseSuperinstructions(chunk);
+		if (optimizationLevel >= 1) {
+			// drops the POPs that fused compare-and-branch instructions jump past
+			optimizeChunk(chunk, &optimizerStats);
+		}
+#endif
+		counts.fused = countInstructions(chunk);
+		optimizerStats.chunks.push_back(counts);
+		chunk->maxStack = computeMaxStack(chunk);
+	}
+
+	// Deepest the value stack can get inside one frame of this chunk, counted
+	// from the frame's first slot. Walks every path through the bytecode once.
+	int computeMaxStack(Chunk* chunk, std::vector<int>* depths = nullptr) {
+		int size = (int)chunk->opcodes.size();
+		std::vector<int> depth(size, -1);
+		std::vector<int> pending = { 0 };
+		depth[0] = chunk->function.arity;
+		int max = depth[0];
+		while (!pending.empty()) {
+			int offset = pending.back();
+			pending.pop_back();
+			while (offset < size) {
+				int opcode = chunk->opcodes[offset];
+				int next = offset + chunk->instructionLength(offset);
+				int current = depth[offset] + stackEffect(chunk, offset);
+				if (current > max) max = current;
+				int target = chunk->jumpTarget(offset);
+				bool fallsThrough = opcode != OP_RETURN && opcode != OP_RETURN_VALUE && opcode != OP_JUMP && opcode != OP_LOOP &&
+					opcode != OP_TAIL_CALL && opcode != OP_TAIL_CALL_LONG;
+				if (target != -1 && target < size && depth[target] == -1) {
+					depth[target] = current;
+					pending.push_back(target);
+				}
+				if (!fallsThrough || next >= size || depth[next] != -1) break;
+				depth[next] = current;
+				offset = next;
+			}
+		}
+		if (depths) *depths = depth;
+		return max;
+	}
+
+	int stackEffect(Chunk* chunk, int offset) {
+		switch (chunk->opcodes[offset]) {
+		case OP_CONSTANT:
+		case OP_CONSTANT_LONG:
+		case OP_NIL:
+		case OP_TRUE:
+		case OP_FALSE:
+		case OP_GET_GLOBAL:
+		case OP_GET_GLOBAL_LONG:
+		case OP_GET_LOCAL:
+		case OP_GET_LOCAL_LONG:
+			return 1;
+		case OP_EQUAL:
+		case OP_GREATER:
+		case OP_LESS:
+		case OP_ADD:
+		case OP_SUB:
+		case OP_MUL:
+		case OP_DIV:
+		case OP_ADD_NUM:
+		case OP_ADD_STR:
+		case OP_SUB_NUM:
+		case OP_MUL_NUM:
+		case OP_DIV_NUM:
+		case OP_EQUAL_NUM:
+		case OP_GREATER_NUM:
+		case OP_LESS_NUM:
+		case OP_PRINT:
+		case OP_POP:
+		case OP_DEFINE_GLOBAL:
+		case OP_DEFINE_GLOBAL_LONG:
+		case OP_SET_LOCAL_POP:
+		case OP_SET_GLOBAL_POP:
+			return -1;
+		case OP_GET_LOCAL_CONSTANT:
+		case OP_GET_GLOBAL_CONSTANT:
+			return 2;
+		case OP_ADD_LOCAL_LOCAL:
+			return 1;
+		case OP_JUMP_IF_LESS:
+		case OP_JUMP_IF_NOT_LESS:
+		case OP_JUMP_IF_GREATER:
+		case OP_JUMP_IF_NOT_GREATER:
+		case OP_JUMP_IF_EQUAL:
+		case OP_JUMP_IF_NOT_EQUAL:
+			return -2;
+		case OP_CALL:
+			return 1 - function_table->at(chunk->opcodes[offset + 1])->function.arity;
+		case OP_CALL_LONG:
+			return 1 - function_table->at((chunk->opcodes[offset + 1] << 8) | chunk->opcodes[offset + 2])->function.arity;
+		case OP_CALL_NATIVE:
+			return 1 - native_functions->at(chunk->opcodes[offset + 1]).arguments;
+		case OP_TAIL_CALL:
+			return 1 - function_table->at(chunk->opcodes[offset + 1])->function.arity;
+		case OP_TAIL_CALL_LONG:
+			return 1 - function_table->at((chunk->opcodes[offset + 1] << 8) | chunk->opcodes[offset + 2])->function.arity;
+		default:
+			return 0;
+		}
+	}
+
 	void declaration() {
 		if (match(TOKEN_VAR)) {
 			varDeclaration();
@@ -104,11 +212,11 @@ public:
 	}
 
 	void varDeclaration() {
-		uint8_t global = parseVariable("Expect variable name.");
+		int global = parseVariable("Expect variable name.");
 
 		if (match(TOKEN_EQUAL)) {
 			if (check_function_call()) {
-				std::string function_name = std::string(parser.current.start).substr(0, parser.current.length);
+				std::string function_name = std::string(parser.current.start, parser.current.length);
 				parser.advance();
 				parser.consume(TOKEN_LEFT_PAREN, "Expect ( after function call");
 				int num_arguments = 0;
@@ -135,26 +243,32 @@ public:
 		defineVariable(global);
 	}
 
-	uint8_t parseVariable(const char* errorMessage) {
+	int parseVariable(const char* errorMessage) {
 		parser.consume(TOKEN_IDENTIFIER, errorMessage);
 		declareVariable();
 		if (this->compiling_chunk->scopeDepth > 0) return 0;
-		return identifierConstant(&parser.previous);
+		return globalSlot(&parser.previous);
 	}
 
-	uint8_t identifierConstant(Token* name) {
-		std::string identifierName = (parser.previous.start);
-		identifierName = identifierName.substr(0, parser.previous.length);
-		Value value = Value(identifierName);
-		return makeConstant(value);
+	int globalSlot(Token* name) {
+		std::string key = std::string(name->start, name->length);
+		if (readOnlyTables) {
+			int slot = globals->find(key);
+			if (slot == -1) {
+				missingGlobal = true;
+				return 0;
+			}
+			return slot;
+		}
+		return globals->resolve(key);
 	}
 
-	void defineVariable(uint8_t global) {
+	void defineVariable(int global) {
 		if (this->compiling_chunk->scopeDepth > 0) {
 			markInitialized();
 			return;
 		}
-		emitBytes(OP_DEFINE_GLOBAL, global);
+		emitOperand(OP_DEFINE_GLOBAL, global);
 	}
 
 	void declareVariable() {
@@ -168,7 +282,8 @@ public:
 					break;
 				}
 				if (identifiersEqual(&name, &local->name)) {
-					std::cout << "Same variable name exists in this scope. " << "\n";
+					*messages << "Same variable name exists in this scope. " << "\n";
+					warnings++;
 					break;
 				}
 			}
@@ -219,9 +334,18 @@ public:
 				expression();
 				parser.consume(TOKEN_SEMICOLON, "Expect ; after function declaration");
 				parser.consume(TOKEN_RIGHT_BRACE, "Expect } after function declaration");
+				// return f(...): the frame has nothing left to do once the call is
+				// made, so the callee takes it over. RETURN_VALUE stays for paths
+				// that jump past the call, like the left side of `a or f(x)`.
+				Chunk* chunk = this->compiling_chunk;
+				if (lastCall != -1 && lastCall + chunk->instructionLength(lastCall) == (int)chunk->opcodes.size()) {
+					chunk->opcodes[lastCall] = chunk->opcodes[lastCall] == OP_CALL ? OP_TAIL_CALL : OP_TAIL_CALL_LONG;
+				}
 				emitByte(OP_RETURN_VALUE);
 			}
+			endChunk();
 			this->compiling_chunk = functions->at("main").get();
+			lastCall = -1;
 		}
 		else {
 			expressionStatement();
@@ -239,21 +363,23 @@ public:
 	}
 
 	void funDeclaration() {
-		uint8_t global = parseVariable("Expect function name.");
-		std::string func_name =std::string(parser.previous.start).substr(0,parser.previous.length);
+		const char* declaration = parser.previous.start;
+		int global = parseVariable("Expect function name.");
+		std::string func_name =std::string(parser.previous.start, parser.previous.length);
 		int arity = 0;
 
 		this->compiling_chunk_shared = std::make_shared<Chunk>(10);// 10 is the id for function chunks
 		this->compiling_chunk = this->compiling_chunk_shared.get();
+		lastCall = -1;
 
 		parser.consume(TOKEN_LEFT_PAREN, "Expect '(' after function name.");
 		if (!match(TOKEN_RIGHT_PAREN)) {
-			uint8_t constant = parseVariable("Expect parameter name.");
+			int constant = parseVariable("Expect parameter name.");
 			defineVariable(constant);
 			arity++;
 			while (match(TOKEN_COMMA)) {
 				arity++;
-				uint8_t constant = parseVariable("Expect parameter name.");
+				int constant = parseVariable("Expect parameter name.");
 				defineVariable(constant);
 			}
 			parser.consume(TOKEN_RIGHT_PAREN, "Expect ')' after parameters.");
@@ -261,36 +387,105 @@ public:
 		
 		parser.consume(TOKEN_LEFT_BRACE, "Expect '{' after function declaration");
 		createFunction(func_name,arity);
+		if (functionSpans) {
+			skipFunctionBody(declaration);
+		}
 	}
 
 	void createFunction(std::string name, int arity) {
+		if (readOnlyTables) {
+			// declared by the main compile, which left the body to this compiler
+			this->compiling_chunk->function = functions->at(name)->function;
+			return;
+		}
 		FunctionObject function = FunctionObject(name,arity);
-		if (functions->count(function.funcName) != 0 || native_functions->count(name)!=0) {
-			std::cout << "redefinition of function found" << "\n";
+		if (functions->count(function.funcName) != 0 || resolveNative(name) != -1) {
+			*messages << "redefinition of function found" << "\n";
+			warnings++;
 			return;
 		}
-		
+
+		function.index = function_table->size();
 		this->compiling_chunk->function = function;
 		this->functions->insert({ function.funcName,this->compiling_chunk_shared });
+		this->function_table->push_back(this->compiling_chunk);
 	}
 
-	void call(std::string function_name, int num_arguments) {
-		if (functions->count(function_name) == 0 && native_functions->count(function_name)==0) {
-			std::cout << "Definition for " << function_name << " not found" << "\n";
+	// Leaves the body of the function just declared to a compiler of its own,
+	// resolving the globals it uses as if it had been compiled here.
+	void skipFunctionBody(const char* declaration) {
+		if (nextSpan == functionSpans->size() || (*functionSpans)[nextSpan].start != declaration) {
+			spansMatched = false;
 			return;
 		}
-		if (functions->count(function_name) != 0) {
-			if (functions->at(function_name)->function.arity != num_arguments) {
-				std::cout << "not enuf arguments supplied" << "\n";
+		FunctionSpan& span = (*functionSpans)[nextSpan++];
+		span.declared = this->compiling_chunk;
+		for (const std::string& name : span.globals) {
+			globals->resolve(name);
+		}
+		scanner.current = span.end;
+		scanner.line = span.endLine;
+		parser.advance();
+		this->compiling_chunk = functions->at("main").get();
+		lastCall = -1;
+	}
+
+	// Compiles a function declaration the main compile skipped into a chunk
+	// of its own. Null if it could not be compiled without the serial compiler.
+	std::shared_ptr<Chunk> compileFunction(const FunctionSpan& span) {
+		Chunk* main = this->compiling_chunk;
+		functionLimit = span.declared->function.index + 1;
+		scanner.current = span.start;
+		scanner.line = span.line;
+		parser.advance();
+		statement();
+		while (this->compiling_chunk != main && !check(TOKEN_EOF)) {
+			declaration();
+		}
+		if (this->compiling_chunk != main || parser.had_error || warnings != 0 || missingGlobal) {
+			return nullptr;
+		}
+		return compiling_chunk_shared;
+	}
+
+	// Calls are bound at compile time: script functions by their index in the
+	// function table, natives by their index in the native table.
+	void call(std::string function_name, int num_arguments) {
+		auto function = functions->find(function_name);
+		if (function != functions->end() && function->second->function.index < functionLimit) {
+			if (function->second->function.arity != num_arguments) {
+				*messages << "not enuf arguments supplied" << "\n";
+				warnings++;
 				return;
 			}
+			lastCall = compiling_chunk->opcodes.size();
+			emitOperand(OP_CALL, function->second->function.index);
+			return;
+		}
+		int native = resolveNative(function_name);
+		if (native == -1) {
+			*messages << "Definition for " << function_name << " not found" << "\n";
+			warnings++;
+			return;
+		}
+		if (native_functions->at(native).arguments != num_arguments) {
+			*messages << "not enuf arguments supplied" << "\n";
+			warnings++;
+			return;
+		}
+		emitBytes(OP_CALL_NATIVE, native);
+	}
+
+	int resolveNative(const std::string& name) {
+		for (int i = 0; i < (int)native_functions->size(); i++) {
+			if (native_functions->at(i).name == name) return i;
 		}
-		int func_offset = makeConstant(Value(function_name));
-		emitBytes(OP_CALL, func_offset);
+		return -1;
 	}
 
 	bool check_function_call(){
-		return (functions->count(std::string(parser.current.start).substr(0, parser.current.length)) && native_functions->count(std::string(parser.current.start).substr(0, parser.current.length)))!=0;
+		std::string name = std::string(parser.current.start, parser.current.length);
+		return (functions->count(name) && resolveNative(name) != -1);
 	}
 
 	void printStatement() {
@@ -308,7 +503,7 @@ public:
 	}
 
 	void emitByte(int byte) {
-		compiling_chunk->WriteChunk(byte, parser.previous.line);
+		compiling_chunk->WriteChunk((uint8_t)byte, parser.previous.line);
 	}
 
 	void emitBytes(int byte1, int byte2) {
@@ -316,42 +511,90 @@ public:
 		emitByte(byte2);
 	}
 
+	// Emits an instruction with an index operand, switching to the two byte
+	// _LONG form when the index does not fit in one byte.
+	void emitOperand(int opcode, int operand) {
+		if (operand <= UINT8_MAX) {
+			emitBytes(opcode, operand);
+			return;
+		}
+		if (operand > UINT16_MAX) {
+			parser.error("Too many constants or locals in one chunk.");
+			return;
+		}
+		emitByte(longOpcode(opcode));
+		emitByte((operand >> 8) & 0xff);
+		emitByte(operand & 0xff);
+	}
+
 	void expression() {
 		parsePrecedence(PREC_ASSIGNMENT);
 	}
 
+	// The Pratt parser's rules, indexed by token type. The table is a
+	// constant built by the C++ compiler, so a lookup is one array index.
+	static const ParseRule& getRule(TokenType type) {
+		static constexpr std::array<ParseRule, TOKEN_NONE + 1> rules = [] {
+			std::array<ParseRule, TOKEN_NONE + 1> rules{};
+			rules[TOKEN_LEFT_PAREN] = { &Compiler::grouping, nullptr, PREC_NONE };
+			rules[TOKEN_MINUS] = { &Compiler::unary, &Compiler::binary, PREC_TERM };
+			rules[TOKEN_PLUS] = { nullptr, &Compiler::binary, PREC_TERM };
+			rules[TOKEN_SLASH] = { nullptr, &Compiler::binary, PREC_FACTOR };
+			rules[TOKEN_STAR] = { nullptr, &Compiler::binary, PREC_FACTOR };
+			rules[TOKEN_BANG] = { &Compiler::unary, nullptr, PREC_NONE };
+			rules[TOKEN_BANG_EQUAL] = { nullptr, &Compiler::binary, PREC_EQUALITY };
+			rules[TOKEN_EQUAL_EQUAL] = { nullptr, &Compiler::binary, PREC_EQUALITY };
+			rules[TOKEN_GREATER] = { nullptr, &Compiler::binary, PREC_COMPARISON };
+			rules[TOKEN_GREATER_EQUAL] = { nullptr, &Compiler::binary, PREC_COMPARISON };
+			rules[TOKEN_LESS] = { nullptr, &Compiler::binary, PREC_COMPARISON };
+			rules[TOKEN_LESS_EQUAL] = { nullptr, &Compiler::binary, PREC_COMPARISON };
+			rules[TOKEN_IDENTIFIER] = { &Compiler::variable, nullptr, PREC_NONE };
+			rules[TOKEN_STRING] = { &Compiler::string, nullptr, PREC_NONE };
+			rules[TOKEN_NUMBER] = { &Compiler::number, nullptr, PREC_NONE };
+			rules[TOKEN_AND] = { nullptr, &Compiler::and_, PREC_AND };
+			rules[TOKEN_OR] = { nullptr, &Compiler::or_, PREC_OR };
+			rules[TOKEN_TRUE] = { &Compiler::literal, nullptr, PREC_NONE };
+			rules[TOKEN_FALSE] = { &Compiler::literal, nullptr, PREC_NONE };
+			rules[TOKEN_NIL] = { &Compiler::literal, nullptr, PREC_NONE };
+			return rules;
+		}();
+		return rules[type];
+	}
+
 	void parsePrecedence(Precedence precedence) {
 		parser.advance();
-		std::function<void()> function1 = parser_rules_map[parser.previous.type].prefix;
-		if (function1 == NULL) {
+		ParseFn prefixRule = getRule(parser.previous.type).prefix;
+		if (prefixRule == nullptr) {
 			parser.error("Expect expression.");
 			return;
 		}
-		function1();
+		(this->*prefixRule)();
 
-		while (precedence <= parser_rules_map[parser.current.type].precedence) {
+		while (precedence <= getRule(parser.current.type).precedence) {
 			parser.advance();
-			std::function<void()> infixRule = parser_rules_map[parser.previous.type].infix;
-			infixRule();
+			ParseFn infixRule = getRule(parser.previous.type).infix;
+			(this->*infixRule)();
 		}
 	}
 
 	void number() {
-		Value value =Value(strtod(parser.previous.start, NULL));
+		// strtod would read past the token, and past the end of a mapped source
+		double number = 0;
+		std::from_chars(parser.previous.start, parser.previous.start + parser.previous.length, number);
+		Value value =Value(number);
 		emitConstant(value);
 	}
 
 	void string() {
-		std::string string = (parser.previous.start + 1);
-		string = string.substr(0, parser.previous.length - 2);
-		Value value = Value(string);
+		std::string string = std::string(parser.previous.start + 1, parser.previous.length - 2);
+		Value value = Value(compiling_chunk->heap.allocateString(string));
 		emitConstant(value);
 	}
 
 	void variable() {
 
 		if (parser.current.type == TOKEN_LEFT_PAREN) {
-			std::string func_name = std::string(parser.previous.start).substr(0, parser.previous.length);
+			std::string func_name = std::string(parser.previous.start, parser.previous.length);
 			parser.consume(TOKEN_LEFT_PAREN, "Expect '('");
 			int num_arguments = 0;
 			if (!match(TOKEN_RIGHT_PAREN)) {
@@ -371,21 +614,21 @@ public:
 	}
 
 	void namedVariable(Token name) {
-		uint8_t getOp, setOp;
+		int getOp, setOp;
 		int arg = resolveLocal(&name);
 		if (arg != -1) {
 			getOp = OP_GET_LOCAL;
 			setOp = OP_SET_LOCAL;
 		}
 		else {
-			arg = identifierConstant(&name);
+			arg = globalSlot(&name);
 			getOp = OP_GET_GLOBAL;
 			setOp = OP_SET_GLOBAL;
 		}
 
 		if (match(TOKEN_EQUAL)) {
 			if (check_function_call()) {
-				std::string function_name = std::string(parser.current.start).substr(0, parser.current.length);
+				std::string function_name = std::string(parser.current.start, parser.current.length);
 				parser.advance();
 				parser.consume(TOKEN_LEFT_PAREN, "Expect ( after function call");
 				int num_arguments = 0;
@@ -403,10 +646,10 @@ public:
 			else {
 				expression();
 			}
-			emitBytes(setOp, (int)arg);
+			emitOperand(setOp, arg);
 		}
 		else {
-			emitBytes(getOp, (int)arg);
+			emitOperand(getOp, arg);
 		}
 	}
 
@@ -423,7 +666,16 @@ public:
 		return -1;
 	}
 
+	// A return ends the function it is in, so one inside a branch or loop body
+	// would leave the statement's jumps to be patched in the main chunk.
+	bool bodyEndedFunction(Chunk* chunk) {
+		if (this->compiling_chunk == chunk) return false;
+		parser.error("Expect 'return' at the end of function.");
+		return true;
+	}
+
 	void ifStatement() {
+		Chunk* chunk = compiling_chunk;
 		parser.consume(TOKEN_LEFT_PAREN, "Expect '(' after 'if'.");
 		expression();
 		parser.consume(TOKEN_RIGHT_PAREN, "Expect ')' after condition.");
@@ -431,14 +683,17 @@ public:
 		int thenJump = emitJump(OP_JUMP_IF_FALSE);
 		emitByte(OP_POP);
 		statement();
+		if (bodyEndedFunction(chunk)) return;
 		int elseJump = emitJump(OP_JUMP);
 		patchJump(thenJump);
 		emitByte(OP_POP);
 		if (match(TOKEN_ELSE)) statement();
+		if (bodyEndedFunction(chunk)) return;
 		patchJump(elseJump);
 	}
 
 	void whileStatement() {
+		Chunk* chunk = compiling_chunk;
 		int loopStart = compiling_chunk->opcodes.size();
 		parser.consume(TOKEN_LEFT_PAREN, "Expect '(' after 'while'.");
 		expression();
@@ -446,12 +701,14 @@ public:
 		int exitJump = emitJump(OP_JUMP_IF_FALSE);
 		emitByte(OP_POP);
 		statement();
+		if (bodyEndedFunction(chunk)) return;
 		emitLoop(loopStart);
 		patchJump(exitJump);
 		emitByte(OP_POP);
 	}
 
 	void forStatement() {
+		Chunk* chunk = compiling_chunk;
 		beginScope();
 		parser.consume(TOKEN_LEFT_PAREN, "Expect '(' after 'for'.");
 		if (match(TOKEN_SEMICOLON)) {
@@ -486,6 +743,7 @@ public:
 		}
 
 		statement();
+		if (bodyEndedFunction(chunk)) return;
 		emitLoop(loopStart);
 		if (exitJump != -1) {
 			patchJump(exitJump);
@@ -497,6 +755,7 @@ public:
 	void emitLoop(int start) {
 		emitByte(OP_LOOP);
 		int offset = compiling_chunk->opcodes.size() - start + 2;
+		if (offset > UINT16_MAX) parser.error("Loop body too large.");
 		emitByte((offset >> 8) & 0xff);
 		emitByte(offset & 0xff);
 	}
@@ -510,6 +769,9 @@ public:
 
 	void patchJump(int offset) {
 		int jump = compiling_chunk->opcodes.size() - offset-2;
+		if (jump > UINT16_MAX) {
+			parser.error("Too much code to jump over.");
+		}
 
 		compiling_chunk->opcodes[offset] = (jump >> 8) & 0xff;
 		compiling_chunk->opcodes[offset + 1] = jump & 0xff;
@@ -536,7 +798,7 @@ public:
 	}
 
 	void emitConstant(Value value) {
-		emitBytes(OP_CONSTANT, makeConstant(value));
+		emitOperand(OP_CONSTANT, makeConstant(value));
 	}
 
 	int makeConstant(Value value) {
@@ -560,8 +822,7 @@ public:
 	}
 	void binary() {
 		TokenType operator_type = parser.previous.type;
-		ParseRule* rule = &parser_rules_map[operator_type];
-		parsePrecedence((Precedence)(rule->precedence + 1));
+		parsePrecedence((Precedence)(getRule(operator_type).precedence + 1));
 		switch (operator_type) {
 		case TOKEN_PLUS:          emitByte(OP_ADD); break;
 		case TOKEN_MINUS:         emitByte(OP_SUB); break;
@@ -0,0 +1,483 @@
+#include "coroutine.h"
+#include "vm.h"
+#include <algorithm>
+#include <thread>
+#ifdef VM_COROUTINES
+#include <cerrno>
+#include <cstring>
+#include <fcntl.h>
+#include <sys/epoll.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+#endif
+
+Coroutine::Coroutine(int id)
+{
+	this->id = id;
+}
+
+Coroutine::~Coroutine()
+{
+	freeStacks();
+}
+
+#ifdef VM_COROUTINES
+
+void Coroutine::freeStacks()
+{
+	if (valueStack != nullptr) munmap(valueStack, STACK_MAX * sizeof(Value));
+	if (nativeStack != nullptr) munmap(nativeStack, COROUTINE_NATIVE_STACK);
+	valueStack = nullptr;
+	nativeStack = nullptr;
+	ownFrames.reset();
+	stackBase = nullptr;
+	stackTop = nullptr;
+}
+
+Scheduler::Scheduler(VM* vm)
+{
+	this->vm = vm;
+	coroutines.push_back(std::make_unique<Coroutine>(0));
+	current = coroutines[0].get();
+	current->state = COROUTINE_RUNNING;
+}
+
+Scheduler::~Scheduler()
+{
+	if (epoll >= 0) close(epoll);
+}
+
+static void wake(std::deque<Coroutine*>* ready, Coroutine* coroutine)
+{
+	if (coroutine->state == COROUTINE_WAITING) {
+		coroutine->state = COROUTINE_READY;
+		ready->push_back(coroutine);
+	}
+}
+
+// makecontext only passes ints
+static void coroutineMain(unsigned int low, unsigned int high)
+{
+	Scheduler* scheduler = (Scheduler*)(((uintptr_t)high << 32) | low);
+	scheduler->run(scheduler->current);
+}
+
+int Scheduler::spawn(Chunk* function, Value argument)
+{
+	std::unique_ptr<Coroutine> coroutine = std::make_unique<Coroutine>((int)coroutines.size());
+	coroutine->function = function;
+	coroutine->argument = argument;
+	// reserved, not committed: a coroutine only uses the pages it touches
+	coroutine->valueStack = mmap(nullptr, STACK_MAX * sizeof(Value), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+	coroutine->nativeStack = mmap(nullptr, COROUTINE_NATIVE_STACK, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE | MAP_STACK, -1, 0);
+	if (coroutine->valueStack == MAP_FAILED || coroutine->nativeStack == MAP_FAILED) {
+		if (coroutine->valueStack == MAP_FAILED) coroutine->valueStack = nullptr;
+		if (coroutine->nativeStack == MAP_FAILED) coroutine->nativeStack = nullptr;
+		std::cout << "Out of memory for a coroutine" << "\n";
+		return -1;
+	}
+	// the stack grows down into a guard page instead of into whatever is below
+	mprotect(coroutine->nativeStack, 4096, PROT_NONE);
+	coroutine->ownFrames = std::unique_ptr<CallFrame[]>(new CallFrame[FRAMES_MAX]);
+	coroutine->stackBase = (Value*)coroutine->valueStack;
+	coroutine->stackTop = coroutine->stackBase;
+	coroutine->frames = coroutine->ownFrames.get();
+	getcontext(&coroutine->context);
+	coroutine->context.uc_stack.ss_sp = coroutine->nativeStack;
+	coroutine->context.uc_stack.ss_size = COROUTINE_NATIVE_STACK;
+	coroutine->context.uc_link = nullptr;
+	uintptr_t self = (uintptr_t)this;
+	makecontext(&coroutine->context, (void (*)())coroutineMain, 2, (unsigned int)self, (unsigned int)(self >> 32));
+	ready.push_back(coroutine.get());
+	coroutines.push_back(std::move(coroutine));
+	live++;
+	return (int)coroutines.size() - 1;
+}
+
+void Scheduler::run(Coroutine* coroutine)
+{
+	if (finished != nullptr && finished != current) {
+		finished->freeStacks();
+		finished = nullptr;
+	}
+	Value result;
+	if (!vm->callFunction(coroutine->function, &coroutine->argument, &result)) {
+		result = Value();
+	}
+	coroutine->result = result;
+	coroutine->state = COROUTINE_DONE;
+	live--;
+	for (Coroutine* waiter : coroutine->waiters) {
+		wake(&ready, waiter);
+	}
+	coroutine->waiters.clear();
+	if (live == 0) {
+		wake(&ready, coroutines[0].get());
+	}
+	finished = coroutine;
+	if (!switchAway()) {
+		// the rest can never run again, and the main script is waiting on one
+		// of them: its wait fails
+		wake(&ready, coroutines[0].get());
+		switchAway();
+	}
+}
+
+void Scheduler::switchTo(Coroutine* next)
+{
+	Coroutine* previous = current;
+	previous->stackBase = vm->stackBase;
+	previous->stackTop = vm->stackTop;
+	previous->frames = vm->frames;
+	previous->frameCount = vm->frameCount;
+	vm->stackBase = next->stackBase;
+	vm->stackTop = next->stackTop;
+	vm->frames = next->frames;
+	vm->frameCount = next->frameCount;
+	current = next;
+	next->state = COROUTINE_RUNNING;
+	swapcontext(&previous->context, &next->context);
+	// running again; whoever switched back has put this coroutine's registers in the VM
+	if (finished != nullptr && finished != current) {
+		finished->freeStacks();
+		finished = nullptr;
+	}
+}
+
+bool Scheduler::switchAway()
+{
+	if (!ready.empty() && (!files.empty() || !timers.empty())) {
+		// coroutines waiting on I/O get their turn even while others are ready
+		poll(false);
+	}
+	while (ready.empty()) {
+		if (!poll(true)) return false;
+	}
+	Coroutine* next = ready.front();
+	ready.pop_front();
+	if (next == current) {
+		current->state = COROUTINE_RUNNING;
+	}
+	else {
+		switchTo(next);
+	}
+	return true;
+}
+
+bool Scheduler::poll(bool block)
+{
+	if (files.empty() && timers.empty()) return false;
+	int timeout = block ? -1 : 0;
+	if (!timers.empty() && block) {
+		auto wait = std::chrono::ceil<std::chrono::milliseconds>(timers.begin()->first - std::chrono::steady_clock::now());
+		timeout = (int)std::max<long long>(0, wait.count());
+	}
+	if (!files.empty()) {
+		epoll_event events[64];
+		int count = epoll_wait(epoll, events, 64, timeout);
+		for (int i = 0; i < count; i++) {
+			int fd = events[i].data.fd;
+			FileWaiters& waiters = files[fd];
+			uint32_t flags = events[i].events;
+			if ((flags & (EPOLLIN | EPOLLHUP | EPOLLERR)) && waiters.reader != nullptr) {
+				wake(&ready, waiters.reader);
+				waiters.reader = nullptr;
+			}
+			if ((flags & (EPOLLOUT | EPOLLHUP | EPOLLERR)) && waiters.writer != nullptr) {
+				wake(&ready, waiters.writer);
+				waiters.writer = nullptr;
+			}
+			if (waiters.reader == nullptr && waiters.writer == nullptr) {
+				epoll_ctl(epoll, EPOLL_CTL_DEL, fd, nullptr);
+				files.erase(fd);
+			}
+			else {
+				epoll_event interest = {};
+				interest.events = waiters.reader != nullptr ? EPOLLIN : EPOLLOUT;
+				interest.data.fd = fd;
+				epoll_ctl(epoll, EPOLL_CTL_MOD, fd, &interest);
+			}
+		}
+	}
+	else if (timeout > 0) {
+		std::this_thread::sleep_for(std::chrono::milliseconds(timeout));
+	}
+	auto now = std::chrono::steady_clock::now();
+	while (!timers.empty() && timers.begin()->first <= now) {
+		wake(&ready, timers.begin()->second);
+		timers.erase(timers.begin());
+	}
+	return true;
+}
+
+void Scheduler::yield()
+{
+	current->state = COROUTINE_READY;
+	ready.push_back(current);
+	switchAway();
+}
+
+bool Scheduler::await(int id, Value* result)
+{
+	if (id <= 0 || id >= (int)coroutines.size() || id == current->id) {
+		std::cout << "Incorrect coroutine for await, nill Returned " << "\n";
+		return false;
+	}
+	Coroutine* target = coroutines[id].get();
+	while (target->state != COROUTINE_DONE) {
+		if (std::find(target->waiters.begin(), target->waiters.end(), current) == target->waiters.end()) {
+			target->waiters.push_back(current);
+		}
+		current->state = COROUTINE_WAITING;
+		if (!switchAway()) {
+			target->waiters.erase(std::find(target->waiters.begin(), target->waiters.end(), current));
+			current->state = COROUTINE_RUNNING;
+			std::cout << "await would wait forever, nill Returned " << "\n";
+			return false;
+		}
+	}
+	*result = target->result;
+	return true;
+}
+
+bool Scheduler::sleep(double milliseconds)
+{
+	auto duration = std::chrono::duration<double, std::milli>(std::max(0.0, milliseconds));
+	timers.insert({ std::chrono::steady_clock::now() + std::chrono::duration_cast<std::chrono::steady_clock::duration>(duration), current });
+	current->state = COROUTINE_WAITING;
+	return switchAway();
+}
+
+void Scheduler::finish()
+{
+	while (live > 0) {
+		current->state = COROUTINE_WAITING;
+		if (!switchAway()) {
+			current->state = COROUTINE_RUNNING;
+			std::cout << live << " coroutines are waiting on something that never happens" << "\n";
+			return;
+		}
+	}
+}
+
+void Scheduler::mark()
+{
+	for (std::unique_ptr<Coroutine>& coroutine : coroutines) {
+		if (coroutine.get() != current) {
+			for (Value* slot = coroutine->stackBase; slot < coroutine->stackTop; slot++) {
+				vm->markValue(*slot);
+			}
+		}
+		vm->markValue(coroutine->argument);
+		vm->markValue(coroutine->result);
+	}
+}
+
+bool Scheduler::waitForFile(int fd, bool writing)
+{
+	if (epoll < 0) {
+		epoll = epoll_create1(EPOLL_CLOEXEC);
+		if (epoll < 0) return false;
+	}
+	bool registered = files.count(fd) != 0;
+	FileWaiters& waiters = files[fd];
+	Coroutine*& slot = writing ? waiters.writer : waiters.reader;
+	if (slot != nullptr) {
+		std::cout << "Another coroutine is already waiting on this file" << "\n";
+		return false;
+	}
+	slot = current;
+	epoll_event interest = {};
+	interest.events = (waiters.reader != nullptr ? EPOLLIN : 0) | (waiters.writer != nullptr ? EPOLLOUT : 0);
+	interest.data.fd = fd;
+	if (epoll_ctl(epoll, registered ? EPOLL_CTL_MOD : EPOLL_CTL_ADD, fd, &interest) != 0) {
+		int error = errno;
+		slot = nullptr;
+		if (!registered) files.erase(fd);
+		// a regular file cannot be polled, but never makes a read or write wait either
+		return error == EPERM;
+	}
+	current->state = COROUTINE_WAITING;
+	if (!switchAway()) {
+		current->state = COROUTINE_RUNNING;
+		slot = nullptr;
+		if (waiters.reader == nullptr && waiters.writer == nullptr) {
+			epoll_ctl(epoll, EPOLL_CTL_DEL, fd, nullptr);
+			files.erase(fd);
+		}
+		return false;
+	}
+	return true;
+}
+
+// Files the natives did not open may block; waiting until they are ready first
+// keeps the other coroutines running.
+static bool blocking(int fd)
+{
+	int flags = fcntl(fd, F_GETFL);
+	return flags >= 0 && (flags & O_NONBLOCK) == 0;
+}
+
+int Scheduler::connect(const std::string& path)
+{
+	sockaddr_un address = {};
+	address.sun_family = AF_UNIX;
+	if (path.size() >= sizeof(address.sun_path)) return -1;
+	memcpy(address.sun_path, path.c_str(), path.size() + 1);
+	int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if (fd < 0) return -1;
+	while (::connect(fd, (sockaddr*)&address, sizeof(address)) != 0) {
+		if (errno == EINTR) continue;
+		if (errno == EAGAIN) {
+			// the server's backlog is full until it accepts more
+			sleep(1);
+			continue;
+		}
+		if (errno == EINPROGRESS && waitForFile(fd, true)) {
+			int error = 0;
+			socklen_t size = sizeof(error);
+			if (getsockopt(fd, SOL_SOCKET, SO_ERROR, &error, &size) == 0 && error == 0) break;
+		}
+		close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+int Scheduler::openFile(const std::string& path, const std::string& mode)
+{
+	int flags;
+	if (mode == "r") flags = O_RDONLY;
+	else if (mode == "w") flags = O_WRONLY | O_CREAT | O_TRUNC;
+	else if (mode == "a") flags = O_WRONLY | O_CREAT | O_APPEND;
+	else return -1;
+	for (;;) {
+		int fd = open(path.c_str(), flags | O_NONBLOCK | O_CLOEXEC, 0644);
+		struct stat status;
+		if (fd >= 0 && flags == O_RDONLY && fstat(fd, &status) == 0 && S_ISFIFO(status.st_mode)) {
+			// reads see end of file until a writer opens the pipe, where a
+			// blocking open would have waited for one
+			if (!waitForFile(fd, false)) {
+				close(fd);
+				return -1;
+			}
+		}
+		if (fd >= 0) return fd;
+		// a pipe opened for writing before anyone opened it for reading
+		if (errno != ENXIO && errno != EINTR) return -1;
+		sleep(1);
+	}
+}
+
+static bool readSome(Scheduler* scheduler, int fd, std::string* data)
+{
+	if (blocking(fd) && !scheduler->waitForFile(fd, false)) return false;
+	data->resize(IO_READ_SIZE);
+	for (;;) {
+		ssize_t count = ::read(fd, &(*data)[0], IO_READ_SIZE);
+		if (count > 0) {
+			data->resize(count);
+			return true;
+		}
+		if (count == 0) return false;
+		if (errno == EINTR) continue;
+		if (errno != EAGAIN || !scheduler->waitForFile(fd, false)) return false;
+	}
+}
+
+bool Scheduler::read(int fd, std::string* data)
+{
+	auto buffer = buffers.find(fd);
+	if (buffer != buffers.end() && !buffer->second.empty()) {
+		*data = std::move(buffer->second);
+		buffers.erase(buffer);
+		return true;
+	}
+	return readSome(this, fd, data);
+}
+
+bool Scheduler::readLine(int fd, std::string* line)
+{
+	for (;;) {
+		std::string& buffer = buffers[fd];
+		size_t newline = buffer.find('\n');
+		if (newline != std::string::npos) {
+			line->assign(buffer, 0, newline);
+			buffer.erase(0, newline + 1);
+			return true;
+		}
+		std::string more;
+		if (!readSome(this, fd, &more)) {
+			// the last line may have no newline
+			std::string& rest = buffers[fd];
+			if (rest.empty()) return false;
+			*line = std::move(rest);
+			buffers.erase(fd);
+			return true;
+		}
+		buffers[fd] += more;
+	}
+}
+
+bool Scheduler::write(int fd, const std::string& data)
+{
+	size_t written = 0;
+	while (written < data.size()) {
+		if (blocking(fd) && !waitForFile(fd, true)) return false;
+		ssize_t count = ::write(fd, data.data() + written, data.size() - written);
+		if (count >= 0) {
+			written += count;
+			continue;
+		}
+		if (errno == EINTR) continue;
+		if (errno != EAGAIN || !waitForFile(fd, true)) return false;
+	}
+	return true;
+}
+
+void Scheduler::closeFile(int fd)
+{
+	auto waiting = files.find(fd);
+	if (waiting != files.end()) {
+		// their next read or write fails instead of waiting forever
+		if (waiting->second.reader != nullptr) wake(&ready, waiting->second.reader);
+		if (waiting->second.writer != nullptr) wake(&ready, waiting->second.writer);
+		epoll_ctl(epoll, EPOLL_CTL_DEL, fd, nullptr);
+		files.erase(waiting);
+	}
+	buffers.erase(fd);
+	close(fd);
+}
+
+#else
+
+static void unsupported()
+{
+	std::cout << "Coroutines are not supported on this platform" << "\n";
+}
+
+void Coroutine::freeStacks() {}
+Scheduler::Scheduler(VM* vm) { this->vm = vm; current = nullptr; }
+Scheduler::~Scheduler() {}
+int Scheduler::spawn(Chunk* function, Value argument) { unsupported(); return -1; }
+void Scheduler::yield() {}
+bool Scheduler::await(int id, Value* result) { unsupported(); return false; }
+bool Scheduler::sleep(double milliseconds) { std::this_thread::sleep_for(std::chrono::duration<double, std::milli>(milliseconds)); return true; }
+void Scheduler::finish() {}
+void Scheduler::mark() {}
+int Scheduler::connect(const std::string& path) { unsupported(); return -1; }
+int Scheduler::openFile(const std::string& path, const std::string& mode) { unsupported(); return -1; }
+bool Scheduler::read(int fd, std::string* data) { unsupported(); return false; }
+bool Scheduler::readLine(int fd, std::string* line) { unsupported(); return false; }
+bool Scheduler::write(int fd, const std::string& data) { unsupported(); return false; }
+void Scheduler::closeFile(int fd) {}
+bool Scheduler::switchAway() { return false; }
+bool Scheduler::waitForFile(int fd, bool writing) { return false; }
+bool Scheduler::poll(bool block) { return false; }
+void Scheduler::switchTo(Coroutine* next) {}
+void Scheduler::run(Coroutine* coroutine) {}
+
+#endif
@@ -0,0 +1,119 @@
+#pragma once
+#ifndef clox_coroutine_h
+#include "value.h"
+#include <chrono>
+#include <deque>
+#include <map>
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+// Coroutines (green threads) of one VM. spawn starts a script function as a
+// coroutine with a value stack, call frames and native stack of its own;
+// yield, await and the I/O natives switch to another coroutine instead of
+// blocking, and the main script is a coroutine like the others. Switching
+// saves the whole native stack (ucontext), so a coroutine can be suspended
+// anywhere, even in a function running as machine code. When nothing is
+// ready to run the scheduler waits in epoll for the files, pipes and sockets
+// coroutines are waiting on, or for the next sleep to end. Linux only: other
+// platforms have the natives but they report an error.
+#if defined(__linux__) && !defined(VM_NO_COROUTINES)
+#define VM_COROUTINES
+#include <ucontext.h>
+#endif
+
+// native stack of a coroutine, reserved but only used as it is touched
+#define COROUTINE_NATIVE_STACK (1024 * 1024)
+#define IO_READ_SIZE 65536
+
+class VM;
+class Chunk;
+class CallFrame;
+
+typedef enum {
+	COROUTINE_READY, // in the run queue
+	COROUTINE_RUNNING,
+	COROUTINE_WAITING, // on another coroutine, a file or a timer
+	COROUTINE_DONE,
+} CoroutineState;
+
+class Coroutine {
+public:
+	int id;
+	CoroutineState state = COROUTINE_READY;
+	Chunk* function = nullptr; // nullptr for the main script
+	Value argument;
+	Value result;
+	std::vector<Coroutine*> waiters; // in await on this one
+	// the VM's stack registers while this coroutine is switched out
+	Value* stackBase = nullptr;
+	Value* stackTop = nullptr;
+	CallFrame* frames = nullptr;
+	int frameCount = 0;
+	// owned by a spawned coroutine, and freed as soon as it is done
+	void* valueStack = nullptr;
+	void* nativeStack = nullptr;
+	std::unique_ptr<CallFrame[]> ownFrames;
+#ifdef VM_COROUTINES
+	ucontext_t context;
+#endif
+
+	Coroutine(int id);
+	~Coroutine();
+	void freeStacks();
+};
+
+class FileWaiters {
+public:
+	Coroutine* reader = nullptr;
+	Coroutine* writer = nullptr;
+};
+
+class Scheduler {
+public:
+	VM* vm;
+	std::vector<std::unique_ptr<Coroutine>> coroutines; // by id, the main script is 0
+	Coroutine* current;
+	std::deque<Coroutine*> ready;
+	Coroutine* finished = nullptr; // done, its stacks are freed by the next coroutine to run
+	int live = 0; // spawned and not yet done
+	int epoll = -1;
+	std::unordered_map<int, FileWaiters> files; // fds coroutines are waiting on
+	std::multimap<std::chrono::steady_clock::time_point, Coroutine*> timers;
+	std::unordered_map<int, std::string> buffers; // read ahead of readLine, by fd
+
+	Scheduler(VM* vm);
+	~Scheduler();
+
+	// A new coroutine calling function with argument, ready to run. -1 when
+	// coroutines are not supported.
+	int spawn(Chunk* function, Value argument);
+	void yield();
+	// False, after an error message, when the coroutine would wait forever.
+	bool await(int id, Value* result);
+	bool sleep(double milliseconds);
+	// Runs the other coroutines until every one is done, once the main
+	// script has finished.
+	void finish();
+	void mark();
+
+	int connect(const std::string& path);
+	int openFile(const std::string& path, const std::string& mode);
+	// false at end of file or on an error
+	bool read(int fd, std::string* data);
+	bool readLine(int fd, std::string* line);
+	bool write(int fd, const std::string& data);
+	void closeFile(int fd);
+
+	// Suspends the running coroutine, which has been put in a wait list or the
+	// run queue, and runs the next ready one, waiting for I/O or timers while
+	// none is. False when nothing could ever make a coroutine ready.
+	bool switchAway();
+	bool waitForFile(int fd, bool writing);
+	bool poll(bool block);
+	void switchTo(Coroutine* next);
+	void run(Coroutine* coroutine);
+};
+
+#endif // !clox_coroutine_h
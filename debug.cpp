@@ -1,6 +1,30 @@
 #include "debug.h"
 #include "chunk.h"
 #include <iostream>
+#include <algorithm>
+
+static const char* opcodeNames[] = {
+#define OPCODE_NAME(op, operands) #op,
+	OPCODE_LIST(OPCODE_NAME)
+#undef OPCODE_NAME
+};
+
+static const char* registerOpcodeNames[] = {
+#define OPCODE_NAME(op) #op,
+	REG_OPCODE_LIST(OPCODE_NAME)
+#undef OPCODE_NAME
+};
+
+static int readOperand(Chunk* chunk, int offset) {
+	if (opcodeOperandBytes[chunk->opcodes[offset]] == 2) {
+		return (chunk->opcodes[offset + 1] << 8) | chunk->opcodes[offset + 2];
+	}
+	return chunk->opcodes[offset + 1];
+}
+
+static void printPrefix(Chunk* chunk, int offset) {
+	std::cout << " At line = " << chunk->getLine(offset) << " At Offset " << offset << " Instruction " << opcodeNames[chunk->opcodes[offset]];
+}
 
 static int disassembleInstruction(Chunk* chunk, int opcode, int offset) {
 	if (offset == 0) {
@@ -8,121 +32,92 @@ static int disassembleInstruction(Chunk* chunk, int opcode, int offset) {
 	}
 	switch (opcode)
 	{
-	case OP_RETURN:
-		std::cout <<" At line = " << chunk->lines[offset]<<" At Offset " << offset << " Instruction " << "RETURN" << "\n";
-		return offset + 1;
+	case OP_CONSTANT:
+	case OP_CONSTANT_LONG:
+		printPrefix(chunk, offset);
+		std::cout << " = ";
+		chunk->constants[readOperand(chunk, offset)].printValue();
 		break;
 
-	case OP_RETURN_VALUE:
-		std::cout << " At line = " << chunk->lines[offset] << " At Offset " << offset << " Instruction " << "RETURN VALUE" << "\n";
-		return offset + 1;
+	case OP_DEFINE_GLOBAL:
+	case OP_DEFINE_GLOBAL_LONG:
+	case OP_GET_GLOBAL:
+	case OP_GET_GLOBAL_LONG:
+	case OP_SET_GLOBAL:
+	case OP_SET_GLOBAL_LONG:
+		printPrefix(chunk, offset);
+		std::cout << " GLOBAL " << readOperand(chunk, offset) << "\n";
 		break;
 
-	case OP_CONSTANT:
-		std::cout << " At line = " << chunk->lines[offset] << " At Offset " << offset << " Instruction " << "LOAD_CONSTANT" << " = "; 
-		chunk->constants[chunk->opcodes[offset + 1]].printValue();
-		return offset + 2;
-		break;
-	case OP_NEGATE:
-		std::cout << " At line = " << chunk->lines[offset] << " At Offset " << offset << " Instruction " << "OP_NEGATE" <<"\n";
-		return offset + 1;
-		break;
-	case OP_ADD:
-		std::cout << " At line = " << chunk->lines[offset] << " At Offset " << offset << " Instruction " << "OP_ADD" << "\n";
-		return offset + 1;
-		break;
-	case OP_SUB:
-		std::cout << " At line = " << chunk->lines[offset] << " At Offset " << offset << " Instruction " << "OP_SUB" << "\n";
-		return offset + 1;
-		break;
-	case OP_MUL:
-		std::cout << " At line = " << chunk->lines[offset] << " At Offset " << offset << " Instruction " << "OP_MUL" << "\n";
-		return offset + 1;
-		break;
-	case OP_DIV:
-		std::cout << " At line = " << chunk->lines[offset] << " At Offset " << offset << " Instruction " << "OP_DIV" << "\n";
-		return offset + 1;
-		break;
-	case OP_NIL:
-		std::cout << " At line = " << chunk->lines[offset] << " At Offset " << offset << " Instruction " << "OP_NIL" << "\n";
-		return offset + 1;
-		break;
-	case OP_FALSE:
-		std::cout << " At line = " << chunk->lines[offset] << " At Offset " << offset << " Instruction " << "OP_FALSE" << "\n";
-		return offset + 1;
-		break;
-	case OP_TRUE:
-		std::cout << " At line = " << chunk->lines[offset] << " At Offset " << offset << " Instruction " << "OP_TRUE" << "\n";
-		return offset + 1;
-		break;
-	case OP_NOT:
-		std::cout << " At line = " << chunk->lines[offset] << " At Offset " << offset << " Instruction " << "OP_NOT" << "\n";
-		return offset + 1;
-		break;
-	case OP_EQUAL:
-		std::cout << " At line = " << chunk->lines[offset] << " At Offset " << offset << " Instruction " << "OP_EQUAL" << "\n";
-		return offset + 1;
-		break;
-	case OP_GREATER:
-		std::cout << " At line = " << chunk->lines[offset] << " At Offset " << offset << " Instruction " << "OP_GREATER" << "\n";
-		return offset + 1;
-		break;
-	case OP_LESS:
-		std::cout << " At line = " << chunk->lines[offset] << " At Offset " << offset << " Instruction " << "OP_LESS" << "\n";
-		return offset + 1;
-		break;
-	case OP_PRINT:
-		std::cout << " At line = " << chunk->lines[offset] << " At Offset " << offset << " Instruction " << "OP_PRINT" << "\n";
-		return offset + 1;
-		break;
-	case OP_POP:
-		std::cout << " At line = " << chunk->lines[offset] << " At Offset " << offset << " Instruction " << "OP_POP" << "\n";
-		return offset + 1;
+	case OP_CALL:
+	case OP_CALL_LONG:
+	case OP_TAIL_CALL:
+	case OP_TAIL_CALL_LONG:
+		printPrefix(chunk, offset);
+		std::cout << " FUNCTION " << readOperand(chunk, offset) << "\n";
 		break;
-	
-	case OP_DEFINE_GLOBAL:
-		std::cout << " At line = " << chunk->lines[offset] << " At Offset " << offset << " Instruction " << "OP_DEFINE_GLOBAL" << "\n";
-		return offset + 2;
+	case OP_CALL_NATIVE:
+		printPrefix(chunk, offset);
+		std::cout << " NATIVE " << readOperand(chunk, offset) << "\n";
 		break;
-	case OP_GET_GLOBAL:
-		std::cout << " At line = " << chunk->lines[offset] << " At Offset " << offset << " Instruction " << "OP_GET_GLOBAL" << "\n";
-		return offset + 2;
+
+	case OP_GET_LOCAL:
+	case OP_GET_LOCAL_LONG:
+	case OP_SET_LOCAL:
+	case OP_SET_LOCAL_LONG:
+		printPrefix(chunk, offset);
+		std::cout << " SLOT " << readOperand(chunk, offset) << "\n";
 		break;
-	case OP_SET_GLOBAL:
-		std::cout << " At line = " << chunk->lines[offset] << " At Offset " << offset << " Instruction " << "OP_SET_GLOBAL" << "\n";
-		return offset + 2;
+
+	case OP_SET_LOCAL_POP:
+		printPrefix(chunk, offset);
+		std::cout << " SLOT " << readOperand(chunk, offset) << "\n";
 		break;
-	case OP_SET_LOCAL:
-		std::cout << " At line = " << chunk->lines[offset] << " At Offset " << offset << " Instruction " << "OP_SET_LOCAL" << "\n";
-		return offset + 2;
+	case OP_SET_GLOBAL_POP:
+		printPrefix(chunk, offset);
+		std::cout << " GLOBAL " << readOperand(chunk, offset) << "\n";
 		break;
-	case OP_GET_LOCAL:
-		std::cout << " At line = " << chunk->lines[offset] << " At Offset " << offset << " Instruction " << "OP_GET_LOCAL" << "\n";
-		return offset + 2;
+
+	case OP_GET_LOCAL_CONSTANT:
+	case OP_INCREMENT_LOCAL:
+		printPrefix(chunk, offset);
+		std::cout << " SLOT " << (int)chunk->opcodes[offset + 1] << " = ";
+		chunk->constants[chunk->opcodes[offset + 2]].printValue();
+		break;
+	case OP_GET_GLOBAL_CONSTANT:
+	case OP_INCREMENT_GLOBAL:
+		printPrefix(chunk, offset);
+		std::cout << " GLOBAL " << (int)chunk->opcodes[offset + 1] << " = ";
+		chunk->constants[chunk->opcodes[offset + 2]].printValue();
+		break;
+	case OP_ADD_LOCAL_LOCAL:
+		printPrefix(chunk, offset);
+		std::cout << " SLOTS " << (int)chunk->opcodes[offset + 1] << " " << (int)chunk->opcodes[offset + 2] << "\n";
 		break;
 
 	case OP_JUMP:
-		std::cout << " At line = " << chunk->lines[offset] << " At Offset " << offset << " Instruction " << "OP_JUMP " << "TO OFFSET "<<(uint16_t)((chunk->opcodes[offset +1] << 8) | chunk->opcodes[offset + 2])+offset+3<<"\n";
-		return offset + 3;
-		break;
 	case OP_JUMP_IF_FALSE:
-		std::cout << " At line = " << chunk->lines[offset] << " At Offset " << offset << " Instruction " << "OP_JUMP_IF_FALSE " << "TO OFFSET "<< (uint16_t)((chunk->opcodes[offset +1] << 8) | chunk->opcodes[offset + 2]) +offset+3<< "\n";
-		return offset + 3;
-		break;
 	case OP_LOOP:
-		std::cout << " At line = " << chunk->lines[offset] << " At Offset " << offset << " Instruction " << "OP_LOOP " << "TO OFFSET " << -(uint16_t)((chunk->opcodes[offset + 1] << 8) | chunk->opcodes[offset + 2]) + offset + 3 << "\n";
-		return offset + 3;
-		break;
-	case OP_CALL:
-		std::cout << " At line = " << chunk->lines[offset] << " At Offset " << offset << " Instruction " << "OP_CALL " << "\n";
-		return offset + 2;
+	case OP_JUMP_IF_LESS:
+	case OP_JUMP_IF_NOT_LESS:
+	case OP_JUMP_IF_GREATER:
+	case OP_JUMP_IF_NOT_GREATER:
+	case OP_JUMP_IF_EQUAL:
+	case OP_JUMP_IF_NOT_EQUAL:
+		printPrefix(chunk, offset);
+		std::cout << " TO OFFSET " << chunk->jumpTarget(offset) << "\n";
 		break;
 
 	default:
-		std::cout<< " At line = " << chunk->lines[offset] << " At Offset " << offset << " Instruction " << "UNKNOWN"<< "\n";
-		return offset + 1;
+		if (opcode >= (int)(sizeof(opcodeNames) / sizeof(opcodeNames[0]))) {
+			std::cout << " At line = " << chunk->getLine(offset) << " At Offset " << offset << " Instruction " << "UNKNOWN" << "\n";
+			return offset + 1;
+		}
+		printPrefix(chunk, offset);
+		std::cout << "\n";
 		break;
 	}
+	return offset + chunk->instructionLength(offset);
 }
 
 
@@ -135,6 +130,116 @@ void disassembleChunk(Chunk* chunk)
 
 }
 
+static void printRegisterOperand(Chunk* chunk, int operand)
+{
+	if (operand & REG_CONSTANT) {
+		std::cout << " K" << (operand & ~REG_CONSTANT) << "(";
+		Value value = chunk->constants[operand & ~REG_CONSTANT];
+		if (value.isNumber()) std::cout << value.returnDouble();
+		else if (value.isString()) std::cout << value.returnString();
+		else if (value.isBool()) std::cout << (value.returnBool() ? "true" : "false");
+		else std::cout << "nil";
+		std::cout << ")";
+		return;
+	}
+	std::cout << " R" << operand;
+}
 
+void disassembleRegisterCode(Chunk* chunk)
+{
+	std::cout << "Register code of " << chunk->function.funcName << ", " << chunk->registerCount << " registers\n";
+	for (int i = 0; i < (int)chunk->registerCode.size(); i++) {
+		const RegInstruction& instruction = chunk->registerCode[i];
+		std::cout << " At line = " << chunk->registerLines[i] << " At " << i << " Instruction " << registerOpcodeNames[instruction.opcode];
+		switch (instruction.opcode) {
+		case REG_MOVE:
+			std::cout << " R" << instruction.a << " R" << instruction.b;
+			break;
+		case REG_LOADK:
+			std::cout << " R" << instruction.a;
+			printRegisterOperand(chunk, instruction.b | REG_CONSTANT);
+			break;
+		case REG_GET_GLOBAL:
+			std::cout << " R" << instruction.a << " GLOBAL " << instruction.b;
+			break;
+		case REG_SET_GLOBAL:
+		case REG_DEFINE_GLOBAL:
+			std::cout << " GLOBAL " << instruction.a;
+			printRegisterOperand(chunk, instruction.b);
+			break;
+		case REG_NOT:
+		case REG_NEGATE:
+			std::cout << " R" << instruction.a;
+			printRegisterOperand(chunk, instruction.b);
+			break;
+		case REG_PRINT:
+		case REG_RETURN_VALUE:
+			printRegisterOperand(chunk, instruction.a);
+			break;
+		case REG_JUMP:
+			std::cout << " TO " << instruction.a;
+			break;
+		case REG_JUMP_IF_FALSE:
+			std::cout << " R" << instruction.b << " TO " << instruction.a;
+			break;
+		case REG_JUMP_IF_LESS:
+		case REG_JUMP_IF_NOT_LESS:
+		case REG_JUMP_IF_GREATER:
+		case REG_JUMP_IF_NOT_GREATER:
+		case REG_JUMP_IF_EQUAL:
+		case REG_JUMP_IF_NOT_EQUAL:
+			printRegisterOperand(chunk, instruction.b);
+			printRegisterOperand(chunk, instruction.c);
+			std::cout << " TO " << instruction.a;
+			break;
+		case REG_CALL:
+		case REG_TAIL_CALL:
+			std::cout << " R" << instruction.a << " FUNCTION " << instruction.b;
+			break;
+		case REG_CALL_NATIVE:
+			std::cout << " R" << instruction.a << " NATIVE " << instruction.b;
+			break;
+		case REG_RETURN:
+			break;
+		default:
+			std::cout << " R" << instruction.a;
+			printRegisterOperand(chunk, instruction.b);
+			printRegisterOperand(chunk, instruction.c);
+			break;
+		}
+		std::cout << "\n";
+	}
+}
 
+void OpcodeStats::print()
+{
+	const int opcodeCount = sizeof(opcodeNames) / sizeof(opcodeNames[0]);
+	if (registerDispatches != 0) {
+		std::cerr << "register dispatches: " << registerDispatches << "\n";
+	}
+	uint64_t total = 0;
+	for (uint64_t count : counts) total += count;
+	std::cerr << "dispatches: " << total << "\n";
+	if (total == 0) return;
 
+	std::vector<int> order;
+	for (int i = 0; i < opcodeCount; i++) {
+		if (counts[i] != 0) order.push_back(i);
+	}
+	std::sort(order.begin(), order.end(), [&](int a, int b) { return counts[a] > counts[b]; });
+	std::cerr << "opcodes:\n";
+	for (int opcode : order) {
+		std::cerr << "  " << opcodeNames[opcode] << " " << counts[opcode] << " (" << counts[opcode] * 100.0 / total << "%)\n";
+	}
+
+	order.clear();
+	for (int i = 0; i < (int)pairs.size(); i++) {
+		if (pairs[i] != 0) order.push_back(i);
+	}
+	std::sort(order.begin(), order.end(), [&](int a, int b) { return pairs[a] > pairs[b]; });
+	if (order.size() > 20) order.resize(20);
+	std::cerr << "top pairs:\n";
+	for (int pair : order) {
+		std::cerr << "  " << opcodeNames[pair / 256] << " -> " << opcodeNames[pair % 256] << " " << pairs[pair] << " (" << pairs[pair] * 100.0 / total << "%)\n";
+	}
+}
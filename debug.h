@@ -4,5 +4,25 @@
 
 
 void disassembleChunk(Chunk* chunk);
+void disassembleRegisterCode(Chunk* chunk);
+
+// Dynamic opcode and opcode pair counts, filled in by a VM built with
+// VM_OPCODE_STATS. Quickened opcodes are counted as their generic form.
+class OpcodeStats {
+public:
+	std::vector<uint64_t> counts = std::vector<uint64_t>(256);
+	std::vector<uint64_t> pairs = std::vector<uint64_t>(256 * 256);
+	int previous = -1;
+	uint64_t registerDispatches = 0; // instructions run by the register VM
+
+	void record(int opcode) {
+		opcode = genericOpcode(opcode);
+		counts[opcode]++;
+		if (previous != -1) pairs[previous * 256 + opcode]++;
+		previous = opcode;
+	}
+
+	void print();
+};
 
 #endif // !clox_debug_h
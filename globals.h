@@ -0,0 +1,43 @@
+#pragma once
+#include <string>
+#include <vector>
+#include <unordered_map>
+
+// Name <-> slot mapping for global variables. The compiler hands out a slot
+// the first time it sees a global name and emits the slot as the operand of
+// the global opcodes, so the VM reads and writes globals by index. The names
+// are kept for error messages and for code compiled later (REPL input).
+class GlobalTable {
+public:
+	std::unordered_map<std::string, int> slots;
+	std::vector<std::string> names;
+
+	int resolve(const std::string& name) {
+		auto slot = slots.find(name);
+		if (slot != slots.end()) {
+			return slot->second;
+		}
+		names.push_back(name);
+		slots.insert({ name, (int)names.size() - 1 });
+		return names.size() - 1;
+	}
+
+	// The slot of a name already resolved, or -1. Unlike resolve it never
+	// writes, so compilers on several threads may call it at once.
+	int find(const std::string& name) const {
+		auto slot = slots.find(name);
+		return slot == slots.end() ? -1 : slot->second;
+	}
+
+	// Forgets the names resolved after the first size.
+	void truncate(int size) {
+		while ((int)names.size() > size) {
+			slots.erase(names.back());
+			names.pop_back();
+		}
+	}
+
+	int size() {
+		return names.size();
+	}
+};
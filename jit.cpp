@@ -0,0 +1,725 @@
+#include "jit.h"
+#include "vm.h"
+
+#ifdef VM_JIT
+#include <sys/mman.h>
+#include <unistd.h>
+#include <cstring>
+#include <map>
+
+JitCode::~JitCode()
+{
+	if (memory != nullptr) munmap(memory, size);
+}
+
+typedef enum { RAX, RCX, RDX, RBX, RSP, RBP, RSI, RDI, R8, R9, R10, R11, R12, R13, R14, R15 } X64Register;
+
+// condition codes of jcc and setcc
+typedef enum { CC_B = 0x2, CC_AE = 0x3, CC_E = 0x4, CC_NE = 0x5, CC_BE = 0x6, CC_A = 0x7, CC_P = 0xA, CC_NP = 0xB } X64Condition;
+
+// opcodes of the "op r/m64, r64" forms
+typedef enum { ALU_ADD = 0x01, ALU_AND = 0x21, ALU_XOR = 0x31, ALU_CMP = 0x39, ALU_TEST = 0x85 } X64Alu;
+
+// opcodes of the scalar double instructions
+typedef enum { SSE_ADD = 0x58, SSE_MUL = 0x59, SSE_SUB = 0x5C, SSE_DIV = 0x5E } X64Sse;
+
+// Encodes the few x86-64 instructions the JIT needs. Memory operands are
+// always [base + disp32].
+class Assembler {
+public:
+	std::vector<uint8_t> code;
+
+	void byte(uint8_t value) {
+		code.push_back(value);
+	}
+
+	void int32(int32_t value) {
+		for (int i = 0; i < 4; i++) byte((uint32_t)value >> (8 * i));
+	}
+
+	void int64(uint64_t value) {
+		for (int i = 0; i < 8; i++) byte(value >> (8 * i));
+	}
+
+	void rex(int reg, int rm) {
+		byte(0x48 | ((reg & 8) ? 4 : 0) | ((rm & 8) ? 1 : 0));
+	}
+
+	void direct(int reg, int rm) {
+		byte(0xC0 | ((reg & 7) << 3) | (rm & 7));
+	}
+
+	void memory(int reg, int base, int32_t disp) {
+		byte(0x80 | ((reg & 7) << 3) | (base & 7));
+		if ((base & 7) == RSP) byte(0x24);
+		int32(disp);
+	}
+
+	void push(int reg) {
+		if (reg & 8) byte(0x41);
+		byte(0x50 | (reg & 7));
+	}
+
+	void pop(int reg) {
+		if (reg & 8) byte(0x41);
+		byte(0x58 | (reg & 7));
+	}
+
+	void movImmediate(int reg, uint64_t value) {
+		rex(0, reg);
+		byte(0xB8 | (reg & 7));
+		int64(value);
+	}
+
+	// zero extends, reg must be one of the first eight
+	void movImmediate32(int reg, uint32_t value) {
+		byte(0xB8 | reg);
+		int32(value);
+	}
+
+	void load(int reg, int base, int32_t disp) {
+		rex(reg, base);
+		byte(0x8B);
+		memory(reg, base, disp);
+	}
+
+	void store(int base, int32_t disp, int reg) {
+		rex(reg, base);
+		byte(0x89);
+		memory(reg, base, disp);
+	}
+
+	void move(int destination, int source) {
+		alu(0x89, destination, source);
+	}
+
+	void alu(int opcode, int destination, int source) {
+		rex(source, destination);
+		byte(opcode);
+		direct(source, destination);
+	}
+
+	void addImmediate(int reg, int32_t value) {
+		rex(0, reg);
+		byte(0x81);
+		direct(0, reg);
+		int32(value);
+	}
+
+	void movqToXmm(int xmm, int reg) {
+		byte(0x66);
+		rex(xmm, reg);
+		byte(0x0F);
+		byte(0x6E);
+		direct(xmm, reg);
+	}
+
+	void movqFromXmm(int reg, int xmm) {
+		byte(0x66);
+		rex(xmm, reg);
+		byte(0x0F);
+		byte(0x7E);
+		direct(xmm, reg);
+	}
+
+	// xmm0 to xmm7 only
+	void sse(int opcode, int destination, int source) {
+		byte(0xF2);
+		byte(0x0F);
+		byte(opcode);
+		direct(destination, source);
+	}
+
+	void ucomisd(int left, int right) {
+		byte(0x66);
+		byte(0x0F);
+		byte(0x2E);
+		direct(left, right);
+	}
+
+	// al to bl only
+	void setcc(int condition, int reg) {
+		byte(0x0F);
+		byte(0x90 | condition);
+		direct(0, reg);
+	}
+
+	void movzxByte(int destination, int source) {
+		byte(0x0F);
+		byte(0xB6);
+		direct(destination, source);
+	}
+
+	void andByte(int destination, int source) {
+		byte(0x20);
+		direct(source, destination);
+	}
+
+	void testByte(int reg) {
+		byte(0x84);
+		direct(reg, reg);
+	}
+
+	void callAbsolute(const void* function) {
+		movImmediate(RAX, (uint64_t)(uintptr_t)function);
+		byte(0xFF);
+		direct(2, RAX);
+	}
+
+	void ret() {
+		byte(0xC3);
+	}
+
+	void jumpRegister(int reg) {
+		if (reg & 8) byte(0x41);
+		byte(0xFF);
+		direct(4, reg);
+	}
+
+	// Jumps return where their rel32 is, for patch.
+	int jump() {
+		byte(0xE9);
+		int32(0);
+		return code.size() - 4;
+	}
+
+	int jumpIf(int condition) {
+		byte(0x0F);
+		byte(0x80 | condition);
+		int32(0);
+		return code.size() - 4;
+	}
+
+	void patch(int at, int target) {
+		int32_t distance = target - (at + 4);
+		memcpy(&code[at], &distance, sizeof(distance));
+	}
+
+	void jumpTo(int target) {
+		patch(jump(), target);
+	}
+};
+
+// Called from machine code. A guard failed at offset: hand the frame to the
+// interpreter there.
+static void jitDeoptimize(VM* vm, Value* sp, int offset)
+{
+	CallFrame* frame = &vm->frames[vm->frameCount - 1];
+	frame->ip = frame->chunk->opcodes.data() + offset;
+	vm->stackTop = sp;
+	if (++frame->chunk->deoptimizations == JIT_MAX_DEOPTIMIZATIONS) {
+		// activations already running keep using the code, so it stays mapped
+		frame->chunk->jitEntry = nullptr;
+	}
+}
+
+static bool jitCall(VM* vm, Value* sp, int function)
+{
+	return vm->callFromJit(sp, function);
+}
+
+// The callee takes over the running frame; see VM::tailCall.
+static bool jitTailCall(VM* vm, Value* sp, int function)
+{
+	Chunk* callee = vm->vm_function_table[function];
+	CallFrame* frame = &vm->frames[vm->frameCount - 1];
+	if (!vm->tailCall(frame, callee, sp)) return false;
+	vm->stackTop = frame->slots + callee->function.arity;
+	if (callee->jitEntry == nullptr) vm->profileCall(callee);
+	return true;
+}
+
+static JitFunction jitEntryOf(VM* vm, int function)
+{
+	return vm->vm_function_table[function]->jitEntry;
+}
+
+static void jitCallNative(VM* vm, Value* sp, int index)
+{
+	NativeFunction& native = vm->vm_native_functions[index];
+	Value* arguments = sp - native.arguments;
+	vm->stackTop = sp;
+	*arguments = native.function(vm, native.arguments, arguments);
+}
+
+static void jitPrint(uint64_t bits)
+{
+	Value value;
+	value.bits = bits;
+	value.printValue();
+	std::cout << "\n";
+}
+
+static uint64_t valueBits(Value value)
+{
+	return value.bits;
+}
+
+// Translates one chunk. While the code runs rbx holds the VM, r12 the frame
+// slots, r13 the stack top, r14 QNAN for number checks and r15 the globals;
+// all of them are callee saved, so helpers can be called directly.
+class JitCompiler {
+public:
+	VM* vm;
+	Chunk* chunk;
+	Assembler a;
+	std::vector<int> labels; // machine code offset of each bytecode offset
+	std::vector<std::pair<int, int>> jumps; // rel32, bytecode offset it goes to
+	std::map<int, std::vector<int>> exits; // bytecode offset to resume at, rel32s going there
+	std::vector<int> errors; // rel32s going to the error return
+
+	JitCompiler(VM* vm, Chunk* chunk) : vm(vm), chunk(chunk) {}
+
+	static int32_t slot(int index) {
+		return index * (int32_t)sizeof(Value);
+	}
+
+	void push(int reg) {
+		a.store(R13, 0, reg);
+		a.addImmediate(R13, slot(1));
+	}
+
+	void epilogue() {
+		a.pop(R15);
+		a.pop(R14);
+		a.pop(R13);
+		a.pop(R12);
+		a.pop(RBX);
+		a.ret();
+	}
+
+	void exitIf(int condition, int offset) {
+		exits[offset].push_back(a.jumpIf(condition));
+	}
+
+	void exitAlways(int offset) {
+		exits[offset].push_back(a.jump());
+	}
+
+	void guardNumber(int reg, int offset) {
+		a.move(RCX, reg);
+		a.alu(ALU_AND, RCX, R14);
+		a.alu(ALU_CMP, RCX, R14);
+		exitIf(CC_E, offset);
+	}
+
+	void guardDefined(int reg, int offset) {
+		a.movImmediate(RCX, valueBits(Value::undefined()));
+		a.alu(ALU_CMP, reg, RCX);
+		exitIf(CC_E, offset);
+	}
+
+	// The two operands on top of the stack into xmm0 and xmm1.
+	void loadNumbers(int offset) {
+		a.load(RAX, R13, -slot(2));
+		a.load(RDX, R13, -slot(1));
+		guardNumber(RAX, offset);
+		guardNumber(RDX, offset);
+		a.movqToXmm(0, RAX);
+		a.movqToXmm(1, RDX);
+	}
+
+	void arithmetic(int operation, int offset) {
+		loadNumbers(offset);
+		if (operation == SSE_DIV) {
+			// 0 and -0 both become 0 when the sign is shifted out; the interpreter reports the error
+			a.alu(ALU_ADD, RDX, RDX);
+			exitIf(CC_E, offset);
+		}
+		a.sse(operation, 0, 1);
+		a.movqFromXmm(RAX, 0);
+		a.store(R13, -slot(2), RAX);
+		a.addImmediate(R13, -slot(1));
+	}
+
+	// Replaces the two operands with the bool in al.
+	void storeBool() {
+		a.movzxByte(RAX, RAX);
+		a.movImmediate(RCX, valueBits(Value(false)));
+		a.alu(ALU_ADD, RAX, RCX);
+		a.store(R13, -slot(2), RAX);
+		a.addImmediate(R13, -slot(1));
+	}
+
+	// ucomisd leaves ZF and PF both set for NaN, which must compare unequal
+	void setEqual() {
+		a.setcc(CC_E, RAX);
+		a.setcc(CC_NP, RCX);
+		a.andByte(RAX, RCX);
+	}
+
+	// Branches on nil, false, 0 and -0; reg is clobbered. Returns the rel32s.
+	std::vector<int> branchIfFalsey(int reg) {
+		std::vector<int> branches;
+		a.movImmediate(RCX, valueBits(Value()));
+		a.alu(ALU_CMP, reg, RCX);
+		branches.push_back(a.jumpIf(CC_E));
+		a.movImmediate(RCX, valueBits(Value(false)));
+		a.alu(ALU_CMP, reg, RCX);
+		branches.push_back(a.jumpIf(CC_E));
+		a.alu(ALU_ADD, reg, reg);
+		branches.push_back(a.jumpIf(CC_E));
+		return branches;
+	}
+
+	void jumpTo(int condition, int target) {
+		jumps.push_back({ condition == -1 ? a.jump() : a.jumpIf(condition), target });
+	}
+
+	// Fused compare and jump: pops both operands, then jumps on condition.
+	void compareAndJump(int offset, bool less, int condition) {
+		loadNumbers(offset);
+		a.addImmediate(R13, -slot(2));
+		if (less) a.ucomisd(1, 0);
+		else a.ucomisd(0, 1);
+		jumpTo(condition, chunk->jumpTarget(offset));
+	}
+
+	bool compileInstruction(int offset) {
+		int opcode = chunk->opcodes[offset];
+		int operand = 0;
+		if (opcodeOperandBytes[opcode] == 2) operand = (chunk->opcodes[offset + 1] << 8) | chunk->opcodes[offset + 2];
+		else if (opcodeOperandBytes[opcode] == 1) operand = chunk->opcodes[offset + 1];
+		uint8_t first = opcodeOperandBytes[opcode] == 2 ? chunk->opcodes[offset + 1] : 0;
+		uint8_t second = opcodeOperandBytes[opcode] == 2 ? chunk->opcodes[offset + 2] : 0;
+
+		switch (genericOpcode(opcode)) {
+		case OP_CONSTANT:
+		case OP_CONSTANT_LONG:
+			a.movImmediate(RAX, valueBits(chunk->constants[operand]));
+			push(RAX);
+			break;
+		case OP_NIL:
+			a.movImmediate(RAX, valueBits(Value()));
+			push(RAX);
+			break;
+		case OP_TRUE:
+			a.movImmediate(RAX, valueBits(Value(true)));
+			push(RAX);
+			break;
+		case OP_FALSE:
+			a.movImmediate(RAX, valueBits(Value(false)));
+			push(RAX);
+			break;
+		case OP_POP:
+			a.addImmediate(R13, -slot(1));
+			break;
+
+		case OP_GET_LOCAL:
+		case OP_GET_LOCAL_LONG:
+			a.load(RAX, R12, slot(operand));
+			push(RAX);
+			break;
+		case OP_SET_LOCAL:
+		case OP_SET_LOCAL_LONG:
+			a.load(RAX, R13, -slot(1));
+			a.store(R12, slot(operand), RAX);
+			break;
+		case OP_SET_LOCAL_POP:
+			a.load(RAX, R13, -slot(1));
+			a.store(R12, slot(operand), RAX);
+			a.addImmediate(R13, -slot(1));
+			break;
+
+		case OP_GET_GLOBAL:
+		case OP_GET_GLOBAL_LONG:
+			a.load(RAX, R15, slot(operand));
+			guardDefined(RAX, offset);
+			push(RAX);
+			break;
+		case OP_SET_GLOBAL:
+		case OP_SET_GLOBAL_LONG:
+			a.load(RAX, R13, -slot(1));
+			a.store(R15, slot(operand), RAX);
+			break;
+		case OP_DEFINE_GLOBAL:
+		case OP_DEFINE_GLOBAL_LONG:
+		case OP_SET_GLOBAL_POP:
+			a.load(RAX, R13, -slot(1));
+			a.store(R15, slot(operand), RAX);
+			a.addImmediate(R13, -slot(1));
+			break;
+
+		case OP_ADD: arithmetic(SSE_ADD, offset); break;
+		case OP_SUB: arithmetic(SSE_SUB, offset); break;
+		case OP_MUL: arithmetic(SSE_MUL, offset); break;
+		case OP_DIV: arithmetic(SSE_DIV, offset); break;
+
+		case OP_LESS:
+			loadNumbers(offset);
+			a.ucomisd(1, 0);
+			a.setcc(CC_A, RAX);
+			storeBool();
+			break;
+		case OP_GREATER:
+			loadNumbers(offset);
+			a.ucomisd(0, 1);
+			a.setcc(CC_A, RAX);
+			storeBool();
+			break;
+		case OP_EQUAL:
+			loadNumbers(offset);
+			a.ucomisd(0, 1);
+			setEqual();
+			storeBool();
+			break;
+
+		case OP_NEGATE:
+			a.load(RAX, R13, -slot(1));
+			guardNumber(RAX, offset);
+			a.movImmediate(RCX, SIGN_BIT);
+			a.alu(ALU_XOR, RAX, RCX);
+			a.store(R13, -slot(1), RAX);
+			break;
+		case OP_NOT: {
+			a.load(RAX, R13, -slot(1));
+			// any object exits, the interpreter decides what NOT does with it
+			a.move(RDX, RAX);
+			a.movImmediate(RCX, QNAN | SIGN_BIT);
+			a.alu(ALU_AND, RDX, RCX);
+			a.alu(ALU_CMP, RDX, RCX);
+			exitIf(CC_E, offset);
+			std::vector<int> falsey = branchIfFalsey(RAX);
+			a.movImmediate(RAX, valueBits(Value(false)));
+			int done = a.jump();
+			for (int branch : falsey) a.patch(branch, a.code.size());
+			a.movImmediate(RAX, valueBits(Value(true)));
+			a.patch(done, a.code.size());
+			a.store(R13, -slot(1), RAX);
+			break;
+		}
+
+		case OP_PRINT:
+			a.load(RDI, R13, -slot(1));
+			a.addImmediate(R13, -slot(1));
+			a.callAbsolute((const void*)&jitPrint);
+			break;
+
+		case OP_JUMP:
+		case OP_LOOP:
+			jumpTo(-1, chunk->jumpTarget(offset));
+			break;
+		case OP_JUMP_IF_FALSE: {
+			a.load(RAX, R13, -slot(1));
+			std::vector<int> falsey = branchIfFalsey(RAX);
+			for (int branch : falsey) jumps.push_back({ branch, chunk->jumpTarget(offset) });
+			break;
+		}
+		case OP_JUMP_IF_LESS: compareAndJump(offset, true, CC_A); break;
+		case OP_JUMP_IF_NOT_LESS: compareAndJump(offset, true, CC_BE); break;
+		case OP_JUMP_IF_GREATER: compareAndJump(offset, false, CC_A); break;
+		case OP_JUMP_IF_NOT_GREATER: compareAndJump(offset, false, CC_BE); break;
+		case OP_JUMP_IF_EQUAL:
+		case OP_JUMP_IF_NOT_EQUAL:
+			loadNumbers(offset);
+			a.addImmediate(R13, -slot(2));
+			a.ucomisd(0, 1);
+			if (opcode == OP_JUMP_IF_EQUAL) {
+				int unordered = a.jumpIf(CC_P);
+				jumpTo(CC_E, chunk->jumpTarget(offset));
+				a.patch(unordered, a.code.size());
+			}
+			else {
+				jumpTo(CC_P, chunk->jumpTarget(offset));
+				jumpTo(CC_NE, chunk->jumpTarget(offset));
+			}
+			break;
+
+		case OP_GET_LOCAL_CONSTANT:
+			a.load(RAX, R12, slot(first));
+			a.store(R13, 0, RAX);
+			a.movImmediate(RAX, valueBits(chunk->constants[second]));
+			a.store(R13, slot(1), RAX);
+			a.addImmediate(R13, slot(2));
+			break;
+		case OP_GET_GLOBAL_CONSTANT:
+			a.load(RAX, R15, slot(first));
+			guardDefined(RAX, offset);
+			a.store(R13, 0, RAX);
+			a.movImmediate(RAX, valueBits(chunk->constants[second]));
+			a.store(R13, slot(1), RAX);
+			a.addImmediate(R13, slot(2));
+			break;
+		case OP_ADD_LOCAL_LOCAL:
+			a.load(RAX, R12, slot(first));
+			a.load(RDX, R12, slot(second));
+			guardNumber(RAX, offset);
+			guardNumber(RDX, offset);
+			a.movqToXmm(0, RAX);
+			a.movqToXmm(1, RDX);
+			a.sse(SSE_ADD, 0, 1);
+			a.movqFromXmm(RAX, 0);
+			push(RAX);
+			break;
+		case OP_INCREMENT_LOCAL:
+		case OP_INCREMENT_GLOBAL: {
+			int base = opcode == OP_INCREMENT_LOCAL ? R12 : R15;
+			Value constant = chunk->constants[second];
+			if (!constant.isNumber()) {
+				exitAlways(offset);
+				break;
+			}
+			// an undefined global is not a number either
+			a.load(RAX, base, slot(first));
+			guardNumber(RAX, offset);
+			a.movqToXmm(0, RAX);
+			a.movImmediate(RDX, valueBits(constant));
+			a.movqToXmm(1, RDX);
+			a.sse(SSE_ADD, 0, 1);
+			a.movqFromXmm(RAX, 0);
+			a.store(base, slot(first), RAX);
+			break;
+		}
+
+		case OP_CALL:
+		case OP_CALL_LONG: {
+			a.move(RDI, RBX);
+			a.move(RSI, R13);
+			a.movImmediate32(RDX, operand);
+			a.callAbsolute((const void*)&jitCall);
+			a.testByte(RAX);
+			errors.push_back(a.jumpIf(CC_E));
+			// the result replaces the arguments
+			a.addImmediate(R13, -slot(vm->vm_function_table[operand]->function.arity - 1));
+			break;
+		}
+		case OP_TAIL_CALL:
+		case OP_TAIL_CALL_LONG: {
+			a.move(RDI, RBX);
+			a.move(RSI, R13);
+			a.movImmediate32(RDX, operand);
+			a.callAbsolute((const void*)&jitTailCall);
+			a.testByte(RAX);
+			errors.push_back(a.jumpIf(CC_E));
+			a.move(RDI, RBX);
+			a.movImmediate32(RSI, operand);
+			a.callAbsolute((const void*)&jitEntryOf);
+			// an interpreted callee: the interpreter picks the frame up at its start
+			a.alu(ALU_TEST, RAX, RAX);
+			int compiled = a.jumpIf(CC_NE);
+			a.movImmediate32(RAX, JIT_DEOPTIMIZED);
+			epilogue();
+			// a compiled one is jumped to with our own return address, so
+			// tail recursion does not grow the machine stack either
+			a.patch(compiled, a.code.size());
+			a.move(RDI, R12);
+			a.move(RSI, R15);
+			a.move(RDX, RBX);
+			a.move(RCX, R12);
+			a.addImmediate(RCX, slot(vm->vm_function_table[operand]->function.arity));
+			a.alu(ALU_XOR, R8, R8);
+			a.pop(R15);
+			a.pop(R14);
+			a.pop(R13);
+			a.pop(R12);
+			a.pop(RBX);
+			a.jumpRegister(RAX);
+			break;
+		}
+		case OP_CALL_NATIVE:
+			a.move(RDI, RBX);
+			a.move(RSI, R13);
+			a.movImmediate32(RDX, operand);
+			a.callAbsolute((const void*)&jitCallNative);
+			a.addImmediate(R13, -slot(vm->vm_native_functions[operand].arguments - 1));
+			break;
+
+		case OP_RETURN:
+			a.movImmediate(RAX, valueBits(Value()));
+			a.store(R12, 0, RAX);
+			a.movImmediate32(RAX, JIT_RETURNED);
+			epilogue();
+			break;
+		case OP_RETURN_VALUE:
+			a.load(RAX, R13, -slot(1));
+			a.store(R12, 0, RAX);
+			a.movImmediate32(RAX, JIT_RETURNED);
+			epilogue();
+			break;
+
+		default:
+			return false;
+		}
+		return true;
+	}
+
+	bool compile() {
+		labels.assign(chunk->opcodes.size() + 1, -1);
+		a.push(RBX);
+		a.push(R12);
+		a.push(R13);
+		a.push(R14);
+		a.push(R15);
+		a.move(R12, RDI);
+		a.move(R15, RSI);
+		a.move(RBX, RDX);
+		a.move(R13, RCX);
+		a.movImmediate(R14, QNAN);
+		a.alu(ALU_TEST, R8, R8);
+		int fromStart = a.jumpIf(CC_E);
+		a.jumpRegister(R8);
+		a.patch(fromStart, a.code.size());
+
+		for (int offset = 0; offset < (int)chunk->opcodes.size(); offset += chunk->instructionLength(offset)) {
+			labels[offset] = a.code.size();
+			if (!compileInstruction(offset)) return false;
+		}
+		for (auto& jump : jumps) {
+			if (labels[jump.second] == -1) return false;
+			a.patch(jump.first, labels[jump.second]);
+		}
+
+		int error = a.code.size();
+		a.movImmediate32(RAX, JIT_ERROR);
+		epilogue();
+		for (int branch : errors) a.patch(branch, error);
+
+		int deoptimize = a.code.size();
+		a.move(RDI, RBX);
+		a.move(RSI, R13);
+		a.callAbsolute((const void*)&jitDeoptimize);
+		a.movImmediate32(RAX, JIT_DEOPTIMIZED);
+		epilogue();
+		for (auto& exit : exits) {
+			for (int branch : exit.second) a.patch(branch, a.code.size());
+			a.movImmediate32(RDX, exit.first);
+			a.jumpTo(deoptimize);
+		}
+		return true;
+	}
+};
+
+std::unique_ptr<JitCode> jitCompile(VM* vm, Chunk* chunk)
+{
+	JitCompiler compiler(vm, chunk);
+	if (!compiler.compile()) return nullptr;
+
+	size_t pageSize = sysconf(_SC_PAGESIZE);
+	size_t size = (compiler.a.code.size() + pageSize - 1) / pageSize * pageSize;
+	void* memory = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (memory == MAP_FAILED) return nullptr;
+	memcpy(memory, compiler.a.code.data(), compiler.a.code.size());
+	if (mprotect(memory, size, PROT_READ | PROT_EXEC) != 0) {
+		munmap(memory, size);
+		return nullptr;
+	}
+	std::unique_ptr<JitCode> code = std::make_unique<JitCode>();
+	code->memory = memory;
+	code->size = size;
+	code->entry = (JitFunction)memory;
+	code->labels = std::move(compiler.labels);
+	return code;
+}
+
+#else
+
+JitCode::~JitCode()
+{
+}
+
+std::unique_ptr<JitCode> jitCompile(VM* vm, Chunk* chunk)
+{
+	return nullptr;
+}
+
+#endif
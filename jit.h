@@ -0,0 +1,60 @@
+#pragma once
+#ifndef clox_jit_h
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+// Baseline JIT for x86-64 Linux. A function that has been called
+// JIT_CALL_THRESHOLD times, or whose loops have jumped back
+// JIT_LOOP_THRESHOLD times, is translated opcode by opcode into machine code
+// that keeps the interpreter's value stack and frame layout. So whenever a
+// guard fails (an operand that is not a number, an undefined global, ...)
+// the machine code can hand the frame back to the interpreter at the same
+// bytecode offset, and a frame running in the interpreter can move into the
+// machine code at any instruction, which is how a hot loop switches over in
+// the middle (on-stack replacement). Define VM_NO_JIT to build without it.
+#if defined(__x86_64__) && defined(__linux__) && !defined(VM_NO_JIT)
+#define VM_JIT
+#endif
+
+#define JIT_CALL_THRESHOLD 100
+#define JIT_LOOP_THRESHOLD 1000
+// a function whose guards keep failing goes back to being interpreted
+#define JIT_MAX_DEOPTIMIZATIONS 100
+
+class VM;
+class Chunk;
+class Value;
+
+typedef enum {
+	JIT_RETURNED, // the result is in slot 0 of the frame
+	JIT_DEOPTIMIZED, // frame ip and VM::stackTop say where to carry on interpreting
+	JIT_ERROR, // a runtime error has been reported
+} JitStatus;
+
+// slots is the frame base, globals VM::vm_globals.data() and sp the stack
+// top. start is nullptr to run the function from its beginning, otherwise
+// JitCode::address of the instruction to carry on at.
+typedef int (*JitFunction)(Value* slots, Value* globals, VM* vm, Value* sp, const void* start);
+
+// Machine code of one function, in its own executable mapping.
+class JitCode {
+public:
+	void* memory = nullptr;
+	size_t size = 0;
+	JitFunction entry = nullptr;
+	std::vector<int> labels; // offset into memory of each bytecode offset
+
+	const void* address(int offset) {
+		return (const uint8_t*)memory + labels[offset];
+	}
+
+	~JitCode();
+};
+
+// Returns nullptr when the function uses an opcode the JIT does not handle
+// or the platform has no JIT.
+std::unique_ptr<JitCode> jitCompile(VM* vm, Chunk* chunk);
+
+#endif // !clox_jit_h
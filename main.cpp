@@ -4,42 +4,353 @@
 #include "debug.h"
 #include "vm.h"
 #include "compiler.h"
-#include <fstream>
-#include <sstream>
+#include "mapped_file.h"
+#include "channel.h"
+#include "worker_pool.h"
+#include "server.h"
+#include <string_view>
+#include <chrono>
+#include <thread>
+#include <algorithm>
+#include <cctype>
 
+// Each line is compiled and run on its own against everything the earlier
+// lines defined. An error is reported and the session carries on.
 static void repl(VM *vm)
 {
+    std::string input;
     while (1)
     {
-        std::string input;
         std::cout << "> ";
-        std::getline(std::cin, input);
-        if (input == "exit")
+        if (!std::getline(std::cin, input) || input == "exit")
         {
             break;
         }
-        InterpretResult result = vm->interpret(input);
-        if (result != INTERPRET_OK)
+        vm->interpretSnippet(input);
+    }
+}
+
+// Compiles source into fresh function and global tables over and over for
+// about a second and returns the number of compiles per second.
+static double compilesPerSecond(std::string_view source, int optimizationLevel, int threads, std::vector<NativeFunction> *natives)
+{
+    auto start = std::chrono::steady_clock::now();
+    double seconds = 0;
+    int runs = 0;
+    while (seconds < 1)
+    {
+        std::unordered_map<std::string, std::shared_ptr<Chunk>> functions;
+        std::vector<Chunk *> function_table;
+        GlobalTable globals;
+        std::shared_ptr<Chunk> main = std::make_shared<Chunk>(0);
+        main->function = FunctionObject("main", 0);
+        functions["main"] = main;
+        function_table.push_back(main.get());
+        Compiler compiler = Compiler(source, &functions, &function_table, natives, &globals);
+        compiler.optimizationLevel = optimizationLevel;
+        compiler.threads = threads;
+        if (!compiler.compile())
+        {
+            std::cout << "compile error" << "\n";
+            return 0;
+        }
+        runs++;
+        seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    }
+    return runs / seconds;
+}
+
+// Scans and then compiles source over and over, about a second each, and
+// reports how fast the scanner and the whole front end go, then how compile
+// time scales with the number of threads compiling function bodies.
+static void benchmarkCompile(std::string_view source, int optimizationLevel, int threads)
+{
+    long tokens = 0;
+    long lines = std::count(source.begin(), source.end(), '\n');
+    double megabytes = source.size() / (1024.0 * 1024.0);
+    auto start = std::chrono::steady_clock::now();
+    double seconds = 0;
+    int runs = 0;
+    while (seconds < 1)
+    {
+        Scanner scanner;
+        scanner.reset(source);
+        tokens = 0;
+        while (scanner.scanToken().type != TOKEN_EOF)
+        {
+            tokens++;
+        }
+        runs++;
+        seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    }
+    std::cout << runs << " scans of " << tokens << " tokens, " << lines << " lines in " << seconds << "s\n";
+    std::cout << "scan: " << megabytes * runs / seconds << " MB/s, " << (long)(tokens * runs / seconds) << " tokens/sec\n";
+
+    std::vector<NativeFunction> natives;
+    initNativeFunctions(&natives);
+    double rate = compilesPerSecond(source, optimizationLevel, threads, &natives);
+    if (rate == 0)
+    {
+        return;
+    }
+    std::cout << "compile: " << megabytes * rate << " MB/s, " << (long)(tokens * rate) << " tokens/sec, " << (long)(lines * rate) << " lines/sec, " << 1000 / rate << "ms per compile\n";
+
+    int maxThreads = std::max(8, (int)std::thread::hardware_concurrency());
+    double serial = compilesPerSecond(source, optimizationLevel, 1, &natives);
+    for (int count = 1; count <= maxThreads; count *= 2)
+    {
+        double parallel = count == 1 ? serial : compilesPerSecond(source, optimizationLevel, count, &natives);
+        std::cout << "threads " << count << ": " << 1000 / parallel << "ms per compile, " << parallel / serial << "x\n";
+    }
+}
+
+// Runs program in count isolates at once, each on a thread of its own and
+// each running the script over and over for about a second, and returns the
+// number of runs per second of all of them together.
+static double runsPerSecond(std::shared_ptr<const Program> program, int count, bool useJit)
+{
+    std::vector<double> rates(count);
+    auto work = [&](int index)
+    {
+        VM isolate;
+        isolate.useJit = useJit;
+        isolate.loadProgram(program);
+        auto start = std::chrono::steady_clock::now();
+        double seconds = 0;
+        int runs = 0;
+        while (seconds < 1)
         {
-            exit(10);
+            isolate.resetGlobals();
+            isolate.runMain();
+            runs++;
+            seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
         }
+        rates[index] = runs / seconds;
+    };
+    std::vector<std::thread> threads;
+    for (int i = 0; i < count; i++)
+    {
+        threads.emplace_back(work, i);
+    }
+    double total = 0;
+    for (int i = 0; i < count; i++)
+    {
+        threads[i].join();
+        total += rates[i];
+    }
+    return total;
+}
+
+// Reports how the throughput of a script compiled once scales with the number
+// of isolates running it at the same time. The script's own output goes to
+// stdout as usual and the table to stderr.
+static void benchmarkIsolates(std::shared_ptr<const Program> program, bool useJit)
+{
+    int maxThreads = std::max(8, (int)std::thread::hardware_concurrency());
+    double single = runsPerSecond(program, 1, useJit);
+    for (int count = 1; count <= maxThreads; count *= 2)
+    {
+        double rate = count == 1 ? single : runsPerSecond(program, count, useJit);
+        std::cerr << "isolates " << count << ": " << rate << " runs/sec, " << rate / single << "x\n";
+    }
+}
+
+// Sends messages from producer isolates to consumer isolates through one
+// channel, all of them started together, and returns the messages per second.
+// The producers split the messages between them; once they are done the
+// channel is closed and the consumers stop when it is empty.
+static double messagesPerSecond(int producers, int consumers, long messages, bool strings)
+{
+    int channel = createChannel(1024);
+    std::string id = std::to_string(channel);
+    std::string count = std::to_string(messages / producers);
+    std::string value = strings ? "\"message\"" : "i";
+    VM producerCompiler, consumerCompiler;
+    std::shared_ptr<const Program> producer = producerCompiler.compileProgram(
+        "var ch = " + id + "; var i = 0; while (i < " + count + ") { send(ch, " + value + "); i = i + 1; }");
+    std::shared_ptr<const Program> consumer = consumerCompiler.compileProgram(
+        "var ch = " + id + "; var v = receive(ch); while (v != nil) { v = receive(ch); }");
+    if (!producer || !consumer)
+    {
+        return 0;
+    }
+    auto run = [](std::shared_ptr<const Program> program)
+    {
+        VM isolate;
+        isolate.loadProgram(program);
+        isolate.runMain();
+    };
+    auto start = std::chrono::steady_clock::now();
+    std::vector<std::thread> sending, receiving;
+    for (int i = 0; i < producers; i++)
+    {
+        sending.emplace_back(run, producer);
+    }
+    for (int i = 0; i < consumers; i++)
+    {
+        receiving.emplace_back(run, consumer);
+    }
+    for (std::thread &thread : sending)
+    {
+        thread.join();
+    }
+    findChannel(Value((double)channel))->close();
+    for (std::thread &thread : receiving)
+    {
+        thread.join();
+    }
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    return messages / producers * producers / seconds;
+}
+
+// Channel throughput for one to one and many to many topologies, sending
+// numbers and then strings.
+static void benchmarkChannels()
+{
+    const long messages = 1000000;
+    int topologies[][2] = { { 1, 1 }, { 2, 2 }, { 4, 4 }, { 1, 4 }, { 4, 1 } };
+    for (auto &topology : topologies)
+    {
+        double numbers = messagesPerSecond(topology[0], topology[1], messages, false);
+        double strings = messagesPerSecond(topology[0], topology[1], messages, true);
+        std::cout << topology[0] << ":" << topology[1] << " numbers: " << (long)numbers << " messages/sec, strings: " << (long)strings << " messages/sec\n";
     }
 }
 
 int main(int argc, const char *argv[])
 {
     VM vm;
-    if (argc == 2)
+    // options come before the script: -O1 enables the optimizer, -stats
+    // prints instruction counts before and after it, -registers runs the
+    // register VM, -nojit keeps hot functions interpreted, -nocache always
+    // compiles instead of using the bytecode cache next to the script,
+    // -compilebench measures compile throughput without running the script,
+    // -jN compiles function bodies on N threads (-j1 on the main thread only),
+    // -isolatebench compiles the script once and runs it in 1, 2, 4, ...
+    // isolates on as many threads, -channelbench (without a script) measures
+    // channel throughput between isolates, -pN runs the parallel natives on N
+    // threads, -serve PATH runs scripts sent to the Unix socket PATH until
+    // killed, -send PATH runs the script on that server instead of here,
+    // -servebench measures request latency through a server.
+    // Without a script the lines typed in are run one at a time
+    bool useCache = true;
+    bool compileOnly = false;
+    bool isolateBenchmark = false;
+    bool serverBenchmark = false;
+    std::string sendTo;
+    std::string serveOn;
+    int arg = 1;
+    for (; arg < argc && argv[arg][0] == '-'; arg++)
     {
-        std::ifstream code(argv[1]);
-        if (!code) {
+        std::string option = argv[arg];
+        if (option == "-O1")
+        {
+            vm.optimizationLevel = 1;
+        }
+        else if (option == "-O0")
+        {
+            vm.optimizationLevel = 0;
+        }
+        else if (option == "-stats")
+        {
+            vm.printOptimizerStats = true;
+        }
+        else if (option == "-registers")
+        {
+            vm.useRegisters = true;
+        }
+        else if (option == "-nojit")
+        {
+            vm.useJit = false;
+        }
+        else if (option == "-nocache")
+        {
+            useCache = false;
+        }
+        else if (option.compare(0, 2, "-j") == 0 && option.size() > 2)
+        {
+            vm.compileThreads = std::atoi(option.c_str() + 2);
+        }
+        else if (option.compare(0, 2, "-p") == 0 && option.size() > 2 && isdigit(option[2]))
+        {
+            parallelThreads = std::atoi(option.c_str() + 2);
+        }
+        else if (option == "-compilebench")
+        {
+            compileOnly = true;
+        }
+        else if (option == "-isolatebench")
+        {
+            isolateBenchmark = true;
+        }
+        else if (option == "-channelbench")
+        {
+            benchmarkChannels();
+            return 0;
+        }
+        else if (option == "-serve" && arg + 1 < argc)
+        {
+            serveOn = argv[++arg];
+        }
+        else if (option == "-send" && arg + 1 < argc)
+        {
+            sendTo = argv[++arg];
+        }
+        else if (option == "-servebench")
+        {
+            serverBenchmark = true;
+        }
+        else
+        {
+            std::cout << "Unknown option " << option << "\n";
+            return 1;
+        }
+    }
+    if (!serveOn.empty() && arg == argc)
+    {
+        return serveForever(serveOn, vm);
+    }
+    if (arg == argc - 1 && serveOn.empty())
+    {
+        // the script is never copied: tokens and string constants are taken
+        // straight from the mapping, which lives until the script finishes
+        MappedFile code;
+        if (!code.open(argv[arg])) {
             std::cout << "file not found" << "\n";
             return 1;
         }
-        std::stringstream buffer;
-        buffer << code.rdbuf();
-        std::string code_string = buffer.str();
-        vm.interpret(code_string);
+        if (compileOnly)
+        {
+            benchmarkCompile(code.view(), vm.optimizationLevel, vm.compileThreads);
+            return 0;
+        }
+        if (!sendTo.empty())
+        {
+            return sendScript(sendTo, argv[arg]);
+        }
+        if (serverBenchmark)
+        {
+            benchmarkServer(argv[arg], vm, argv[0]);
+            return 0;
+        }
+        if (useCache)
+        {
+            vm.bytecodeCache = std::string(argv[arg]) + "c";
+        }
+        if (isolateBenchmark)
+        {
+            std::shared_ptr<const Program> program = vm.compileProgram(code.view());
+            if (program)
+            {
+                benchmarkIsolates(program, vm.useJit);
+            }
+            return 0;
+        }
+        vm.interpret(code.view());
+    }
+    else if (arg == argc && !compileOnly && !isolateBenchmark && !serverBenchmark && sendTo.empty())
+    {
+        repl(&vm);
     }
     else
     {
@@ -0,0 +1,77 @@
+#pragma once
+#ifndef clox_mapped_file_h
+#include <cstddef>
+#include <fstream>
+#include <iterator>
+#include <string>
+#include <string_view>
+#include <vector>
+#if defined(__unix__) || defined(__APPLE__)
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#define MAPPED_FILE_POSIX
+#endif
+
+// The bytes of a file, mapped read only where the platform allows and read
+// into memory otherwise. The bytes are not NUL terminated and stay valid for
+// the lifetime of the object.
+class MappedFile {
+public:
+	const char* data = "";
+	size_t size = 0;
+
+	MappedFile() = default;
+	MappedFile(const MappedFile&) = delete;
+	MappedFile& operator=(const MappedFile&) = delete;
+
+	std::string_view view() const {
+		return std::string_view(data, size);
+	}
+
+#ifdef MAPPED_FILE_POSIX
+	void* mapping = MAP_FAILED;
+
+	bool open(const std::string& path) {
+		int fd = ::open(path.c_str(), O_RDONLY);
+		if (fd < 0) return false;
+		struct stat status;
+		bool ok = fstat(fd, &status) == 0 && S_ISREG(status.st_mode);
+		// an empty file cannot be mapped, but opens fine with no bytes
+		if (ok && status.st_size > 0) {
+			mapping = mmap(nullptr, status.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+			if (mapping == MAP_FAILED) {
+				ok = false;
+			}
+			else {
+				size = status.st_size;
+				data = (const char*)mapping;
+				// scripts and caches are read front to back once
+				madvise(mapping, size, MADV_SEQUENTIAL);
+			}
+		}
+		close(fd);
+		return ok;
+	}
+
+	~MappedFile() {
+		if (mapping != MAP_FAILED) munmap(mapping, size);
+	}
+#else
+	std::vector<char> contents;
+
+	bool open(const std::string& path) {
+		std::ifstream file(path, std::ios::binary);
+		if (!file) return false;
+		contents.assign(std::istreambuf_iterator<char>(file), std::istreambuf_iterator<char>());
+		if (!contents.empty()) {
+			data = contents.data();
+			size = contents.size();
+		}
+		return true;
+	}
+#endif
+};
+
+#endif // !clox_mapped_file_h
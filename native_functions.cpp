@@ -1,28 +1,478 @@
 #include "native_functions.h"
+#include "channel.h"
+#include "vm.h"
+#include "worker_pool.h"
+#include <algorithm>
+#include <atomic>
+#include <cmath>
 #include <string>
 #include <unordered_map>
 
-auto start = std::chrono::steady_clock::now();
+// Natives keep no state of their own, so any number of VMs can call them from
+// different threads. The epoch clock() counts from is set once at startup.
+static const auto start = std::chrono::steady_clock::now();
 
-Value Clock(int argCount, Value* args) {
+Value Clock(VM* vm, int argCount, Value* args) {
 	auto now = std::chrono::steady_clock::now();
 	double x = std::chrono::duration_cast<std::chrono::milliseconds>(now - start).count();
 	return Value(x);
 }
 
-Value StringLen(int argCount, Value* args) {
-	if (args->value.index() != 2) {
+Value StringLen(VM* vm, int argCount, Value* args) {
+	if (args->isArray()) {
+		return Value((double)args->returnArray().size());
+	}
+	if (!args->isString()) {
 		std::cout << "Incorrect value type for len, nill Returned "<<"\n";
 		return Value();
 	}
 	return Value((double)args->returnString().length());
 }
 
-NativeFunction clock_function = NativeFunction(0, Clock);
-NativeFunction stringlen = NativeFunction(1, StringLen);
+static Channel* channelArgument(Value id, const char* native) {
+	Channel* channel = findChannel(id);
+	if (channel == nullptr) {
+		std::cout << "Incorrect channel for " << native << ", nill Returned " << "\n";
+	}
+	return channel;
+}
+
+// An object sent is a copy outside the sender's heap until a receiver adopts it.
+static Value received(VM* vm, Value value) {
+	if (value.isObject()) {
+		return Value(vm->adoptObject(value.returnObject()));
+	}
+	return value;
+}
+
+Value ChannelCreate(VM* vm, int argCount, Value* args) {
+	if (!args->isNumber() || !(args->returnDouble() >= 1 && args->returnDouble() <= CHANNEL_CAPACITY_MAX)) {
+		std::cout << "Incorrect capacity for channel, nill Returned " << "\n";
+		return Value();
+	}
+	int index = createChannel((size_t)args->returnDouble());
+	if (index < 0) {
+		std::cout << "Too many channels, nill Returned " << "\n";
+		return Value();
+	}
+	return Value((double)index);
+}
+
+Value ChannelSend(VM* vm, int argCount, Value* args) {
+	Channel* channel = channelArgument(args[0], "send");
+	if (channel == nullptr) return Value();
+	Value value = args[1];
+	if (value.isString()) {
+		value = Value(new StringObject(value.returnString()));
+	}
+	else if (value.isArray()) {
+		value = Value(new ArrayObject(value.returnArray()));
+	}
+	if (channel->send(value)) return Value(true);
+	if (value.isObject()) delete value.returnObject();
+	return Value(false);
+}
+
+Value ChannelReceive(VM* vm, int argCount, Value* args) {
+	Channel* channel = channelArgument(args[0], "receive");
+	Value value;
+	if (channel == nullptr || !channel->receive(&value)) return Value();
+	return received(vm, value);
+}
+
+Value ChannelTryReceive(VM* vm, int argCount, Value* args) {
+	Channel* channel = channelArgument(args[0], "tryReceive");
+	Value value;
+	if (channel == nullptr || !channel->tryReceive(&value)) return Value();
+	return received(vm, value);
+}
+
+Value ChannelClose(VM* vm, int argCount, Value* args) {
+	Channel* channel = channelArgument(args[0], "close");
+	if (channel == nullptr) return Value();
+	channel->close();
+	return Value(true);
+}
+
+static std::vector<double>* arrayArgument(Value value, const char* native) {
+	if (!value.isArray()) {
+		std::cout << "Incorrect array for " << native << ", nill Returned " << "\n";
+		return nullptr;
+	}
+	return &value.returnArray();
+}
+
+// An index into array, or -1 after an error message.
+static long indexArgument(const std::vector<double>& array, Value index, const char* native) {
+	if (!index.isNumber() || !(index.returnDouble() >= 0 && index.returnDouble() < array.size()) || index.returnDouble() != (long)index.returnDouble()) {
+		std::cout << "Index out of range for " << native << ", nill Returned " << "\n";
+		return -1;
+	}
+	return (long)index.returnDouble();
+}
+
+static bool sizeArgument(Value size, const char* native) {
+	if (!size.isNumber() || !(size.returnDouble() >= 0 && size.returnDouble() <= ARRAY_SIZE_MAX) || size.returnDouble() != (long)size.returnDouble()) {
+		std::cout << "Incorrect size for " << native << ", nill Returned " << "\n";
+		return false;
+	}
+	return true;
+}
+
+Value ArrayCreate(VM* vm, int argCount, Value* args) {
+	if (!sizeArgument(args[0], "array")) return Value();
+	return Value(vm->allocateArray(std::vector<double>((size_t)args[0].returnDouble())));
+}
+
+Value ArrayRange(VM* vm, int argCount, Value* args) {
+	if (!sizeArgument(args[0], "range")) return Value();
+	std::vector<double> values((size_t)args[0].returnDouble());
+	for (size_t i = 0; i < values.size(); i++) {
+		values[i] = (double)i;
+	}
+	return Value(vm->allocateArray(std::move(values)));
+}
+
+Value ArrayGet(VM* vm, int argCount, Value* args) {
+	std::vector<double>* array = arrayArgument(args[0], "arrayGet");
+	if (array == nullptr) return Value();
+	long index = indexArgument(*array, args[1], "arrayGet");
+	if (index < 0) return Value();
+	return Value((*array)[index]);
+}
+
+Value ArraySet(VM* vm, int argCount, Value* args) {
+	std::vector<double>* array = arrayArgument(args[0], "arraySet");
+	if (array == nullptr) return Value();
+	long index = indexArgument(*array, args[1], "arraySet");
+	if (index < 0) return Value();
+	if (!args[2].isNumber()) {
+		std::cout << "Arrays hold numbers only, nill Returned " << "\n";
+		return Value();
+	}
+	(*array)[index] = args[2].returnDouble();
+	return args[2];
+}
+
+// The script function named by a parallel native's first argument, called
+// on the workers as the kernel.
+static Chunk* kernelArgument(VM* vm, Value name, int arity, const char* native) {
+	if (name.isString()) {
+		auto function = vm->vm_functions.find(name.returnString());
+		if (function != vm->vm_functions.end() && function->second->function.index != 0 && function->second->function.arity == arity) {
+			return function->second.get();
+		}
+	}
+	std::cout << "Incorrect function for " << native << ", it must name a function of " << arity << " arguments, nill Returned " << "\n";
+	return nullptr;
+}
+
+// Shared by the workers of one parallel native: the first failed kernel call
+// stops them all.
+class KernelStatus {
+public:
+	std::atomic<int> error = 0; // 1 a runtime error in the kernel, 2 a result that is not a number
+
+	bool failed() {
+		return error.load(std::memory_order_relaxed) != 0;
+	}
+
+	bool check(bool ran, Value result, bool needNumber) {
+		if (!ran) error = 1;
+		else if (needNumber && !result.isNumber()) error = 2;
+		return !failed();
+	}
+
+	bool report(const char* native) {
+		if (error == 2) {
+			std::cout << "The function for " << native << " must return a number, nill Returned " << "\n";
+		}
+		return !failed();
+	}
+};
+
+Value ParallelMap(VM* vm, int argCount, Value* args) {
+	Chunk* kernel = kernelArgument(vm, args[0], 1, "parallelMap");
+	std::vector<double>* input = arrayArgument(args[1], "parallelMap");
+	if (kernel == nullptr || input == nullptr) return Value();
+	std::vector<double> output(input->size());
+	int workers = parallelWorkers(input->size());
+	std::vector<VM*> contexts = vm->prepareWorkers(workers);
+	KernelStatus status;
+	parallelFor(input->size(), PARALLEL_GRAIN, workers, [&](int worker, size_t begin, size_t end) {
+		VM* context = contexts[worker];
+		Chunk* function = context->vm_function_table[kernel->function.index];
+		for (size_t i = begin; i < end && !status.failed(); i++) {
+			Value argument = Value((*input)[i]);
+			Value result;
+			if (!status.check(context->callFunction(function, &argument, &result), result, true)) return;
+			output[i] = result.returnDouble();
+		}
+	});
+	if (!status.report("parallelMap")) return Value();
+	return Value(vm->allocateArray(std::move(output)));
+}
+
+Value ParallelFilter(VM* vm, int argCount, Value* args) {
+	Chunk* kernel = kernelArgument(vm, args[0], 1, "parallelFilter");
+	std::vector<double>* input = arrayArgument(args[1], "parallelFilter");
+	if (kernel == nullptr || input == nullptr) return Value();
+	// what each piece keeps, put back together in order afterwards
+	std::vector<std::vector<double>> kept((input->size() + PARALLEL_GRAIN - 1) / PARALLEL_GRAIN);
+	int workers = parallelWorkers(input->size());
+	std::vector<VM*> contexts = vm->prepareWorkers(workers);
+	KernelStatus status;
+	parallelFor(input->size(), PARALLEL_GRAIN, workers, [&](int worker, size_t begin, size_t end) {
+		VM* context = contexts[worker];
+		Chunk* function = context->vm_function_table[kernel->function.index];
+		std::vector<double>& piece = kept[begin / PARALLEL_GRAIN];
+		for (size_t i = begin; i < end && !status.failed(); i++) {
+			Value argument = Value((*input)[i]);
+			Value result;
+			if (!status.check(context->callFunction(function, &argument, &result), result, false)) return;
+			if (!result.isFalsey()) piece.push_back((*input)[i]);
+		}
+	});
+	if (!status.report("parallelFilter")) return Value();
+	std::vector<double> output;
+	for (std::vector<double>& piece : kept) {
+		output.insert(output.end(), piece.begin(), piece.end());
+	}
+	return Value(vm->allocateArray(std::move(output)));
+}
+
+// Each piece of the array is folded starting from initial and the pieces'
+// results are folded together in order, so the kernel must be associative
+// with initial as its identity (0 for +, 1 for *) for the result to be the
+// same as a serial fold.
+Value ParallelReduce(VM* vm, int argCount, Value* args) {
+	Chunk* kernel = kernelArgument(vm, args[0], 2, "parallelReduce");
+	std::vector<double>* input = arrayArgument(args[1], "parallelReduce");
+	if (kernel == nullptr || input == nullptr) return Value();
+	if (!args[2].isNumber()) {
+		std::cout << "Incorrect initial value for reduce, nill Returned " << "\n";
+		return Value();
+	}
+	std::vector<double> pieces((input->size() + PARALLEL_GRAIN - 1) / PARALLEL_GRAIN);
+	int workers = parallelWorkers(input->size());
+	std::vector<VM*> contexts = vm->prepareWorkers(workers);
+	KernelStatus status;
+	auto fold = [&](VM* context, const double* values, size_t count, double* result) {
+		Chunk* function = context->vm_function_table[kernel->function.index];
+		Value arguments[2] = { Value(*result), Value() };
+		for (size_t i = 0; i < count && !status.failed(); i++) {
+			arguments[1] = Value(values[i]);
+			if (!status.check(context->callFunction(function, arguments, &arguments[0]), arguments[0], true)) return;
+		}
+		*result = arguments[0].returnDouble();
+	};
+	parallelFor(input->size(), PARALLEL_GRAIN, workers, [&](int worker, size_t begin, size_t end) {
+		double* piece = &pieces[begin / PARALLEL_GRAIN];
+		*piece = args[2].returnDouble();
+		fold(contexts[worker], input->data() + begin, end - begin, piece);
+	});
+	double result = args[2].returnDouble();
+	if (!pieces.empty()) {
+		result = pieces[0];
+		fold(contexts[0], pieces.data() + 1, pieces.size() - 1, &result);
+	}
+	if (!status.report("parallelReduce")) return Value();
+	return Value(result);
+}
+
+// Summed piece by piece and the pieces in order, so the result is the same
+// whatever the number of threads, though it may round differently from a
+// sum from front to back.
+Value ParallelSum(VM* vm, int argCount, Value* args) {
+	std::vector<double>* input = arrayArgument(args[0], "parallelSum");
+	if (input == nullptr) return Value();
+	std::vector<double> pieces((input->size() + PARALLEL_GRAIN - 1) / PARALLEL_GRAIN);
+	parallelFor(input->size(), PARALLEL_GRAIN, parallelWorkers(input->size()), [&](int worker, size_t begin, size_t end) {
+		double sum = 0;
+		for (size_t i = begin; i < end; i++) {
+			sum += (*input)[i];
+		}
+		pieces[begin / PARALLEL_GRAIN] = sum;
+	});
+	double sum = 0;
+	for (double piece : pieces) {
+		sum += piece;
+	}
+	return Value(sum);
+}
+
+// NaNs sort after every number.
+static bool sortsBefore(double a, double b) {
+	return a < b || (std::isnan(b) && !std::isnan(a));
+}
+
+// Sorts the array in place: each worker sorts a block of its own, then the
+// blocks are merged pairwise, the pairs of each round in parallel.
+Value ParallelSort(VM* vm, int argCount, Value* args) {
+	std::vector<double>* array = arrayArgument(args[0], "parallelSort");
+	if (array == nullptr) return Value();
+	size_t size = array->size();
+	int blocks = parallelWorkers(size);
+	auto boundary = [&](size_t block) {
+		return array->begin() + size * std::min<size_t>(block, blocks) / blocks;
+	};
+	parallelFor(blocks, 1, blocks, [&](int worker, size_t begin, size_t end) {
+		for (size_t block = begin; block < end; block++) {
+			std::sort(boundary(block), boundary(block + 1), sortsBefore);
+		}
+	});
+	for (size_t width = 1; width < (size_t)blocks; width *= 2) {
+		size_t pairs = (blocks + 2 * width - 1) / (2 * width);
+		parallelFor(pairs, 1, (int)pairs, [&](int worker, size_t begin, size_t end) {
+			for (size_t pair = begin; pair < end; pair++) {
+				size_t first = pair * 2 * width;
+				std::inplace_merge(boundary(first), boundary(first + width), boundary(first + 2 * width), sortsBefore);
+			}
+		});
+	}
+	return args[0];
+}
+
+static Scheduler* scheduler(VM* vm) {
+	if (!vm->scheduler) {
+		vm->scheduler = std::make_unique<Scheduler>(vm);
+	}
+	return vm->scheduler.get();
+}
+
+// spawn("f", argument) runs f(argument) as a coroutine, like the parallel
+// natives take their kernel.
+Value CoroutineSpawn(VM* vm, int argCount, Value* args) {
+	Chunk* function = kernelArgument(vm, args[0], 1, "spawn");
+	if (function == nullptr) return Value();
+	int id = scheduler(vm)->spawn(function, args[1]);
+	if (id < 0) return Value();
+	return Value((double)id);
+}
+
+Value CoroutineYield(VM* vm, int argCount, Value* args) {
+	scheduler(vm)->yield();
+	return Value();
+}
+
+Value CoroutineAwait(VM* vm, int argCount, Value* args) {
+	Value result;
+	if (!args->isNumber() || !scheduler(vm)->await((int)args->returnDouble(), &result)) return Value();
+	return result;
+}
+
+Value CoroutineSleep(VM* vm, int argCount, Value* args) {
+	if (!args->isNumber()) {
+		std::cout << "Incorrect value type for sleep, nill Returned " << "\n";
+		return Value();
+	}
+	return Value(scheduler(vm)->sleep(args->returnDouble()));
+}
+
+static bool fdArgument(Value fd, const char* native) {
+	if (!fd.isNumber() || !(fd.returnDouble() >= 0 && fd.returnDouble() <= INT32_MAX)) {
+		std::cout << "Incorrect file for " << native << ", nill Returned " << "\n";
+		return false;
+	}
+	return true;
+}
+
+Value IoConnect(VM* vm, int argCount, Value* args) {
+	if (!args->isString()) {
+		std::cout << "Incorrect value type for connect, nill Returned " << "\n";
+		return Value();
+	}
+	int fd = scheduler(vm)->connect(args->returnString());
+	if (fd < 0) {
+		std::cout << "Cannot connect to " << args->returnString() << ", nill Returned " << "\n";
+		return Value();
+	}
+	return Value((double)fd);
+}
+
+Value IoOpenFile(VM* vm, int argCount, Value* args) {
+	if (!args[0].isString() || !args[1].isString()) {
+		std::cout << "Incorrect value type for openFile, nill Returned " << "\n";
+		return Value();
+	}
+	int fd = scheduler(vm)->openFile(args[0].returnString(), args[1].returnString());
+	if (fd < 0) {
+		std::cout << "Cannot open " << args[0].returnString() << ", nill Returned " << "\n";
+		return Value();
+	}
+	return Value((double)fd);
+}
 
-void initNativeFunctions(std::unordered_map<std::string, NativeFunction>* natives) {
-	natives->insert({"clock", clock_function});
-	natives->insert({ "len",stringlen });
+// nil at end of file
+Value IoRead(VM* vm, int argCount, Value* args) {
+	if (!fdArgument(args[0], "read")) return Value();
+	std::string data;
+	if (!scheduler(vm)->read((int)args[0].returnDouble(), &data)) return Value();
+	return Value(vm->allocateString(std::move(data)));
 }
 
+Value IoReadLine(VM* vm, int argCount, Value* args) {
+	if (!fdArgument(args[0], "readLine")) return Value();
+	std::string line;
+	if (!scheduler(vm)->readLine((int)args[0].returnDouble(), &line)) return Value();
+	return Value(vm->allocateString(std::move(line)));
+}
+
+Value IoWrite(VM* vm, int argCount, Value* args) {
+	if (!fdArgument(args[0], "write")) return Value();
+	if (!args[1].isString()) {
+		std::cout << "Incorrect value type for write, nill Returned " << "\n";
+		return Value();
+	}
+	return Value(scheduler(vm)->write((int)args[0].returnDouble(), args[1].returnString()));
+}
+
+// Strings have no escapes, so this is the way to end a line.
+Value IoWriteLine(VM* vm, int argCount, Value* args) {
+	if (!fdArgument(args[0], "writeLine")) return Value();
+	if (!args[1].isString()) {
+		std::cout << "Incorrect value type for writeLine, nill Returned " << "\n";
+		return Value();
+	}
+	return Value(scheduler(vm)->write((int)args[0].returnDouble(), args[1].returnString() + "\n"));
+}
+
+Value IoCloseFile(VM* vm, int argCount, Value* args) {
+	if (!fdArgument(args[0], "closeFile")) return Value();
+	scheduler(vm)->closeFile((int)args[0].returnDouble());
+	return Value(true);
+}
+
+static const NativeFunction natives[] = {
+	NativeFunction("clock", 0, Clock),
+	NativeFunction("len", 1, StringLen),
+	NativeFunction("channel", 1, ChannelCreate),
+	NativeFunction("send", 2, ChannelSend),
+	NativeFunction("receive", 1, ChannelReceive),
+	NativeFunction("tryReceive", 1, ChannelTryReceive),
+	NativeFunction("close", 1, ChannelClose),
+	NativeFunction("array", 1, ArrayCreate),
+	NativeFunction("range", 1, ArrayRange),
+	NativeFunction("arrayGet", 2, ArrayGet),
+	NativeFunction("arraySet", 3, ArraySet),
+	NativeFunction("parallelMap", 2, ParallelMap),
+	NativeFunction("parallelFilter", 2, ParallelFilter),
+	NativeFunction("parallelReduce", 3, ParallelReduce),
+	NativeFunction("parallelSum", 1, ParallelSum),
+	NativeFunction("parallelSort", 1, ParallelSort),
+	NativeFunction("spawn", 2, CoroutineSpawn),
+	NativeFunction("yield", 0, CoroutineYield),
+	NativeFunction("await", 1, CoroutineAwait),
+	NativeFunction("sleep", 1, CoroutineSleep),
+	NativeFunction("connect", 1, IoConnect),
+	NativeFunction("openFile", 2, IoOpenFile),
+	NativeFunction("read", 1, IoRead),
+	NativeFunction("readLine", 1, IoReadLine),
+	NativeFunction("write", 2, IoWrite),
+	NativeFunction("writeLine", 2, IoWriteLine),
+	NativeFunction("closeFile", 1, IoCloseFile),
+};
+
+void initNativeFunctions(std::vector<NativeFunction>* vm_native_functions) {
+	vm_native_functions->assign(std::begin(natives), std::end(natives));
+}
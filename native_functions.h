@@ -4,20 +4,29 @@
 #include <chrono>
 #include <unordered_map>
 #include <string>
+#include <vector>
 
 
-using NativeFn = Value(*)(int, Value*);
-Value Clock(int argCount, Value* args);
+class VM;
+
+#define ARRAY_SIZE_MAX (1 << 30)
+
+// vm is the VM making the call, for natives that allocate.
+using NativeFn = Value(*)(VM*, int, Value*);
+Value Clock(VM* vm, int argCount, Value* args);
 
 class NativeFunction {
 public:
+	std::string name;
 	int arguments;
 	NativeFn function;
 
-	NativeFunction(int args,NativeFn function) {	
+	NativeFunction(std::string name, int args,NativeFn function) {
+		this->name = name;
 		this->arguments = args;
 		this->function = function;
 	}
 };
 
-void initNativeFunctions(std::unordered_map<std::string, NativeFunction>* vm_native_functions);
+// Natives are called by their index in this table, resolved at compile time.
+void initNativeFunctions(std::vector<NativeFunction>* vm_native_functions);
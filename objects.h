@@ -2,13 +2,33 @@
 #include <string>
 #include <functional>
 #include <iostream>
+#include <vector>
 
+typedef enum {
+	OBJ_STRING,
+	OBJ_ARRAY,
+} ObjectType;
 
-class StringObject {
+// Header shared by every heap allocated object. Objects are linked into the
+// ObjectHeap that allocated them, which owns and eventually frees them.
+class Object {
+public:
+	ObjectType type;
+	bool isMarked = 0;
+	bool isConstant = 0; // owned by a chunk's constant pool, never collected
+	Object* next = nullptr;
+
+	Object(ObjectType type) {
+		this->type = type;
+	}
+	virtual ~Object() {}
+};
+
+class StringObject : public Object {
 public:
 	std::string string;
-	StringObject(std::string string) {
-		this->string = string;
+	StringObject(std::string string) : Object(OBJ_STRING) {
+		this->string = std::move(string);
 	}
 
 	std::string getString() {
@@ -16,29 +36,110 @@ public:
 	}
 };
 
+// A fixed length array of numbers, the data the parallel natives work on.
+class ArrayObject : public Object {
+public:
+	std::vector<double> values;
+	ArrayObject(std::vector<double> values) : Object(OBJ_ARRAY) {
+		this->values = std::move(values);
+	}
+};
+
+class ObjectHeap {
+public:
+	Object* objects = nullptr;
+	size_t bytesAllocated = 0;
+	bool constant;
+
+	ObjectHeap(bool constant = 0) {
+		this->constant = constant;
+	}
+	ObjectHeap(const ObjectHeap&) = delete;
+	ObjectHeap& operator=(const ObjectHeap&) = delete;
+
+	~ObjectHeap() {
+		while (objects != nullptr) {
+			Object* next = objects->next;
+			delete objects;
+			objects = next;
+		}
+	}
+
+	StringObject* allocateString(std::string string) {
+		StringObject* object = new StringObject(std::move(string));
+		adopt(object);
+		return object;
+	}
+
+	ArrayObject* allocateArray(std::vector<double> values) {
+		ArrayObject* object = new ArrayObject(std::move(values));
+		adopt(object);
+		return object;
+	}
+
+	// Takes ownership of an object allocated outside any heap.
+	void adopt(Object* object) {
+		bytesAllocated += objectSize(object);
+		link(object);
+	}
+
+	void link(Object* object) {
+		object->isConstant = constant;
+		object->next = objects;
+		objects = object;
+	}
+
+	// Frees every object that was not marked since the last sweep.
+	void sweep() {
+		Object** link = &objects;
+		while (*link != nullptr) {
+			Object* object = *link;
+			if (object->isMarked) {
+				object->isMarked = 0;
+				link = &object->next;
+				continue;
+			}
+			*link = object->next;
+			bytesAllocated -= objectSize(object);
+			delete object;
+		}
+	}
+
+	static size_t objectSize(Object* object) {
+		switch (object->type) {
+		case OBJ_STRING:
+			return sizeof(StringObject) + ((StringObject*)object)->string.capacity();
+		case OBJ_ARRAY:
+			return sizeof(ArrayObject) + ((ArrayObject*)object)->values.capacity() * sizeof(double);
+		}
+		return 0;
+	}
+};
+
 class FunctionObject {
 public:
 	std::string funcName;
 	int arity;
+	int index; // position in the VM function table, OP_CALL operand
 
 	FunctionObject(std::string name,int arity){
 		this->funcName = name;
 		this->arity = arity;
+		this->index = 0;
 	}
 
 	FunctionObject(std::string name) {
 		this->funcName = name;
 		this->arity = 0;
+		this->index = 0;
 	}
 	FunctionObject() {
 		this->funcName = " ";
 		this->arity = 0;
+		this->index = 0;
 	}
 
 	void printFunction() {
 		std::cout << this->funcName<<"\n";
 	}
 };
-
-
-
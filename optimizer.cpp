@@ -0,0 +1,479 @@
+#include "optimizer.h"
+#include <cstdlib>
+#include <iostream>
+#include <map>
+#include <unordered_map>
+#include <unordered_set>
+
+std::vector<Instruction> decodeChunk(Chunk* chunk)
+{
+	std::vector<Instruction> code;
+	int offset = 0;
+	while (offset < (int)chunk->opcodes.size()) {
+		Instruction instruction = {};
+		instruction.offset = offset;
+		instruction.opcode = chunk->opcodes[offset];
+		instruction.target = chunk->jumpTarget(offset);
+		instruction.line = chunk->getLine(offset);
+		if (instruction.target == -1) {
+			for (int i = 0; i < opcodeOperandBytes[instruction.opcode]; i++) {
+				instruction.operands[i] = chunk->opcodes[offset + 1 + i];
+			}
+		}
+		code.push_back(instruction);
+		offset += chunk->instructionLength(offset);
+	}
+	return code;
+}
+
+void encodeChunk(Chunk* chunk, const std::vector<Instruction>& code)
+{
+	// an instruction keeps the new position of the first original instruction
+	// it was made from. A jump to an instruction that was removed lands on the
+	// next one that is left, or on the new end past the last instruction.
+	std::map<int, int> newOffsets;
+	int size = 0;
+	for (const Instruction& instruction : code) {
+		newOffsets[instruction.offset] = size;
+		size += 1 + opcodeOperandBytes[instruction.opcode];
+	}
+	newOffsets[(int)chunk->opcodes.size()] = size;
+
+	chunk->opcodes.clear();
+	chunk->lines.clear();
+	for (const Instruction& instruction : code) {
+		chunk->WriteChunk(instruction.opcode, instruction.line);
+		if (instruction.target == -1) {
+			for (int i = 0; i < opcodeOperandBytes[instruction.opcode]; i++) {
+				chunk->WriteChunk(instruction.operands[i], instruction.line);
+			}
+			continue;
+		}
+		int next = (int)chunk->opcodes.size() + 2;
+		int target = newOffsets.lower_bound(instruction.target)->second;
+		int distance = instruction.opcode == OP_LOOP ? next - target : target - next;
+		chunk->WriteChunk((distance >> 8) & 0xff, instruction.line);
+		chunk->WriteChunk(distance & 0xff, instruction.line);
+	}
+}
+
+static Instruction fused(const Instruction& first, int opcode, int operand1, int operand2 = 0)
+{
+	Instruction instruction = first;
+	instruction.opcode = opcode;
+	instruction.operands[0] = operand1;
+	instruction.operands[1] = operand2;
+	instruction.target = -1;
+	return instruction;
+}
+
+// Matches code[at..] against a sequence of opcodes. A jump may only enter a
+// sequence at its first instruction, or the fused form would skip its target.
+static bool matches(const std::vector<Instruction>& code, int at, const std::unordered_set<int>& targets, std::initializer_list<int> opcodes)
+{
+	if (at + opcodes.size() > code.size()) return false;
+	int i = at;
+	for (int opcode : opcodes) {
+		if (code[i].opcode != opcode) return false;
+		if (i != at && targets.count(code[i].offset)) return false;
+		i++;
+	}
+	return true;
+}
+
+// Compare-and-branch: a comparison, an optional NOT and a JUMP_IF_FALSE whose
+// taken and fallthrough paths both start by popping the condition. The fused
+// jump pops the operands itself and lands just past the POP at the target.
+static int compareAndJump(int compare, bool negated)
+{
+	switch (compare) {
+	case OP_LESS: return negated ? OP_JUMP_IF_LESS : OP_JUMP_IF_NOT_LESS;
+	case OP_GREATER: return negated ? OP_JUMP_IF_GREATER : OP_JUMP_IF_NOT_GREATER;
+	case OP_EQUAL: return negated ? OP_JUMP_IF_EQUAL : OP_JUMP_IF_NOT_EQUAL;
+	default: return -1;
+	}
+}
+
+void fuseSuperinstructions(Chunk* chunk)
+{
+	std::vector<Instruction> code = decodeChunk(chunk);
+	std::unordered_set<int> targets;
+	std::unordered_map<int, int> indexAt;
+	for (int i = 0; i < (int)code.size(); i++) {
+		indexAt[code[i].offset] = i;
+		if (code[i].target != -1) targets.insert(code[i].target);
+	}
+
+	std::vector<Instruction> fusedCode;
+	int i = 0;
+	while (i < (int)code.size()) {
+		const Instruction& in = code[i];
+
+		// x = x + constant;
+		if ((matches(code, i, targets, { OP_GET_LOCAL, OP_CONSTANT, OP_ADD, OP_SET_LOCAL, OP_POP }) ||
+			matches(code, i, targets, { OP_GET_GLOBAL, OP_CONSTANT, OP_ADD, OP_SET_GLOBAL, OP_POP })) &&
+			in.operands[0] == code[i + 3].operands[0]) {
+			int opcode = in.opcode == OP_GET_LOCAL ? OP_INCREMENT_LOCAL : OP_INCREMENT_GLOBAL;
+			fusedCode.push_back(fused(in, opcode, in.operands[0], code[i + 1].operands[0]));
+			i += 5;
+			continue;
+		}
+
+		if (matches(code, i, targets, { OP_GET_LOCAL, OP_GET_LOCAL, OP_ADD })) {
+			fusedCode.push_back(fused(in, OP_ADD_LOCAL_LOCAL, in.operands[0], code[i + 1].operands[0]));
+			i += 3;
+			continue;
+		}
+
+		int compare = compareAndJump(in.opcode, false);
+		if (compare != -1) {
+			bool negated = matches(code, i, targets, { in.opcode, OP_NOT, OP_JUMP_IF_FALSE, OP_POP });
+			if (negated || matches(code, i, targets, { in.opcode, OP_JUMP_IF_FALSE, OP_POP })) {
+				const Instruction& jump = code[i + (negated ? 2 : 1)];
+				auto target = indexAt.find(jump.target);
+				if (target != indexAt.end() && code[target->second].opcode == OP_POP) {
+					Instruction instruction = fused(in, compareAndJump(in.opcode, negated), 0);
+					instruction.target = jump.target + 1;
+					targets.insert(instruction.target);
+					fusedCode.push_back(instruction);
+					i += negated ? 4 : 3;
+					continue;
+				}
+			}
+		}
+
+		if (matches(code, i, targets, { OP_GET_LOCAL, OP_CONSTANT }) || matches(code, i, targets, { OP_GET_GLOBAL, OP_CONSTANT })) {
+			int opcode = in.opcode == OP_GET_LOCAL ? OP_GET_LOCAL_CONSTANT : OP_GET_GLOBAL_CONSTANT;
+			fusedCode.push_back(fused(in, opcode, in.operands[0], code[i + 1].operands[0]));
+			i += 2;
+			continue;
+		}
+
+		if (matches(code, i, targets, { OP_SET_LOCAL, OP_POP }) || matches(code, i, targets, { OP_SET_GLOBAL, OP_POP })) {
+			int opcode = in.opcode == OP_SET_LOCAL ? OP_SET_LOCAL_POP : OP_SET_GLOBAL_POP;
+			fusedCode.push_back(fused(in, opcode, in.operands[0]));
+			i += 2;
+			continue;
+		}
+
+		fusedCode.push_back(in);
+		i++;
+	}
+
+	if (fusedCode.size() != code.size()) {
+		encodeChunk(chunk, fusedCode);
+	}
+}
+
+int countInstructions(Chunk* chunk)
+{
+	int count = 0;
+	for (int offset = 0; offset < (int)chunk->opcodes.size(); offset += chunk->instructionLength(offset)) {
+		count++;
+	}
+	return count;
+}
+
+// Value pushed by an instruction that only pushes a constant.
+static bool constantValue(Chunk* chunk, const Instruction& instruction, Value* value)
+{
+	switch (instruction.opcode) {
+	case OP_CONSTANT: *value = chunk->constants[instruction.operands[0]]; return true;
+	case OP_CONSTANT_LONG: *value = chunk->constants[(instruction.operands[0] << 8) | instruction.operands[1]]; return true;
+	case OP_NIL: *value = Value(); return true;
+	case OP_TRUE: *value = Value(true); return true;
+	case OP_FALSE: *value = Value(false); return true;
+	default: return false;
+	}
+}
+
+// Pushes a value without side effects or the possibility of an error.
+static bool isPurePush(int opcode)
+{
+	switch (opcode) {
+	case OP_CONSTANT:
+	case OP_CONSTANT_LONG:
+	case OP_NIL:
+	case OP_TRUE:
+	case OP_FALSE:
+	case OP_GET_LOCAL:
+	case OP_GET_LOCAL_LONG:
+		return true;
+	default:
+		return false;
+	}
+}
+
+// Replaces first with an instruction pushing value.
+static bool loadValue(Chunk* chunk, Instruction* first, Value value)
+{
+	first->target = -1;
+	if (value.isNil()) {
+		first->opcode = OP_NIL;
+		return true;
+	}
+	if (value.isBool()) {
+		first->opcode = value.returnBool() ? OP_TRUE : OP_FALSE;
+		return true;
+	}
+	int constant = -1;
+	for (int i = 0; i < (int)chunk->constants.size(); i++) {
+		if (chunk->constants[i].bits == value.bits) {
+			constant = i;
+			break;
+		}
+	}
+	if (constant == -1) {
+		if (chunk->constants.size() > UINT16_MAX) return false;
+		constant = chunk->AddConstant(value);
+	}
+	if (constant <= UINT8_MAX) {
+		first->opcode = OP_CONSTANT;
+		first->operands[0] = constant;
+	}
+	else {
+		first->opcode = OP_CONSTANT_LONG;
+		first->operands[0] = (constant >> 8) & 0xff;
+		first->operands[1] = constant & 0xff;
+	}
+	return true;
+}
+
+// Result of a binary operator on two constants, false where the operation
+// would fail at runtime so the error still happens there.
+static bool foldBinary(Chunk* chunk, int opcode, Value a, Value b, Value* result)
+{
+	if (opcode == OP_EQUAL) {
+		*result = Value(a.ValuesEqual(b));
+		return true;
+	}
+	if (opcode == OP_ADD && a.isString() && b.isString()) {
+		*result = Value(chunk->heap.allocateString(a.returnString() + b.returnString()));
+		return true;
+	}
+	if (!a.isNumber() || !b.isNumber()) return false;
+	double x = a.returnDouble();
+	double y = b.returnDouble();
+	switch (opcode) {
+	case OP_ADD: *result = Value(x + y); return true;
+	case OP_SUB: *result = Value(x - y); return true;
+	case OP_MUL: *result = Value(x * y); return true;
+	case OP_DIV:
+		if (y == 0) return false;
+		*result = Value(x / y);
+		return true;
+	case OP_GREATER: *result = Value(x > y); return true;
+	case OP_LESS: *result = Value(x < y); return true;
+	default: return false;
+	}
+}
+
+// Tries to simplify the last instructions of code, which are consecutive in
+// the original program. Nothing is merged across a jump target.
+// Index of the instruction a jump to target lands on. Like encodeChunk, a
+// target that was removed resolves to the first instruction left after it,
+// or to code.size() past the last one.
+static int landingIndex(const std::map<int, int>& indexAt, int target, int size)
+{
+	auto landing = indexAt.lower_bound(target);
+	return landing == indexAt.end() ? size : landing->second;
+}
+
+static std::map<int, int> indexByOffset(const std::vector<Instruction>& code)
+{
+	std::map<int, int> indexAt;
+	for (int i = 0; i < (int)code.size(); i++) indexAt[code[i].offset] = i;
+	return indexAt;
+}
+
+static bool foldTail(Chunk* chunk, std::vector<Instruction>& code, const std::unordered_set<int>& targets, OptimizerStats* stats)
+{
+	int size = code.size();
+	if (size < 2 || targets.count(code[size - 1].offset)) return false;
+	Instruction& last = code[size - 1];
+	Instruction& previous = code[size - 2];
+	Value a, b, result;
+
+	// a push that is a jump target stays, the jump would land past the POP
+	if (isPurePush(previous.opcode) && last.opcode == OP_POP && !targets.count(previous.offset)) {
+		code.resize(size - 2);
+		if (stats) stats->removed += 2;
+		return true;
+	}
+
+	if (constantValue(chunk, previous, &a)) {
+		bool folded = false;
+		if (last.opcode == OP_NEGATE && a.isNumber()) {
+			folded = loadValue(chunk, &previous, Value(-a.returnDouble()));
+		}
+		else if (last.opcode == OP_NOT && !a.isString()) {
+			folded = loadValue(chunk, &previous, Value(a.isFalsey()));
+		}
+		else if (last.opcode == OP_JUMP_IF_FALSE) {
+			// the condition is known: always jump or never jump
+			if (a.isFalsey()) {
+				last.opcode = OP_JUMP;
+				if (stats) stats->folded++;
+				return true;
+			}
+			code.pop_back();
+			if (stats) stats->folded++;
+			return true;
+		}
+		if (folded) {
+			code.pop_back();
+			if (stats) stats->folded++;
+			return true;
+		}
+	}
+
+	if (size >= 3 && !targets.count(previous.offset)) {
+		Instruction& first = code[size - 3];
+		if (constantValue(chunk, first, &a) && constantValue(chunk, previous, &b) &&
+			foldBinary(chunk, last.opcode, a, b, &result) && loadValue(chunk, &first, result)) {
+			code.resize(size - 2);
+			if (stats) stats->folded++;
+			return true;
+		}
+	}
+	return false;
+}
+
+static bool foldConstants(Chunk* chunk, std::vector<Instruction>& code, OptimizerStats* stats)
+{
+	// a jump whose target an earlier pass removed lands on the next instruction
+	std::map<int, int> indexAt = indexByOffset(code);
+	std::unordered_set<int> targets;
+	for (const Instruction& instruction : code) {
+		if (instruction.target == -1) continue;
+		int landing = landingIndex(indexAt, instruction.target, code.size());
+		if (landing < (int)code.size()) targets.insert(code[landing].offset);
+	}
+	std::vector<Instruction> folded;
+	bool changed = false;
+	for (const Instruction& instruction : code) {
+		folded.push_back(instruction);
+		while (foldTail(chunk, folded, targets, stats)) changed = true;
+	}
+	code = std::move(folded);
+	return changed;
+}
+
+// Points jumps that land on an unconditional jump at its destination, and
+// turns a jump to a return into the return itself.
+static bool threadJumps(std::vector<Instruction>& code, OptimizerStats* stats)
+{
+	std::map<int, int> indexAt = indexByOffset(code);
+
+	bool changed = false;
+	for (Instruction& instruction : code) {
+		if (instruction.target == -1) continue;
+		bool unconditional = instruction.opcode == OP_JUMP || instruction.opcode == OP_LOOP;
+		int target = instruction.target;
+		for (int steps = 0; steps < 16; steps++) {
+			int next = landingIndex(indexAt, target, code.size());
+			if (next == (int)code.size()) break;
+			const Instruction& landing = code[next];
+			// a JUMP_IF_FALSE that was taken takes the next one with the same condition too
+			bool follow = landing.opcode == OP_JUMP || landing.opcode == OP_LOOP ||
+				(instruction.opcode == OP_JUMP_IF_FALSE && landing.opcode == OP_JUMP_IF_FALSE);
+			if (!follow || landing.target == target) break;
+			// conditional jumps only go forward
+			if (!unconditional && landing.target <= instruction.offset) break;
+			target = landing.target;
+		}
+		if (abs(target - instruction.offset) > UINT16_MAX - 3) continue;
+
+		int landing = landingIndex(indexAt, target, code.size());
+		if (unconditional && landing < (int)code.size() &&
+			(code[landing].opcode == OP_RETURN || code[landing].opcode == OP_RETURN_VALUE)) {
+			instruction.opcode = code[landing].opcode;
+			instruction.target = -1;
+			if (stats) stats->threaded++;
+			changed = true;
+			continue;
+		}
+		if (target == instruction.target) continue;
+		if (unconditional) {
+			instruction.opcode = target > instruction.offset ? OP_JUMP : OP_LOOP;
+		}
+		instruction.target = target;
+		if (stats) stats->threaded++;
+		changed = true;
+	}
+	return changed;
+}
+
+// Drops instructions no path from the start reaches, and jumps to the
+// instruction right after them.
+static bool removeDeadCode(std::vector<Instruction>& code, OptimizerStats* stats)
+{
+	std::map<int, int> indexAt = indexByOffset(code);
+
+	std::vector<bool> reachable(code.size(), false);
+	std::vector<int> pending = { 0 };
+	while (!pending.empty()) {
+		int i = pending.back();
+		pending.pop_back();
+		while (i < (int)code.size() && !reachable[i]) {
+			reachable[i] = true;
+			const Instruction& instruction = code[i];
+			if (instruction.target != -1) {
+				pending.push_back(landingIndex(indexAt, instruction.target, code.size()));
+			}
+			if (instruction.opcode == OP_RETURN || instruction.opcode == OP_RETURN_VALUE ||
+				instruction.opcode == OP_JUMP || instruction.opcode == OP_LOOP ||
+				instruction.opcode == OP_TAIL_CALL || instruction.opcode == OP_TAIL_CALL_LONG) break;
+			i++;
+		}
+	}
+
+	std::vector<Instruction> live;
+	for (int i = 0; i < (int)code.size(); i++) {
+		if (reachable[i]) live.push_back(code[i]);
+	}
+	for (int i = 0; i < (int)live.size(); i++) {
+		bool jumpsToNext = (live[i].opcode == OP_JUMP || live[i].opcode == OP_JUMP_IF_FALSE) &&
+			(i + 1 < (int)live.size() ? live[i + 1].offset : INT32_MAX) >= live[i].target && live[i].target > live[i].offset;
+		if (jumpsToNext) {
+			live.erase(live.begin() + i);
+			i--;
+		}
+	}
+
+	int removed = code.size() - live.size();
+	if (stats) stats->removed += removed;
+	code = std::move(live);
+	return removed != 0;
+}
+
+void optimizeChunk(Chunk* chunk, OptimizerStats* stats)
+{
+	std::vector<Instruction> code = decodeChunk(chunk);
+	bool changed = false;
+	for (int pass = 0; pass < 8; pass++) {
+		bool progress = foldConstants(chunk, code, stats);
+		progress |= threadJumps(code, stats);
+		progress |= removeDeadCode(code, stats);
+		if (!progress) break;
+		changed = true;
+	}
+	if (changed) {
+		encodeChunk(chunk, code);
+	}
+}
+
+void OptimizerStats::print()
+{
+	int compiled = 0, optimized = 0, fused = 0, registers = 0;
+	std::cerr << "instructions (compiled / -O1 / fused / register code):\n";
+	for (const ChunkCounts& counts : chunks) {
+		std::cerr << "  " << counts.name << ": " << counts.compiled << " / " << counts.optimized << " / " << counts.fused << " / " << counts.registers << "\n";
+		compiled += counts.compiled;
+		optimized += counts.optimized;
+		fused += counts.fused;
+		registers += counts.registers;
+	}
+	std::cerr << "  total: " << compiled << " / " << optimized << " / " << fused << " / " << registers << "\n";
+	std::cerr << "folded " << folded << ", threaded " << threaded << ", removed " << removed << "\n";
+}
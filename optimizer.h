@@ -0,0 +1,53 @@
+#pragma once
+#ifndef clox_optimizer_h
+#include <vector>
+#include <string>
+#include "chunk.h"
+
+// A decoded instruction. Jumps hold the original offset they land on rather
+// than a distance, so instructions can be merged or dropped around them and
+// the distances recomputed when the code is encoded again.
+class Instruction {
+public:
+	int offset; // where the instruction started in the decoded code
+	int opcode;
+	uint8_t operands[2];
+	int target; // original offset of the jump destination, -1 if not a jump
+	int line;
+};
+
+std::vector<Instruction> decodeChunk(Chunk* chunk);
+void encodeChunk(Chunk* chunk, const std::vector<Instruction>& code);
+
+// Instruction counts per chunk and what the -O1 passes did, printed when the
+// interpreter runs in stats mode.
+class ChunkCounts {
+public:
+	std::string name;
+	int compiled; // as emitted by the compiler
+	int optimized; // after optimizeChunk, same as compiled without -O1
+	int fused; // after fuseSuperinstructions
+	int registers; // register instructions, 0 when not translated
+};
+
+class OptimizerStats {
+public:
+	std::vector<ChunkCounts> chunks;
+	int folded = 0;
+	int threaded = 0;
+	int removed = 0;
+
+	void print();
+};
+
+int countInstructions(Chunk* chunk);
+
+// -O1: constant folding, jump threading, dead code and push/pop removal,
+// repeated until nothing changes. stats may be null.
+void optimizeChunk(Chunk* chunk, OptimizerStats* stats);
+
+// Peephole pass run on every chunk once it is compiled. Replaces the most
+// frequently executed instruction sequences with single superinstructions.
+void fuseSuperinstructions(Chunk* chunk);
+
+#endif // !clox_optimizer_h
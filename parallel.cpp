@@ -0,0 +1,217 @@
+#include "parallel.h"
+#include "compiler.h"
+#include <algorithm>
+#include <atomic>
+#include <thread>
+#include <unordered_set>
+
+// The tokens of the script, with enough look behind and ahead to tell how
+// the compiler will take an identifier: right after var it declares a local,
+// right before '(' it names a function, anywhere else it is a variable.
+class SpanScanner {
+public:
+	Scanner scanner;
+	TokenType beforePrevious = TOKEN_NONE;
+	Token previous = Token(TOKEN_NONE, 0, 0, 0);
+	Token current = Token(TOKEN_NONE, 0, 0, 0);
+
+	void advance() {
+		beforePrevious = previous.type;
+		previous = current;
+		current = scanner.scanToken();
+	}
+
+	// From just after the function's '{' up to and including the '}' that
+	// follows its return statement, which is where the compiler ends it.
+	bool scanBody(FunctionSpan* span, std::unordered_set<std::string_view>* declared) {
+		std::vector<std::string_view> used;
+		std::unordered_set<std::string_view> seen;
+		bool returned = false;
+		for (;;) {
+			advance();
+			if (previous.type == TOKEN_IDENTIFIER) {
+				std::string_view name = std::string_view(previous.start, previous.length);
+				if (beforePrevious == TOKEN_VAR) {
+					declared->insert(name);
+				}
+				else if (current.type != TOKEN_LEFT_PAREN && seen.insert(name).second) {
+					used.push_back(name);
+				}
+			}
+			switch (current.type) {
+			case TOKEN_EOF:
+			case TOKEN_ERROR:
+			case TOKEN_FUN:
+				return false;
+			case TOKEN_RETURN:
+				returned = true;
+				break;
+			case TOKEN_SEMICOLON:
+				if (!returned) break;
+				advance();
+				if (current.type != TOKEN_RIGHT_BRACE) return false;
+				span->end = scanner.current;
+				span->endLine = scanner.line;
+				for (std::string_view name : used) {
+					if (declared->count(name) == 0) {
+						span->globals.push_back(std::string(name));
+					}
+				}
+				return true;
+			default:
+				break;
+			}
+		}
+	}
+};
+
+bool findFunctionSpans(std::string_view source, std::vector<FunctionSpan>* spans)
+{
+	SpanScanner tokens;
+	tokens.scanner.reset(source);
+	int depth = 0;
+	for (;;) {
+		tokens.advance();
+		Token token = tokens.current;
+		switch (token.type) {
+		case TOKEN_EOF:
+			return true;
+		case TOKEN_ERROR:
+			return false;
+		case TOKEN_LEFT_BRACE:
+			depth++;
+			break;
+		case TOKEN_RIGHT_BRACE:
+			depth--;
+			break;
+		case TOKEN_FUN: {
+			// only a declaration that is a statement of its own at the top level
+			TokenType before = tokens.previous.type;
+			if (depth != 0 || (before != TOKEN_NONE && before != TOKEN_SEMICOLON && before != TOKEN_RIGHT_BRACE)) {
+				return false;
+			}
+			FunctionSpan span;
+			span.start = token.start;
+			span.line = token.line;
+			std::unordered_set<std::string_view> declared;
+			tokens.advance();
+			if (tokens.current.type != TOKEN_IDENTIFIER) return false;
+			tokens.advance();
+			if (tokens.current.type != TOKEN_LEFT_PAREN) return false;
+			tokens.advance();
+			while (tokens.current.type == TOKEN_IDENTIFIER) {
+				declared.insert(std::string_view(tokens.current.start, tokens.current.length));
+				tokens.advance();
+				if (tokens.current.type == TOKEN_COMMA) tokens.advance();
+				else break;
+			}
+			if (tokens.current.type != TOKEN_RIGHT_PAREN) return false;
+			tokens.advance();
+			if (tokens.current.type != TOKEN_LEFT_BRACE) return false;
+			if (!tokens.scanBody(&span, &declared)) return false;
+			spans->push_back(std::move(span));
+			break;
+		}
+		default:
+			break;
+		}
+	}
+}
+
+// Messages of compiles whose work may be thrown away are dropped; if they
+// matter the serial compile prints them again.
+static void silence(Compiler* compiler, std::ostream* sink)
+{
+	compiler->messages = sink;
+	compiler->parser.errors = sink;
+}
+
+static void addStats(OptimizerStats* total, const OptimizerStats& stats)
+{
+	total->chunks.insert(total->chunks.end(), stats.chunks.begin(), stats.chunks.end());
+	total->folded += stats.folded;
+	total->threaded += stats.threaded;
+	total->removed += stats.removed;
+}
+
+bool compileInParallel(Compiler* compiler)
+{
+	if (compiler->source.size() < PARALLEL_COMPILE_MIN_SOURCE) {
+		return false;
+	}
+	std::vector<FunctionSpan> spans;
+	if (!findFunctionSpans(compiler->source, &spans) || spans.size() < PARALLEL_COMPILE_MIN_FUNCTIONS) {
+		return false;
+	}
+	auto* functions = compiler->functions;
+	auto* function_table = compiler->function_table;
+	GlobalTable* globals = compiler->globals;
+	size_t functionCount = function_table->size();
+	int globalCount = globals->size();
+	std::ostream sink(nullptr);
+
+	// declares the functions and compiles everything outside them
+	Compiler main = Compiler(compiler->source, functions, function_table, compiler->native_functions, globals);
+	main.optimizationLevel = compiler->optimizationLevel;
+	main.registerBackend = compiler->registerBackend;
+	main.functionSpans = &spans;
+	silence(&main, &sink);
+	bool ok = main.compile() && main.warnings == 0 && main.spansMatched && main.nextSpan == spans.size();
+
+	// the bodies, each thread taking the next one not yet started
+	std::vector<OptimizerStats> stats(spans.size());
+	std::atomic<size_t> next(0);
+	std::atomic<bool> failed(!ok);
+	auto work = [&]() {
+		std::ostream sink(nullptr);
+		for (size_t i = next++; i < spans.size() && !failed; i = next++) {
+			Compiler body = Compiler(compiler->source, functions, function_table, compiler->native_functions, globals);
+			body.optimizationLevel = compiler->optimizationLevel;
+			body.registerBackend = compiler->registerBackend;
+			body.readOnlyTables = true;
+			silence(&body, &sink);
+			spans[i].compiled = body.compileFunction(spans[i]);
+			if (!spans[i].compiled) {
+				failed = true;
+			}
+			stats[i] = std::move(body.optimizerStats);
+		}
+	};
+	if (ok) {
+		std::vector<std::thread> pool;
+		int threads = std::min<int>(compiler->threads, spans.size());
+		for (int i = 1; i < threads; i++) {
+			pool.emplace_back(work);
+		}
+		work();
+		for (std::thread& thread : pool) {
+			thread.join();
+		}
+	}
+
+	if (failed) {
+		while (function_table->size() > functionCount) {
+			functions->erase(function_table->back()->function.funcName);
+			function_table->pop_back();
+		}
+		globals->truncate(globalCount);
+		// main has code in it now, the serial compile starts over on a new one
+		std::shared_ptr<Chunk> fresh = std::make_shared<Chunk>(0);
+		fresh->function = (*function_table)[0]->function;
+		(*functions)["main"] = fresh;
+		(*function_table)[0] = fresh.get();
+		compiler->compiling_chunk = fresh.get();
+		return false;
+	}
+
+	// the compiled bodies replace the placeholders, in declaration order
+	for (size_t i = 0; i < spans.size(); i++) {
+		Chunk* chunk = spans[i].compiled.get();
+		(*functions)[chunk->function.funcName] = spans[i].compiled;
+		(*function_table)[chunk->function.index] = chunk;
+		addStats(&compiler->optimizerStats, stats[i]);
+	}
+	// main finishes last in a serial compile too
+	addStats(&compiler->optimizerStats, main.optimizerStats);
+	return true;
+}
@@ -0,0 +1,47 @@
+#pragma once
+#ifndef clox_parallel_h
+#include <memory>
+#include <string>
+#include <string_view>
+#include <vector>
+
+class Chunk;
+class Compiler;
+
+// Parallel compilation. A pre-pass over the tokens finds every function
+// declared at the top level of the script. The main compile then declares
+// each one in order and skips its body, and the bodies are compiled on a pool
+// of threads, each into a chunk of its own, while the function and global
+// tables are only read. The chunks go into the tables in declaration order,
+// so the result does not depend on the number of threads or their timing.
+//
+// Anything out of the ordinary (an error or a warning anywhere, a function
+// declared inside another, a global the pre-pass did not see) throws the
+// parallel work away and the script is compiled serially, so messages and
+// behaviour are always those of the serial compiler.
+
+// Below these the threads cost more than they save.
+#define PARALLEL_COMPILE_MIN_SOURCE (256 * 1024)
+#define PARALLEL_COMPILE_MIN_FUNCTIONS 16
+
+class FunctionSpan {
+public:
+	const char* start; // the fun keyword
+	int line;
+	const char* end; // just past the closing brace
+	int endLine;
+	// names the body uses that it never declares, so can only be globals, in
+	// the order the body first uses them
+	std::vector<std::string> globals;
+	Chunk* declared = nullptr; // placeholder the main compile put in the tables
+	std::shared_ptr<Chunk> compiled;
+};
+
+// False when the script has something the pre-pass does not handle.
+bool findFunctionSpans(std::string_view source, std::vector<FunctionSpan>* spans);
+
+// Compiles compiler's source with compiler->threads threads. Returns false,
+// with the tables as they were, when the script has to be compiled serially.
+bool compileInParallel(Compiler* compiler);
+
+#endif // !clox_parallel_h
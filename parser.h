@@ -1,11 +1,156 @@
 #pragma once
+#include <cstring>
+#include <cstdint>
+#include <array>
+#include <bit>
+#include <string_view>
+
+// The scanner finds the end of whitespace runs, comments, identifiers and
+// strings 16 bytes at a time with SSE2 where the compiler targets it, and a
+// byte at a time otherwise or in a build with VM_NO_SIMD defined. It never
+// reads at or past the end of the source, so the source needs no terminating
+// NUL and can be a read only mapping of the script file.
+#if (defined(__SSE2__) || defined(_M_X64)) && !defined(VM_NO_SIMD)
+#include <emmintrin.h>
+#define SCANNER_SSE2
+#endif
+
+#ifdef SCANNER_SSE2
+// Bit i is set when byte i of the block is c.
+static inline unsigned bytesEqual(__m128i block, char c) {
+	return _mm_movemask_epi8(_mm_cmpeq_epi8(block, _mm_set1_epi8(c)));
+}
+
+// low <= c <= high in one signed compare: the add moves low to -128, so
+// the range becomes everything below -128 + (high - low + 1).
+static inline unsigned bytesInRange(__m128i block, char low, char high) {
+	__m128i shifted = _mm_add_epi8(block, _mm_set1_epi8((char)(0x80 - low)));
+	return _mm_movemask_epi8(_mm_cmplt_epi8(shifted, _mm_set1_epi8((char)(-128 + high - low + 1))));
+}
+#endif
+
+static inline bool isBlank(char c) {
+	return c == ' ' || c == '\t' || c == '\r' || c == '\n';
+}
+
+// Skips spaces, tabs, carriage returns and newlines, counting the newlines.
+static inline const char* skipBlankRun(const char* p, const char* end, int* line) {
+	// most runs are the single space between two tokens, not worth a block
+	if (p == end || !isBlank(p[0])) return p;
+	if (p + 1 == end || !isBlank(p[1])) {
+		if (p[0] == '\n') (*line)++;
+		return p + 1;
+	}
+#ifdef SCANNER_SSE2
+	while (end - p >= 16) {
+		__m128i block = _mm_loadu_si128((const __m128i*)p);
+		unsigned newlines = bytesEqual(block, '\n');
+		unsigned blank = newlines | bytesEqual(block, ' ') | bytesEqual(block, '\t') | bytesEqual(block, '\r');
+		if (blank != 0xFFFF) {
+			int run = std::countr_zero(~blank);
+			*line += std::popcount(newlines & ((1u << run) - 1));
+			return p + run;
+		}
+		*line += std::popcount(newlines);
+		p += 16;
+	}
+#endif
+	while (p < end && isBlank(*p)) {
+		if (*p == '\n') (*line)++;
+		p++;
+	}
+	return p;
+}
+
+// The newline ending a comment, or end.
+static inline const char* findLineEnd(const char* p, const char* end) {
+#ifdef SCANNER_SSE2
+	while (end - p >= 16) {
+		unsigned newline = bytesEqual(_mm_loadu_si128((const __m128i*)p), '\n');
+		if (newline != 0) return p + std::countr_zero(newline);
+		p += 16;
+	}
+#endif
+	while (p < end && *p != '\n') p++;
+	return p;
+}
+
+// The first byte that cannot continue an identifier.
+static inline const char* skipIdentifierRun(const char* p, const char* end) {
+#ifdef SCANNER_SSE2
+	while (end - p >= 16) {
+		__m128i block = _mm_loadu_si128((const __m128i*)p);
+		// setting bit 5 folds upper case onto lower case and moves nothing
+		// else into a..z
+		__m128i folded = _mm_or_si128(block, _mm_set1_epi8(0x20));
+		unsigned word = bytesInRange(folded, 'a', 'z') | bytesInRange(block, '0', '9') | bytesEqual(block, '_');
+		if (word != 0xFFFF) return p + std::countr_zero(~word);
+		p += 16;
+	}
+#endif
+	while (p < end && ((*p >= 'a' && *p <= 'z') || (*p >= 'A' && *p <= 'Z') || (*p >= '0' && *p <= '9') || *p == '_')) p++;
+	return p;
+}
+
+// The closing quote or a newline, whichever comes first, or end.
+static inline const char* findStringBreak(const char* p, const char* end) {
+#ifdef SCANNER_SSE2
+	while (end - p >= 16) {
+		__m128i block = _mm_loadu_si128((const __m128i*)p);
+		unsigned found = bytesEqual(block, '"') | bytesEqual(block, '\n');
+		if (found != 0) return p + std::countr_zero(found);
+		p += 16;
+	}
+#endif
+	while (p < end && *p != '"' && *p != '\n') p++;
+	return p;
+}
+
+class Keyword {
+public:
+	const char* name;
+	int length;
+	TokenType type;
+};
+
+static constexpr Keyword keywords[] = {
+	{ "and", 3, TOKEN_AND }, { "class", 5, TOKEN_CLASS }, { "else", 4, TOKEN_ELSE },
+	{ "false", 5, TOKEN_FALSE }, { "for", 3, TOKEN_FOR }, { "fun", 3, TOKEN_FUN },
+	{ "if", 2, TOKEN_IF }, { "nil", 3, TOKEN_NIL }, { "or", 2, TOKEN_OR },
+	{ "print", 5, TOKEN_PRINT }, { "return", 6, TOKEN_RETURN }, { "super", 5, TOKEN_SUPER },
+	{ "this", 4, TOKEN_THIS }, { "true", 4, TOKEN_TRUE }, { "var", 3, TOKEN_VAR },
+	{ "while", 5, TOKEN_WHILE },
+};
+
+#define KEYWORD_MIN_LENGTH 2
+#define KEYWORD_MAX_LENGTH 6
+
+// Perfect hash: every keyword gets a slot of its own in a table of 32, so an
+// identifier is a keyword only if it equals the one keyword in its slot.
+static constexpr unsigned keywordHash(const char* start, int length) {
+	return ((unsigned char)start[0] + 5 * (unsigned char)start[length - 1] + length) & 31;
+}
+
 class Scanner {
 public:
 	const char* start;
 	const char* current;
+	const char* end;
 	int line;
+
+	void reset(std::string_view source) {
+		start = source.data();
+		current = source.data();
+		end = source.data() + source.size();
+		line = 1;
+	}
+
 	bool isAtEnd() {
-		return *current == '\0';
+		return current == end;
+	}
+
+	char peek() {
+		return isAtEnd() ? '\0' : *current;
 	}
 
 	bool isDigit(char c) {
@@ -31,40 +176,19 @@ public:
 		return true;
 	}
 
-	void consumeWhitespace() {
-		if (*current == ' ' || *current == '\r' || *current == '\t') {
-			while (*current == ' ' || *current == '\r' || *current == '\t')
-				advance();
-		}
-		start = current;
-	}
-
-	void consumeEmptyLine() {
-		if (*current =='\n') {
-			while (*current == '\n') {
-				advance();
-				consumeWhitespace();
-			}
+	// Whitespace, newlines and // comments in any order.
+	void skipWhitespace() {
+		for (;;) {
+			current = skipBlankRun(current, end, &line);
+			if (end - current < 2 || current[0] != '/' || current[1] != '/') return;
+			current = findLineEnd(current + 2, end);
 		}
-		start = current;
 	}
 
 	Token scanToken() {
+		skipWhitespace();
 		start = current;
-		// Handle for whitespaces 
 		if (isAtEnd()) return makeToken(TOKEN_EOF);
-		consumeWhitespace();
-		if (*current == '\n') {
-			line++;
-			advance();
-			consumeWhitespace();
-			consumeEmptyLine();
-		}
-
-		// Handle for comments
-		if (*current == '/' && *current + 1 == '/') {
-			while (*current != '\n' && !isAtEnd()) advance();
-		}
 
 		char c = advance();
 		if (isDigit(c)) return number();
@@ -114,9 +238,10 @@ public:
 	}
 
 	Token String() {
-		while (*current != '"' && !isAtEnd()) {
-			if (*current == '\n') line++;
-			advance();
+		current = findStringBreak(current, end);
+		while (peek() == '\n') {
+			line++;
+			current = findStringBreak(current + 1, end);
 		}
 		if (isAtEnd()) {
 			return errorToken("Unterminated String");
@@ -126,12 +251,12 @@ public:
 	}
 
 	Token number() {
-		while (isDigit(*current) && !isAtEnd()) {
+		while (isDigit(peek())) {
 			advance();
 		}
-		if (*current == '.') {
+		if (peek() == '.') {
 			advance();
-			while (isDigit(*current)) {
+			while (isDigit(peek())) {
 				advance();
 			}
 		}
@@ -139,58 +264,29 @@ public:
 	}
 
 	Token identifier() {
-		while ((isAlpha(*current) || isDigit(*current)) && !isAtEnd()) {
-			advance();
-		}
+		current = skipIdentifierRun(current, end);
 		return makeToken(TokenTypeIdentifier());
 	}
 
 	TokenType TokenTypeIdentifier() {
-
-		switch (*start) {
-		case 'a': return checkKeyword(1, 2, "nd", TOKEN_AND);
-		case 'c': return checkKeyword(1, 4, "lass", TOKEN_CLASS);
-		case 'e': return checkKeyword(1, 3, "lse", TOKEN_ELSE);
-		case 'f': {
-			if (current - start > 1) {
-				switch (start[1]) {
-				case 'a': return checkKeyword(2, 3, "lse", TOKEN_FALSE);
-				case 'u': return checkKeyword(2, 1, "n", TOKEN_FUN);
-				case 'o': return checkKeyword(2, 1, "r", TOKEN_FOR);
-				}
-
+		static constexpr std::array<int8_t, 32> slots = [] {
+			std::array<int8_t, 32> slots{};
+			slots.fill(-1);
+			for (int i = 0; i < (int)(sizeof(keywords) / sizeof(keywords[0])); i++) {
+				unsigned slot = keywordHash(keywords[i].name, keywords[i].length);
+				// two keywords in one slot stop the build here
+				if (slots[slot] != -1) throw "keyword hash collision";
+				slots[slot] = i;
 			}
-			break;
-		}
-		case 'i': return checkKeyword(1, 1, "f", TOKEN_IF);
-		case 'n': return checkKeyword(1, 2, "il", TOKEN_NIL);
-		case 'o': return checkKeyword(1, 1, "r", TOKEN_OR);
-		case 'p': return checkKeyword(1, 4, "rint", TOKEN_PRINT);
-		case 'r': return checkKeyword(1, 5, "eturn", TOKEN_RETURN);
-		case 's': return checkKeyword(1, 4, "uper", TOKEN_SUPER);
-		case 't': {
-			if (current - start > 1) {
-				switch (start[1]) {
-				case 'h': return checkKeyword(2, 2, "is", TOKEN_THIS);
-				case 'r': return checkKeyword(2, 2, "ue", TOKEN_TRUE);
-				}
-			}
-			break;
-		}
-		case 'v': return checkKeyword(1, 2, "ar", TOKEN_VAR);
-		case 'w': return checkKeyword(1, 4, "hile", TOKEN_WHILE);
-
-		}
-		return TOKEN_IDENTIFIER;
-	}
-
-	TokenType checkKeyword(int startC, int length, const char* check_str, TokenType checkToken) {
-		if (current - start == startC + length &&
-			memcmp(start + startC, check_str, length) == 0) {
-			return checkToken;
-		}
-
-		return TOKEN_IDENTIFIER;
+			return slots;
+		}();
+		int length = (int)(current - start);
+		if (length < KEYWORD_MIN_LENGTH || length > KEYWORD_MAX_LENGTH) return TOKEN_IDENTIFIER;
+		int index = slots[keywordHash(start, length)];
+		if (index == -1) return TOKEN_IDENTIFIER;
+		const Keyword& keyword = keywords[index];
+		if (keyword.length != length || memcmp(start, keyword.name, length) != 0) return TOKEN_IDENTIFIER;
+		return keyword.type;
 	}
 };
 
@@ -201,6 +297,7 @@ public:
 	Scanner* scanner;
 	bool had_error = 0;
 	const char* source;
+	std::ostream* errors = &std::cerr;
 
 	Parser(const char* src, Scanner* scanner) : source(src), current(TOKEN_NONE, 0, 0, 0), previous(TOKEN_NONE, 0, 0, 0) {
 		this->scanner = scanner;
@@ -225,8 +322,8 @@ public:
 	}
 
 	void errorAt(Token* token, const char* message) {
-		std::cerr << "Error at " << token->line << "\n";
-		std::cerr << message << "\n";
+		*errors << "Error at " << token->line << "\n";
+		*errors << message << "\n";
 		had_error = 1;
 	}
 
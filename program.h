@@ -0,0 +1,21 @@
+#pragma once
+#ifndef clox_program_h
+#include "chunk.h"
+#include "globals.h"
+#include <memory>
+#include <vector>
+
+// Isolates. A script is compiled once into a Program, which nothing changes
+// afterwards, and any number of VMs then run it at the same time, one per
+// thread, each with its own stack, frames, globals and heap. A running VM
+// quickens its bytecode in place and counts calls for the JIT, so each one
+// runs a copy of the code (Chunk::runnableCopy); the string constants are
+// shared by all of them and only ever read.
+class Program {
+public:
+	std::vector<std::shared_ptr<const Chunk>> functions; // the function table, main first
+	GlobalTable globals;
+	bool registers = false; // has register code for the register VM
+};
+
+#endif // !clox_program_h
@@ -0,0 +1,392 @@
+#include "regcode.h"
+#include "chunk.h"
+#include <algorithm>
+
+// Where the translator currently has the value of one stack slot. Pushing a
+// local or a constant emits nothing; the value is only copied into its own
+// register when something needs it there.
+class Operand {
+public:
+	enum Kind { IN_PLACE, REGISTER, CONSTANT };
+	Kind kind;
+	int index; // register or constant index, unused when IN_PLACE
+	int producer; // instruction that wrote an IN_PLACE value, -1 if unknown
+};
+
+class RegisterTranslator {
+public:
+	Chunk* chunk;
+	const std::vector<int>& depths;
+	const std::vector<Chunk*>& functions;
+	std::vector<RegInstruction> code;
+	std::vector<int> lines;
+	std::vector<Operand> stack;
+	std::vector<std::pair<int, int>> jumps; // instruction, stack code offset it jumps to
+	int registerCount = 0;
+	int negatedCompare = -1; // a NOT applied to the comparison just before it
+	int line = 0;
+	bool failed = false;
+
+	RegisterTranslator(Chunk* chunk, const std::vector<int>& depths, const std::vector<Chunk*>& functions) : chunk(chunk), depths(depths), functions(functions) {}
+
+	int emit(int opcode, int a, int b = 0, int c = 0) {
+		if (a > UINT16_MAX || b > UINT16_MAX || c > UINT16_MAX) failed = true;
+		code.push_back({ (uint16_t)opcode, (uint16_t)a, (uint16_t)b, (uint16_t)c });
+		lines.push_back(line);
+		return code.size() - 1;
+	}
+
+	void push(Operand::Kind kind, int index, int producer = -1) {
+		stack.push_back({ kind, index, producer });
+		if ((int)stack.size() > registerCount) registerCount = (int)stack.size();
+	}
+
+	Operand pop() {
+		Operand operand = stack.back();
+		stack.pop_back();
+		return operand;
+	}
+
+	void pushConstant(int constant) {
+		if (constant >= REG_CONSTANT) failed = true;
+		push(Operand::CONSTANT, constant);
+	}
+
+	void pushValue(Value value) {
+		for (int i = 0; i < (int)chunk->constants.size(); i++) {
+			if (chunk->constants[i].bits == value.bits) {
+				pushConstant(i);
+				return;
+			}
+		}
+		pushConstant(chunk->AddConstant(value));
+	}
+
+	// Register or constant operand for a value taken off the stack at position.
+	int rk(const Operand& operand, int position) {
+		switch (operand.kind) {
+		case Operand::REGISTER: return operand.index;
+		case Operand::CONSTANT: return operand.index | REG_CONSTANT;
+		default: return position;
+		}
+	}
+
+	// Copies the value of stack slot position into its own register.
+	void materialize(int position) {
+		Operand& operand = stack[position];
+		if (operand.kind == Operand::IN_PLACE) return;
+		int opcode = operand.kind == Operand::REGISTER ? REG_MOVE : REG_LOADK;
+		operand.producer = emit(opcode, position, operand.index);
+		operand.kind = Operand::IN_PLACE;
+	}
+
+	// Brings every slot from position up into its own register, the state
+	// every jump and jump target assumes.
+	void flush(int from = 0) {
+		for (int i = from; i < (int)stack.size(); i++) materialize(i);
+	}
+
+	void reset(int depth) {
+		stack.clear();
+		for (int i = 0; i < depth; i++) push(Operand::IN_PLACE, 0);
+	}
+
+	static bool writesOnlyA(int opcode) {
+		switch (opcode) {
+		case REG_MOVE:
+		case REG_LOADK:
+		case REG_GET_GLOBAL:
+		case REG_ADD:
+		case REG_SUB:
+		case REG_MUL:
+		case REG_DIV:
+		case REG_EQUAL:
+		case REG_GREATER:
+		case REG_LESS:
+		case REG_NOT:
+		case REG_NEGATE:
+			return true;
+		default:
+			return false;
+		}
+	}
+
+	void setLocal(int slot) {
+		int top = stack.size() - 1;
+		Operand value = stack[top];
+		if (value.kind == Operand::REGISTER && value.index == slot) return;
+		// slots still reading the old value of the local need their own copy
+		for (int i = 0; i < top; i++) {
+			if (stack[i].kind == Operand::REGISTER && stack[i].index == slot) materialize(i);
+		}
+		// x = x + 1 computes straight into the local: ADD R(x), R(x), K
+		if (value.kind == Operand::IN_PLACE && value.producer == (int)code.size() - 1 && value.producer != -1 && writesOnlyA(code.back().opcode)) {
+			code.back().a = slot;
+		}
+		else if (value.kind == Operand::CONSTANT) {
+			emit(REG_LOADK, slot, value.index);
+		}
+		else {
+			emit(REG_MOVE, slot, rk(value, top));
+		}
+		stack[slot] = { Operand::IN_PLACE, 0, -1 };
+		stack[top] = { Operand::REGISTER, slot, -1 };
+	}
+
+	static int binaryOpcode(int opcode) {
+		switch (opcode) {
+		case OP_ADD: return REG_ADD;
+		case OP_SUB: return REG_SUB;
+		case OP_MUL: return REG_MUL;
+		case OP_DIV: return REG_DIV;
+		case OP_EQUAL: return REG_EQUAL;
+		case OP_GREATER: return REG_GREATER;
+		default: return REG_LESS;
+		}
+	}
+
+	static int compareAndJump(int compare, bool negated) {
+		switch (compare) {
+		case REG_LESS: return negated ? REG_JUMP_IF_LESS : REG_JUMP_IF_NOT_LESS;
+		case REG_GREATER: return negated ? REG_JUMP_IF_GREATER : REG_JUMP_IF_NOT_GREATER;
+		case REG_EQUAL: return negated ? REG_JUMP_IF_EQUAL : REG_JUMP_IF_NOT_EQUAL;
+		default: return -1;
+		}
+	}
+
+	// JUMP_IF_FALSE on a comparison whose result is popped on both paths
+	// becomes one compare-and-jump; the result is never stored.
+	bool fuseCompare(int offset, int target, int flushedFrom) {
+		Operand condition = stack.back();
+		if (condition.kind != Operand::IN_PLACE || condition.producer == -1 || condition.producer != flushedFrom - 1) return false;
+		int next = offset + 3;
+		if (next >= (int)chunk->opcodes.size() || target >= (int)chunk->opcodes.size() || chunk->opcodes[next] != OP_POP || chunk->opcodes[target] != OP_POP) return false;
+		bool negated = condition.producer == negatedCompare;
+		int compare = negated ? condition.producer - 1 : condition.producer;
+		int opcode = compareAndJump(code[compare].opcode, negated);
+		if (opcode == -1) return false;
+		// copies made by the flush never touch the comparison's operands or
+		// result, so the comparison can move after them
+		std::rotate(code.begin() + compare, code.begin() + flushedFrom, code.end());
+		std::rotate(lines.begin() + compare, lines.begin() + flushedFrom, lines.end());
+		if (negated) {
+			code.pop_back();
+			lines.pop_back();
+		}
+		compare = code.size() - 1;
+		code[compare].opcode = opcode;
+		jumps.push_back({ compare, target });
+		return true;
+	}
+
+	// Whether the stack holds everything the instruction at offset reads, so
+	// no operand indexes past it.
+	bool fitsStack(int offset, int opcode, int operand) {
+		int size = stack.size();
+		switch (opcode) {
+		case OP_GET_LOCAL:
+		case OP_GET_LOCAL_LONG:
+		case OP_SET_LOCAL:
+		case OP_SET_LOCAL_LONG:
+			return operand < size;
+		case OP_ADD:
+		case OP_SUB:
+		case OP_MUL:
+		case OP_DIV:
+		case OP_EQUAL:
+		case OP_GREATER:
+		case OP_LESS:
+			return size >= 2;
+		case OP_SET_GLOBAL:
+		case OP_SET_GLOBAL_LONG:
+		case OP_DEFINE_GLOBAL:
+		case OP_DEFINE_GLOBAL_LONG:
+		case OP_POP:
+		case OP_PRINT:
+		case OP_NOT:
+		case OP_NEGATE:
+		case OP_JUMP_IF_FALSE:
+		case OP_RETURN_VALUE:
+			return size >= 1;
+		case OP_CALL:
+		case OP_CALL_LONG:
+		case OP_CALL_NATIVE: {
+			int next = offset + chunk->instructionLength(offset);
+			return next < (int)depths.size() && depths[next] >= 1 && depths[next] <= size;
+		}
+		case OP_TAIL_CALL:
+		case OP_TAIL_CALL_LONG:
+			return operand < (int)functions.size() && functions[operand]->function.arity <= size;
+		default:
+			return true;
+		}
+	}
+
+	bool translate() {
+		std::vector<bool> isTarget(chunk->opcodes.size() + 1, false);
+		for (int offset = 0; offset < (int)chunk->opcodes.size(); offset += chunk->instructionLength(offset)) {
+			int target = chunk->jumpTarget(offset);
+			if (target < -1 || target >= (int)isTarget.size()) return false;
+			if (target != -1) isTarget[target] = true;
+		}
+
+		std::vector<int> start(chunk->opcodes.size() + 1, -1);
+		bool fallsThrough = true;
+		reset(depths[0]);
+		for (int offset = 0; offset < (int)chunk->opcodes.size() && !failed; offset += chunk->instructionLength(offset)) {
+			if (depths[offset] == -1) {
+				fallsThrough = false;
+				continue;
+			}
+			line = chunk->getLine(offset);
+			if (isTarget[offset] || !fallsThrough) {
+				if (fallsThrough) flush();
+				reset(depths[offset]);
+			}
+			if ((int)stack.size() != depths[offset]) return false;
+			start[offset] = code.size();
+			fallsThrough = true;
+
+			int opcode = chunk->opcodes[offset];
+			int operand = opcodeOperandBytes[opcode] == 2 ? (chunk->opcodes[offset + 1] << 8) | chunk->opcodes[offset + 2] : opcodeOperandBytes[opcode] == 1 ? chunk->opcodes[offset + 1] : 0;
+			if (!fitsStack(offset, opcode, operand)) return false;
+			int top = stack.size() - 1;
+			switch (opcode) {
+			case OP_CONSTANT:
+			case OP_CONSTANT_LONG:
+				pushConstant(operand);
+				break;
+			case OP_NIL: pushValue(Value()); break;
+			case OP_TRUE: pushValue(Value(true)); break;
+			case OP_FALSE: pushValue(Value(false)); break;
+
+			case OP_GET_LOCAL:
+			case OP_GET_LOCAL_LONG:
+				// the slot may still be waiting for its initializer to be copied in
+				materialize(operand);
+				push(Operand::REGISTER, operand);
+				break;
+			case OP_SET_LOCAL:
+			case OP_SET_LOCAL_LONG:
+				setLocal(operand);
+				break;
+			case OP_GET_GLOBAL:
+			case OP_GET_GLOBAL_LONG:
+				push(Operand::IN_PLACE, 0, emit(REG_GET_GLOBAL, stack.size(), operand));
+				break;
+			case OP_SET_GLOBAL:
+			case OP_SET_GLOBAL_LONG:
+				emit(REG_SET_GLOBAL, operand, rk(stack[top], top));
+				break;
+			case OP_DEFINE_GLOBAL:
+			case OP_DEFINE_GLOBAL_LONG:
+				emit(REG_DEFINE_GLOBAL, operand, rk(stack[top], top));
+				pop();
+				break;
+			case OP_POP:
+				pop();
+				break;
+			case OP_PRINT:
+				emit(REG_PRINT, rk(stack[top], top));
+				pop();
+				break;
+
+			case OP_ADD:
+			case OP_SUB:
+			case OP_MUL:
+			case OP_DIV:
+			case OP_EQUAL:
+			case OP_GREATER:
+			case OP_LESS: {
+				Operand c = pop();
+				Operand b = pop();
+				int position = stack.size();
+				int instruction = emit(binaryOpcode(opcode), position, rk(b, position), rk(c, position + 1));
+				push(Operand::IN_PLACE, 0, instruction);
+				break;
+			}
+			case OP_NOT:
+			case OP_NEGATE: {
+				Operand b = pop();
+				int position = stack.size();
+				int instruction = emit(opcode == OP_NOT ? REG_NOT : REG_NEGATE, position, rk(b, position));
+				if (opcode == OP_NOT && b.kind == Operand::IN_PLACE && b.producer != -1 && b.producer == instruction - 1 &&
+					compareAndJump(code[b.producer].opcode, false) != -1) {
+					negatedCompare = instruction;
+				}
+				push(Operand::IN_PLACE, 0, instruction);
+				break;
+			}
+
+			case OP_JUMP:
+			case OP_LOOP:
+				flush();
+				jumps.push_back({ emit(REG_JUMP, 0), chunk->jumpTarget(offset) });
+				fallsThrough = false;
+				break;
+			case OP_JUMP_IF_FALSE: {
+				int target = chunk->jumpTarget(offset);
+				int flushedFrom = code.size();
+				flush();
+				if (fuseCompare(offset, target, flushedFrom)) break;
+				jumps.push_back({ emit(REG_JUMP_IF_FALSE, 0, top), target });
+				break;
+			}
+
+			case OP_CALL:
+			case OP_CALL_LONG:
+			case OP_CALL_NATIVE: {
+				// the result replaces the arguments, so it lands one below the next depth
+				int next = offset + chunk->instructionLength(offset);
+				int base = depths[next] - 1;
+				flush(base);
+				emit(opcode == OP_CALL_NATIVE ? REG_CALL_NATIVE : REG_CALL, base, operand);
+				while ((int)stack.size() > base) pop();
+				push(Operand::IN_PLACE, 0);
+				break;
+			}
+
+			case OP_TAIL_CALL:
+			case OP_TAIL_CALL_LONG: {
+				int base = stack.size() - functions[operand]->function.arity;
+				flush(base);
+				emit(REG_TAIL_CALL, base, operand);
+				fallsThrough = false;
+				break;
+			}
+
+			case OP_RETURN:
+				emit(REG_RETURN, 0);
+				fallsThrough = false;
+				break;
+			case OP_RETURN_VALUE:
+				emit(REG_RETURN_VALUE, rk(stack[top], top));
+				fallsThrough = false;
+				break;
+
+			default:
+				// superinstructions and quickened opcodes are made after translation
+				return false;
+			}
+		}
+
+		if (failed || registerCount >= REG_CONSTANT) return false;
+		for (auto& jump : jumps) {
+			if (jump.second < 0 || jump.second >= (int)start.size() || start[jump.second] == -1) return false;
+			code[jump.first].a = start[jump.second];
+		}
+		return true;
+	}
+};
+
+bool translateToRegisters(Chunk* chunk, const std::vector<int>& depths, const std::vector<Chunk*>& functions)
+{
+	chunk->registerCode.clear();
+	chunk->registerLines.clear();
+	RegisterTranslator translator(chunk, depths, functions);
+	if (!translator.translate()) return false;
+	chunk->registerCode = std::move(translator.code);
+	chunk->registerLines = std::move(translator.lines);
+	chunk->registerCount = translator.registerCount;
+	return true;
+}
@@ -0,0 +1,66 @@
+#pragma once
+#ifndef clox_regcode_h
+#include <cstdint>
+#include <vector>
+
+// Three address register code, the alternative to the stack bytecode that
+// the register VM (VM::runRegisters) executes. Registers are the frame's
+// stack slots: register n is the value the stack code would keep n slots
+// above the frame base, so locals, arguments and the call convention are the
+// same for both engines. R(x) is register x, K(x) constant x, and RK(x) is a
+// constant when x has REG_CONSTANT set, otherwise a register.
+#define REG_OPCODE_LIST(X) \
+	X(REG_MOVE) /* R(a) = R(b) */ \
+	X(REG_LOADK) /* R(a) = K(b) */ \
+	X(REG_GET_GLOBAL) /* R(a) = global b */ \
+	X(REG_SET_GLOBAL) /* global a = RK(b) */ \
+	X(REG_DEFINE_GLOBAL) /* global a = RK(b) */ \
+	X(REG_ADD) /* R(a) = RK(b) + RK(c) */ \
+	X(REG_SUB) \
+	X(REG_MUL) \
+	X(REG_DIV) \
+	X(REG_EQUAL) \
+	X(REG_GREATER) \
+	X(REG_LESS) \
+	X(REG_NOT) /* R(a) = !RK(b) */ \
+	X(REG_NEGATE) /* R(a) = -RK(b) */ \
+	X(REG_PRINT) /* print RK(a) */ \
+	X(REG_JUMP) /* jump to instruction a */ \
+	X(REG_JUMP_IF_FALSE) /* jump to a if R(b) is falsey */ \
+	X(REG_JUMP_IF_LESS) /* jump to a if RK(b) < RK(c) */ \
+	X(REG_JUMP_IF_NOT_LESS) \
+	X(REG_JUMP_IF_GREATER) \
+	X(REG_JUMP_IF_NOT_GREATER) \
+	X(REG_JUMP_IF_EQUAL) \
+	X(REG_JUMP_IF_NOT_EQUAL) \
+	X(REG_CALL) /* R(a) = function b called with arguments from R(a) up */ \
+	X(REG_CALL_NATIVE) /* R(a) = native b called with arguments from R(a) up */ \
+	X(REG_TAIL_CALL) /* return function b called with arguments from R(a) up, reusing the frame */ \
+	X(REG_RETURN) \
+	X(REG_RETURN_VALUE) /* return RK(a) */
+
+typedef enum {
+#define REG_OPCODE_ENUM(op) op,
+	REG_OPCODE_LIST(REG_OPCODE_ENUM)
+#undef REG_OPCODE_ENUM
+} RegOpCode;
+
+#define REG_CONSTANT 0x8000
+
+class RegInstruction {
+public:
+	uint16_t opcode;
+	uint16_t a;
+	uint16_t b;
+	uint16_t c;
+};
+
+class Chunk;
+
+// Translates the stack code of chunk into chunk->registerCode. depths holds
+// the stack depth before every instruction, -1 where none is reachable.
+// Returns false and leaves registerCode empty if the chunk uses more
+// registers, constants or instructions than the encoding has room for.
+bool translateToRegisters(Chunk* chunk, const std::vector<int>& depths, const std::vector<Chunk*>& functions);
+
+#endif // !clox_regcode_h
@@ -0,0 +1,505 @@
+#include "server.h"
+#include "cache.h"
+#include "mapped_file.h"
+#include "vm.h"
+#include <algorithm>
+#include <chrono>
+#include <iomanip>
+#include <iostream>
+#include <sstream>
+#include <thread>
+#ifdef SERVER_POSIX
+#include <cerrno>
+#include <climits>
+#include <cstdlib>
+#include <cstring>
+#include <fcntl.h>
+#include <spawn.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#endif
+
+VM* VmPool::acquire()
+{
+	std::unique_lock<std::mutex> lock(mutex);
+	released.wait(lock, [&]() { return !idle.empty(); });
+	VM* vm = idle.back();
+	idle.pop_back();
+	return vm;
+}
+
+void VmPool::release(VM* vm)
+{
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		idle.push_back(vm);
+	}
+	released.notify_one();
+}
+
+#ifdef SERVER_POSIX
+
+// Everything a request's script prints, on std::cout or std::cerr, goes to
+// the output of the request the thread is running; other threads print as
+// usual. Unbuffered, so threads never share a put area.
+static thread_local std::string* captured = nullptr;
+
+class ThreadOutput : public std::streambuf {
+public:
+	std::streambuf* original = nullptr;
+
+protected:
+	std::streamsize xsputn(const char* data, std::streamsize count) override {
+		if (captured != nullptr) {
+			captured->append(data, count);
+			return count;
+		}
+		return original->sputn(data, count);
+	}
+
+	int overflow(int c) override {
+		if (c == traits_type::eof()) return 0;
+		char byte = (char)c;
+		return xsputn(&byte, 1) == 1 ? c : traits_type::eof();
+	}
+
+	int sync() override {
+		return captured != nullptr ? 0 : original->pubsync();
+	}
+};
+
+static ThreadOutput coutOutput;
+static ThreadOutput cerrOutput;
+
+static bool readMore(int fd, std::string* buffer)
+{
+	char chunk[65536];
+	ssize_t count;
+	do {
+		count = recv(fd, chunk, sizeof(chunk), 0);
+	} while (count < 0 && errno == EINTR);
+	if (count <= 0) return false;
+	buffer->append(chunk, count);
+	return true;
+}
+
+// The header lines of requests and responses, which are short.
+static bool readLine(int fd, std::string* buffer, std::string* line)
+{
+	size_t newline;
+	while ((newline = buffer->find('\n')) == std::string::npos) {
+		if (buffer->size() > 256 || !readMore(fd, buffer)) return false;
+	}
+	line->assign(*buffer, 0, newline);
+	buffer->erase(0, newline + 1);
+	return true;
+}
+
+static bool readBytes(int fd, std::string* buffer, size_t length, std::string* data)
+{
+	while (buffer->size() < length) {
+		if (!readMore(fd, buffer)) return false;
+	}
+	data->assign(*buffer, 0, length);
+	buffer->erase(0, length);
+	return true;
+}
+
+static bool writeAll(int fd, std::string_view data)
+{
+	while (!data.empty()) {
+		ssize_t count = send(fd, data.data(), data.size(), MSG_NOSIGNAL);
+		if (count < 0 && errno == EINTR) continue;
+		if (count <= 0) return false;
+		data.remove_prefix(count);
+	}
+	return true;
+}
+
+// "<word> <length>", the header line of a request or a response.
+static bool parseHeader(const std::string& line, std::string* word, size_t* length)
+{
+	size_t space = line.find(' ');
+	if (space == std::string::npos) return false;
+	char* end;
+	unsigned long long value = strtoull(line.c_str() + space + 1, &end, 10);
+	if (*end != '\0' || end == line.c_str() + space + 1 || value > SERVER_REQUEST_MAX) return false;
+	word->assign(line, 0, space);
+	*length = (size_t)value;
+	return true;
+}
+
+static bool socketAddress(const std::string& path, sockaddr_un* address)
+{
+	memset(address, 0, sizeof(*address));
+	address->sun_family = AF_UNIX;
+	if (path.size() >= sizeof(address->sun_path)) return false;
+	memcpy(address->sun_path, path.c_str(), path.size() + 1);
+	return true;
+}
+
+Server::Server(const std::string& path, int count, const VM& vm)
+{
+	this->path = path;
+	optimizationLevel = vm.optimizationLevel;
+	registers = vm.useRegisters;
+	for (int i = 0; i < count; i++) {
+		vms.all.push_back(std::make_unique<VM>());
+		vms.all.back()->useJit = vm.useJit;
+		vms.idle.push_back(vms.all.back().get());
+	}
+}
+
+Server::~Server()
+{
+	if (listener >= 0) {
+		close(listener);
+		unlink(path.c_str());
+	}
+}
+
+bool Server::listen()
+{
+	sockaddr_un address;
+	if (!socketAddress(path, &address)) {
+		std::cout << "Socket path too long: " << path << "\n";
+		return false;
+	}
+	// a socket left behind by a server that did not stop cleanly
+	struct stat status;
+	if (lstat(path.c_str(), &status) == 0 && S_ISSOCK(status.st_mode)) {
+		unlink(path.c_str());
+	}
+	listener = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (listener < 0 || bind(listener, (sockaddr*)&address, sizeof(address)) != 0 || ::listen(listener, SOMAXCONN) != 0) {
+		std::cout << "Cannot listen on " << path << ": " << strerror(errno) << "\n";
+		if (listener >= 0) close(listener);
+		listener = -1;
+		return false;
+	}
+	coutOutput.original = std::cout.rdbuf(&coutOutput);
+	cerrOutput.original = std::cerr.rdbuf(&cerrOutput);
+	return true;
+}
+
+void Server::serve()
+{
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		accepting = true;
+	}
+	for (;;) {
+		int fd = accept4(listener, nullptr, nullptr, SOCK_CLOEXEC);
+		if (fd < 0) {
+			if (errno == EINTR || errno == ECONNABORTED) continue;
+			// stop shut the listener down
+			break;
+		}
+		std::lock_guard<std::mutex> lock(mutex);
+		connections++;
+		std::thread(&Server::serveConnection, this, fd).detach();
+	}
+	std::lock_guard<std::mutex> lock(mutex);
+	accepting = false;
+	idle.notify_all();
+}
+
+void Server::stop()
+{
+	shutdown(listener, SHUT_RDWR);
+	{
+		std::unique_lock<std::mutex> lock(mutex);
+		idle.wait(lock, [&]() { return !accepting && connections == 0; });
+	}
+	std::cout.rdbuf(coutOutput.original);
+	std::cerr.rdbuf(cerrOutput.original);
+}
+
+void Server::serveConnection(int fd)
+{
+	std::string buffer;
+	std::string line;
+	std::string kind;
+	std::string payload;
+	std::string response;
+	size_t length;
+	while (readLine(fd, &buffer, &line)) {
+		std::string output;
+		std::string status;
+		bool valid = parseHeader(line, &kind, &length) && (kind == "path" || kind == "source");
+		if (!valid) {
+			status = "error";
+			output = "Malformed request\n";
+		}
+		else if (!readBytes(fd, &buffer, length, &payload)) {
+			break;
+		}
+		else if (kind == "source") {
+			status = run(payload, &output);
+		}
+		else {
+			MappedFile script;
+			if (script.open(payload)) {
+				status = run(script.view(), &output);
+			}
+			else {
+				status = "error";
+				output = "file not found\n";
+			}
+		}
+		response = status + " " + std::to_string(output.size()) + "\n";
+		response += output;
+		// after a malformed request the rest of the stream means nothing
+		if (!writeAll(fd, response) || !valid) break;
+	}
+	close(fd);
+	// notified under the lock, so stop cannot return and the server go away
+	// while this thread still uses it
+	std::lock_guard<std::mutex> lock(mutex);
+	connections--;
+	idle.notify_all();
+}
+
+std::string Server::run(std::string_view source, std::string* output)
+{
+	captured = output;
+	uint64_t hash = hashSource(source, optimizationLevel, registers);
+	std::shared_ptr<const Program> program = cache.find(hash, source);
+	if (!program) {
+		VM compiler;
+		compiler.optimizationLevel = optimizationLevel;
+		compiler.useRegisters = registers;
+		program = compiler.compileProgram(source);
+		if (program) {
+			cache.insert(hash, source, program);
+		}
+	}
+	std::string status = "compile-error";
+	if (program) {
+		VM* vm = vms.acquire();
+		if (vm->program == program) {
+			vm->resetGlobals();
+		}
+		else {
+			vm->loadProgram(program);
+		}
+		status = vm->runMain() == INTERPRET_OK ? "ok" : "runtime-error";
+		// coroutines are per request
+		vm->scheduler.reset();
+		vms.release(vm);
+	}
+	captured = nullptr;
+	return status;
+}
+
+ServerClient::~ServerClient()
+{
+	if (fd >= 0) close(fd);
+}
+
+bool ServerClient::connect(const std::string& path)
+{
+	sockaddr_un address;
+	if (!socketAddress(path, &address)) return false;
+	fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	return fd >= 0 && ::connect(fd, (sockaddr*)&address, sizeof(address)) == 0;
+}
+
+bool ServerClient::request(const std::string& kind, std::string_view payload, std::string* status, std::string* output)
+{
+	std::string message = kind + " " + std::to_string(payload.size()) + "\n";
+	message += payload;
+	std::string line;
+	size_t length;
+	return writeAll(fd, message) && readLine(fd, &buffer, &line) && parseHeader(line, status, &length) && readBytes(fd, &buffer, length, output);
+}
+
+int serveForever(const std::string& path, const VM& vm)
+{
+	int count = std::max(1, (int)std::thread::hardware_concurrency());
+	Server server(path, count, vm);
+	if (!server.listen()) return 1;
+	std::cout << "Serving on " << path << " with " << count << " VMs" << std::endl;
+	server.serve();
+	return 0;
+}
+
+int sendScript(const std::string& socket, const std::string& script)
+{
+	// the server may run in another directory
+	char* absolute = realpath(script.c_str(), nullptr);
+	if (absolute == nullptr) {
+		std::cout << "file not found" << "\n";
+		return 1;
+	}
+	std::string path = absolute;
+	free(absolute);
+	ServerClient client;
+	std::string status;
+	std::string output;
+	if (!client.connect(socket) || !client.request("path", path, &status, &output)) {
+		std::cout << "Cannot reach a server on " << socket << "\n";
+		return 1;
+	}
+	std::cout << output;
+	return status == "ok" ? 0 : 1;
+}
+
+static double percentile(std::vector<double>& latencies, double fraction)
+{
+	if (latencies.empty()) return 0;
+	size_t index = std::min(latencies.size() - 1, (size_t)(fraction * latencies.size()));
+	std::nth_element(latencies.begin(), latencies.begin() + index, latencies.end());
+	return latencies[index];
+}
+
+static void report(const char* label, std::vector<double>& latencies, double seconds)
+{
+	std::ostringstream line;
+	line << std::fixed << std::setprecision(1);
+	line << label << ": " << (long)(latencies.size() / seconds) << " requests/sec, p50 " << percentile(latencies, 0.5) << "us, p99 " << percentile(latencies, 0.99) << "us\n";
+	std::cout << line.str();
+}
+
+// Latencies in microseconds of requests sent for about a second from clients
+// threads, each with a connection of its own.
+static bool loadServer(const std::string& socket, const std::string& kind, std::string_view payload, int clients, std::vector<double>* latencies, double* seconds)
+{
+	std::vector<std::vector<double>> measured(clients);
+	std::vector<char> failed(clients, 0);
+	auto start = std::chrono::steady_clock::now();
+	auto work = [&](int index) {
+		ServerClient client;
+		if (!client.connect(socket)) {
+			failed[index] = 1;
+			return;
+		}
+		std::string status;
+		std::string output;
+		for (;;) {
+			auto before = std::chrono::steady_clock::now();
+			if (before - start > std::chrono::seconds(1)) break;
+			if (!client.request(kind, payload, &status, &output) || status != "ok") {
+				failed[index] = 1;
+				return;
+			}
+			measured[index].push_back(std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - before).count());
+		}
+	};
+	std::vector<std::thread> threads;
+	for (int i = 0; i < clients; i++) {
+		threads.emplace_back(work, i);
+	}
+	for (std::thread& thread : threads) {
+		thread.join();
+	}
+	*seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+	for (std::vector<double>& some : measured) {
+		latencies->insert(latencies->end(), some.begin(), some.end());
+	}
+	return std::find(failed.begin(), failed.end(), 1) == failed.end();
+}
+
+// Latencies of running the script in a new process each time, the way the
+// interpreter runs without a server, with its output thrown away.
+static bool loadProcesses(const char* self, const std::vector<std::string>& arguments, std::vector<double>* latencies, double* seconds)
+{
+	std::vector<char*> argv;
+	argv.push_back((char*)self);
+	for (const std::string& argument : arguments) {
+		argv.push_back((char*)argument.c_str());
+	}
+	argv.push_back(nullptr);
+	posix_spawn_file_actions_t actions;
+	posix_spawn_file_actions_init(&actions);
+	posix_spawn_file_actions_addopen(&actions, 1, "/dev/null", O_WRONLY, 0);
+	posix_spawn_file_actions_addopen(&actions, 2, "/dev/null", O_WRONLY, 0);
+	auto start = std::chrono::steady_clock::now();
+	bool ok = true;
+	while (std::chrono::steady_clock::now() - start < std::chrono::seconds(1)) {
+		auto before = std::chrono::steady_clock::now();
+		pid_t pid;
+		int status;
+		if (posix_spawnp(&pid, self, &actions, nullptr, argv.data(), environ) != 0 || waitpid(pid, &status, 0) != pid || status != 0) {
+			ok = false;
+			break;
+		}
+		latencies->push_back(std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - before).count());
+	}
+	*seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+	posix_spawn_file_actions_destroy(&actions);
+	return ok;
+}
+
+void benchmarkServer(const std::string& script, const VM& vm, const char* self)
+{
+	MappedFile code;
+	if (!code.open(script)) {
+		std::cout << "file not found" << "\n";
+		return;
+	}
+	char* absolute = realpath(script.c_str(), nullptr);
+	std::string path = absolute;
+	free(absolute);
+	std::string socket = "/tmp/clox-bench-" + std::to_string(getpid()) + ".sock";
+	int count = std::max(1, (int)std::thread::hardware_concurrency());
+	Server server(socket, count, vm);
+	if (!server.listen()) return;
+	std::thread serving(&Server::serve, &server);
+	const char* kinds[] = { "source", "path" };
+	for (int clients : { 1, 4 }) {
+		for (const char* kind : kinds) {
+			std::vector<double> latencies;
+			double seconds;
+			bool ok = loadServer(socket, kind, kind == std::string("path") ? std::string_view(path) : code.view(), clients, &latencies, &seconds);
+			std::string label = std::string("server, ") + kind + ", " + std::to_string(clients) + (clients == 1 ? " client" : " clients");
+			if (!ok) {
+				std::cout << label << ": a request failed" << "\n";
+				continue;
+			}
+			report(label.c_str(), latencies, seconds);
+		}
+	}
+	server.stop();
+	serving.join();
+
+	// the same options, and the bytecode cache next to the script, so no compile either
+	std::vector<std::string> arguments;
+	if (vm.optimizationLevel == 1) arguments.push_back("-O1");
+	if (vm.useRegisters) arguments.push_back("-registers");
+	if (!vm.useJit) arguments.push_back("-nojit");
+	arguments.push_back(script);
+	std::vector<double> latencies;
+	double seconds;
+	if (!loadProcesses(self, arguments, &latencies, &seconds)) {
+		std::cout << "process per request: the script failed" << "\n";
+		return;
+	}
+	report("process per request", latencies, seconds);
+}
+
+#else
+
+static void unsupported()
+{
+	std::cout << "Server mode is not supported on this platform" << "\n";
+}
+
+Server::Server(const std::string& path, int count, const VM& vm) {}
+Server::~Server() {}
+bool Server::listen() { unsupported(); return false; }
+void Server::serve() {}
+void Server::stop() {}
+void Server::serveConnection(int fd) {}
+std::string Server::run(std::string_view source, std::string* output) { return "error"; }
+ServerClient::~ServerClient() {}
+bool ServerClient::connect(const std::string& path) { unsupported(); return false; }
+bool ServerClient::request(const std::string& kind, std::string_view payload, std::string* status, std::string* output) { return false; }
+int serveForever(const std::string& path, const VM& vm) { unsupported(); return 1; }
+int sendScript(const std::string& socket, const std::string& script) { unsupported(); return 1; }
+void benchmarkServer(const std::string& script, const VM& vm, const char* self) { unsupported(); }
+
+#endif
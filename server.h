@@ -0,0 +1,145 @@
+#pragma once
+#ifndef clox_server_h
+#include "program.h"
+#include <condition_variable>
+#include <cstdint>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+// Server mode. The interpreter listens on a Unix socket and runs the scripts
+// clients send it, so a request pays neither process startup nor, once the
+// script has been seen, compilation. Compiled scripts are kept as Programs in
+// an LRU cache keyed by a hash of the source and the options, so an edited
+// script is simply a new entry. Requests run on a fixed set of VMs made at
+// startup; a VM that ran the same Program before runs it again on the code it
+// already quickened and JIT compiled, after making its globals undefined.
+//
+// A connection carries any number of requests, one at a time. A request is a
+// line "path <length>" or "source <length>" followed by that many bytes of a
+// script's path or of its source. The response is a line "<status> <length>"
+// followed by that many bytes of everything the script printed, error
+// messages included; status is ok, compile-error, runtime-error or error (a
+// malformed request or a script that cannot be read).
+// Linux and other POSIX systems only.
+#if defined(__unix__) || defined(__APPLE__)
+#define SERVER_POSIX
+#endif
+
+#define SERVER_CACHE_ENTRIES 256
+#define SERVER_REQUEST_MAX (64 * 1024 * 1024)
+
+class VM;
+
+class CachedProgram {
+public:
+	uint64_t hash;
+	std::string source; // compared on a hit, so a hash collision is just a miss
+	std::shared_ptr<const Program> program;
+};
+
+class ProgramCache {
+public:
+	size_t capacity;
+	std::mutex mutex;
+	std::list<CachedProgram> entries; // most recently used first
+	std::unordered_map<uint64_t, std::list<CachedProgram>::iterator> byHash;
+
+	ProgramCache(size_t capacity) {
+		this->capacity = capacity;
+	}
+
+	std::shared_ptr<const Program> find(uint64_t hash, std::string_view source) {
+		std::lock_guard<std::mutex> lock(mutex);
+		auto entry = byHash.find(hash);
+		if (entry == byHash.end() || entry->second->source != source) {
+			return nullptr;
+		}
+		entries.splice(entries.begin(), entries, entry->second);
+		return entry->second->program;
+	}
+
+	void insert(uint64_t hash, std::string_view source, std::shared_ptr<const Program> program) {
+		std::lock_guard<std::mutex> lock(mutex);
+		auto entry = byHash.find(hash);
+		if (entry != byHash.end()) {
+			entries.erase(entry->second);
+		}
+		entries.push_front({ hash, std::string(source), program });
+		byHash[hash] = entries.begin();
+		if (entries.size() > capacity) {
+			byHash.erase(entries.back().hash);
+			entries.pop_back();
+		}
+	}
+};
+
+// The VMs requests run on, made once. A request waits while all are busy.
+class VmPool {
+public:
+	std::mutex mutex;
+	std::condition_variable released;
+	std::vector<std::unique_ptr<VM>> all;
+	std::vector<VM*> idle;
+
+	VM* acquire();
+	void release(VM* vm);
+};
+
+class Server {
+public:
+	std::string path;
+	int optimizationLevel = 0;
+	bool registers = false;
+	ProgramCache cache = ProgramCache(SERVER_CACHE_ENTRIES);
+	VmPool vms;
+	int listener = -1;
+	std::mutex mutex;
+	std::condition_variable idle;
+	bool accepting = false; // serve is running
+	int connections = 0; // threads serving a connection
+
+	// count VMs like vm, which is not used otherwise
+	Server(const std::string& path, int count, const VM& vm);
+	~Server();
+
+	// False, after a message, when the socket cannot be made.
+	bool listen();
+	// Serves every connection on a thread of its own until stop.
+	void serve();
+	// Stops accepting and waits for serve to return and the open connections
+	// to close; serve must have started.
+	void stop();
+
+	void serveConnection(int fd);
+	// Runs a script and returns its status; what it printed is in output.
+	std::string run(std::string_view source, std::string* output);
+};
+
+// One connection to a server, for clients and the load generator.
+class ServerClient {
+public:
+	int fd = -1;
+	std::string buffer; // read ahead of the next response
+
+	~ServerClient();
+	bool connect(const std::string& path);
+	// kind is "path" or "source". False when the connection failed.
+	bool request(const std::string& kind, std::string_view payload, std::string* status, std::string* output);
+};
+
+// -serve: serves on path until the process is killed, with one VM per core
+// and vm's options.
+int serveForever(const std::string& path, const VM& vm);
+// -send: runs script on the server at socket and prints what it printed.
+int sendScript(const std::string& socket, const std::string& script);
+// -servebench: request latency through a server in this process, from one
+// and from four clients sending the script's source and then its path, and
+// then of a new process per run for comparison. self is argv[0].
+void benchmarkServer(const std::string& script, const VM& vm, const char* self);
+
+#endif // !clox_server_h
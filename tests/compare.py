@@ -0,0 +1,68 @@
+# Runs the scripts in each suite below with the interpreter given on the command
+# line, once per set of options, and fails when a run crashes or prints
+# something different from the -O0 run. Scripts in optimizer/ are compared
+# against -O1 and the register VM, scripts in registers/ against the register
+# VM, scripts in coroutines/ against -O1, -nojit and the register VM. A .repl
+# file is typed into the REPL line by line instead. Where a script has a .out
+# file next to it, the -O0 run must print exactly that.
+#   python3 tests/compare.py ./interpreter
+import os
+import pathlib
+import subprocess
+import sys
+
+interpreter = sys.argv[1] if len(sys.argv) > 1 else "./interpreter"
+here = pathlib.Path(__file__).parent
+suites = {
+    "optimizer": [["-O1"], ["-registers"], ["-O1", "-registers"]],
+    "registers": [["-registers"], ["-O1", "-registers"]],
+    "coroutines": [["-O1"], ["-nojit"], ["-registers"]],
+}
+# coroutines/fifo.lox reads and writes this pipe
+fifo = "/tmp/lox_compare.fifo"
+
+
+def run(script, options):
+    command = [interpreter, "-nocache"] + options
+    if script.suffix == ".repl":
+        result = subprocess.run(command, input=script.read_text(), capture_output=True, text=True, timeout=60)
+    else:
+        result = subprocess.run(command + [str(script)], capture_output=True, text=True, timeout=60)
+    # an ASan build warns that it cannot follow swapcontext; that is not output
+    stderr = "".join(line for line in result.stderr.splitlines(True) if "ASan doesn't fully support" not in line)
+    return result.returncode, result.stdout + stderr
+
+
+if os.path.exists(fifo):
+    os.remove(fifo)
+os.mkfifo(fifo)
+
+failures = 0
+for suite, variants in suites.items():
+    for script in sorted((here / suite).iterdir()):
+        if script.suffix not in (".lox", ".repl"):
+            continue
+        status, expected = run(script, ["-O0"])
+        if status < 0:
+            print(f"FAIL {suite}/{script.name} -O0: killed by signal {-status}")
+            failures += 1
+            continue
+        reference = script.with_suffix(".out")
+        if reference.exists() and reference.read_text() != expected:
+            print(f"FAIL {suite}/{script.name} -O0: output differs from {reference.name}")
+            failures += 1
+        for options in variants:
+            status, output = run(script, options)
+            name = f"{suite}/{script.name} {' '.join(options)}"
+            if status < 0:
+                print(f"FAIL {name}: killed by signal {-status}")
+                failures += 1
+            elif output != expected:
+                print(f"FAIL {name}: output differs from -O0")
+                failures += 1
+            else:
+                print(f"ok   {name}")
+
+os.remove(fifo)
+print(f"{failures} failed")
+sys.exit(1 if failures else 0)
@@ -1,6 +1,5 @@
 #pragma once
 
-#include <functional>
 typedef enum {
 	// Single-character tokens.
 	TOKEN_LEFT_PAREN, TOKEN_RIGHT_PAREN,
@@ -37,9 +36,12 @@ typedef enum {
 	PREC_PRIMARY
 } Precedence;
 
+class Compiler;
+typedef void (Compiler::*ParseFn)();
+
 typedef struct {
-	std::function<void()> prefix;
-	std::function<void()> infix;
+	ParseFn prefix;
+	ParseFn infix;
 	Precedence precedence;
 } ParseRule;
 
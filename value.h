@@ -1,97 +1,141 @@
 #pragma once
-#include <variant>
+#include <cstdint>
+#include <cstring>
 #include <iostream>
-#include <stdexcept>
 #include "objects.h"
 
+// Values are NaN-boxed into a single 64 bit word. Any bit pattern that is not
+// a quiet NaN with the QNAN bits set is a plain double. Quiet NaNs carry either
+// a small tag (nil, true, false) in the low bits or, when the sign bit is set,
+// a pointer to a heap Object.
+#define QNAN     ((uint64_t)0x7ffc000000000000)
+#define SIGN_BIT ((uint64_t)0x8000000000000000)
+
+#define TAG_NIL   1
+#define TAG_FALSE 2
+#define TAG_TRUE  3
+#define TAG_UNDEFINED 4 // marks a global slot that has never been assigned
+
 class Value {
 public:
-	bool isNill;
-	std::variant<bool, double, std::string> value;
+	uint64_t bits;
 
 	Value(bool value) {
-		this->isNill = 0;
-		this->value = value;
+		this->bits = value ? (QNAN | TAG_TRUE) : (QNAN | TAG_FALSE);
 	}
 
 	Value(double value) {
-		this->isNill = 0;
-		this->value = value;
+		memcpy(&this->bits, &value, sizeof(double));
 	}
 
-	Value(std::string string) {
-		this->isNill = 0;
-		this->value = string;
+	Value(Object* object) {
+		this->bits = SIGN_BIT | QNAN | (uint64_t)(uintptr_t)object;
 	}
 
 	Value() {
-		this->isNill = 1;
+		this->bits = QNAN | TAG_NIL;
 	}
 
-	void printValue() {
-		if (isNill) {
-			std::cout << "NILL" << "\n";
-			return;
-		}
-		switch (value.index()) {
-		case 0:
-			std::cout << std::get<bool>(value) << "\n";
-			break;
-		case 1:
-			std::cout << std::get<double>(value) << "\n";
-			break;
-		case 2:
-			std::cout << std::get<std::string>(value) << "\n";
-			break;
-		}
+	static Value undefined() {
+		Value value;
+		value.bits = QNAN | TAG_UNDEFINED;
+		return value;
 	}
 
-	bool returnBool() {
-		if (std::holds_alternative<bool>(value)) {
-			return std::get<bool>(value);
-		}
-		else if (std::holds_alternative<double>(value)) {
-			return std::get<double>(value);
-		}
-		else {
-			throw std::bad_variant_access();
-		}
+	// string literals would otherwise silently convert to bool
+	Value(const char* value) = delete;
+
+	bool isNil() const {
+		return bits == (QNAN | TAG_NIL);
 	}
 
-	double returnDouble() {
-		if (std::holds_alternative<double>(value)) {
-			return std::get <double>(value);
-		}
-		else {
-			throw std::bad_variant_access();
-		}
+	bool isBool() const {
+		return (bits | 1) == (QNAN | TAG_TRUE);
+	}
+
+	bool isUndefined() const {
+		return bits == (QNAN | TAG_UNDEFINED);
+	}
+
+	bool isNumber() const {
+		return (bits & QNAN) != QNAN;
+	}
+
+	bool isObject() const {
+		return (bits & (QNAN | SIGN_BIT)) == (QNAN | SIGN_BIT);
+	}
+
+	bool isString() const {
+		return isObject() && returnObject()->type == OBJ_STRING;
+	}
+
+	bool isArray() const {
+		return isObject() && returnObject()->type == OBJ_ARRAY;
+	}
+
+	bool isFalsey() const {
+		if (isNil()) return true;
+		if (isBool()) return !returnBool();
+		if (isNumber()) return returnDouble() == 0;
+		return false;
+	}
+
+	bool returnBool() const {
+		return bits == (QNAN | TAG_TRUE);
+	}
+
+	double returnDouble() const {
+		double value;
+		memcpy(&value, &bits, sizeof(double));
+		return value;
+	}
+
+	Object* returnObject() const {
+		return (Object*)(uintptr_t)(bits & ~(SIGN_BIT | QNAN));
+	}
+
+	StringObject* returnStringObject() const {
+		return (StringObject*)returnObject();
+	}
+
+	const std::string& returnString() const {
+		return returnStringObject()->string;
 	}
 
-	std::string returnString() {
-		if (std::holds_alternative<std::string>(value)) {
-			return std::get <std::string>(value);
+	std::vector<double>& returnArray() const {
+		return ((ArrayObject*)returnObject())->values;
+	}
+
+	void printValue() const {
+		if (isNil()) {
+			std::cout << "NILL" << "\n";
+		}
+		else if (isBool()) {
+			std::cout << returnBool() << "\n";
+		}
+		else if (isNumber()) {
+			std::cout << returnDouble() << "\n";
+		}
+		else if (isString()) {
+			std::cout << returnString() << "\n";
 		}
-		else {
-			throw std::bad_variant_access();
+		else if (isArray()) {
+			std::cout << "[";
+			const std::vector<double>& values = returnArray();
+			for (size_t i = 0; i < values.size(); i++) {
+				std::cout << (i == 0 ? "" : ", ") << values[i];
+			}
+			std::cout << "]" << "\n";
 		}
 	}
 
-	bool ValuesEqual(Value b) {
-		if (this->value.index() != b.value.index()) return false;
-		if (this->isNill && b.isNill) return true;
-
-		switch (this->value.index()) {
-		case 0:
-			return this->returnBool() == b.returnBool();
-			break;
-		case 1:
+	bool ValuesEqual(Value b) const {
+		if (this->isNumber() && b.isNumber()) {
 			return this->returnDouble() == b.returnDouble();
-			break;
-		case 2:
+		}
+		if (this->isString() && b.isString()) {
 			return this->returnString() == b.returnString();
 		}
+		return this->bits == b.bits;
 	}
 };
-
-
-
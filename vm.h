@@ -3,13 +3,45 @@
 #include <iostream>
 #include "debug.h"
 #include <string>
+#include <string_view>
+#include <thread>
 #include "compiler.h"
 #include "value.h"
-#include "variant"
 #include <unordered_map>
 #include "native_functions.h"
+#include "globals.h"
+#include "cache.h"
+#include "program.h"
+#include "coroutine.h"
 
 #define FRAMES_MAX 1000
+#define STACK_MAX (FRAMES_MAX * 256)
+#define GC_INITIAL_THRESHOLD (1024 * 1024)
+
+// Threaded dispatch: with GCC/Clang every handler jumps straight to the next
+// one through a table of label addresses. Other compilers (or a build with
+// VM_NO_COMPUTED_GOTO defined) fall back to the portable switch.
+#if (defined(__GNUC__) || defined(__clang__)) && !defined(VM_NO_COMPUTED_GOTO)
+#define VM_COMPUTED_GOTO
+#endif
+
+// Building with VM_OPCODE_STATS counts every dispatched opcode and opcode
+// pair and prints the totals after each script.
+#ifdef VM_OPCODE_STATS
+#define VM_COUNT() opcodeStats.record(*ip)
+#else
+#define VM_COUNT() ((void)0)
+#endif
+
+#ifdef VM_COMPUTED_GOTO
+#define VM_DISPATCH() VM_COUNT(); goto *dispatch_table[*ip++];
+#define VM_CASE(op) label_##op
+#define VM_NEXT() do { VM_COUNT(); goto *dispatch_table[*ip++]; } while (0)
+#else
+#define VM_DISPATCH() VM_COUNT(); switch (*ip++)
+#define VM_CASE(op) case op
+#define VM_NEXT() break
+#endif
 
 typedef enum {
 	INTERPRET_OK,
@@ -17,46 +49,240 @@ typedef enum {
 	INTERPRET_RUNTIME_ERROR,
 } InterpretResult;
 
-class StackFrame {
+// Frames live in a fixed array inside the VM, so a call or return only moves
+// frameCount. ip is the caller's return address while a callee is running.
+// ip is writable because quickening patches opcodes in place.
+class CallFrame {
 public:
-	StackFrame(const std::string name, int offset, int ipoffset) :
-		function_name(name), stack_start_offset(offset), ip_offset(ipoffset) {
-	}
-
-	const std::string function_name;
-	int stack_start_offset;
-	int ip_offset;
+	Chunk* chunk;
+	uint8_t* ip;
+	const RegInstruction* pc; // used instead of ip by the register VM
+	Value* slots; // the frame's first argument/local, register 0 for the register VM
 };
 
 class VM {
 public:
-	Chunk* chunk;
-	std::vector<Value> stack;
-	
-	int ip;
-	std::unordered_map<std::string, Value> vm_globals;
+	std::unique_ptr<Value[]> stack; // the main script's, each coroutine has its own
+	Value* stackBase; // bottom of the stack of whatever is running
+	Value* stackTop;
+	std::vector<Value> vm_globals; // indexed by the slots in vm_global_names
+	GlobalTable vm_global_names;
 	std::unordered_map<std::string, std::shared_ptr<Chunk>> vm_functions;
-	std::unordered_map<std::string, NativeFunction> vm_native_functions;
-	std::vector<std::unique_ptr<StackFrame>> vm_stackFrames;
+	std::vector<Chunk*> vm_function_table; // indexed by OP_CALL, main is 0
+	std::vector<NativeFunction> vm_native_functions; // indexed by OP_CALL_NATIVE
+	std::unique_ptr<CallFrame[]> mainFrames = std::make_unique<CallFrame[]>(FRAMES_MAX);
+	CallFrame* frames = mainFrames.get(); // FRAMES_MAX of them, the main script's or a coroutine's
+	int frameCount = 0;
+	ObjectHeap heap;
+	size_t nextGC = GC_INITIAL_THRESHOLD;
+	int optimizationLevel = 0; // 1 runs optimizeChunk on every compiled chunk
+	bool printOptimizerStats = false;
+	bool useRegisters = false; // run register code instead of the stack bytecode
+	bool useJit = true; // compile hot functions to machine code where VM_JIT is available
+	int compileThreads = std::thread::hardware_concurrency(); // 1 compiles on the calling thread only
+	std::string bytecodeCache; // cache file of the script being run, empty to always compile
+	std::vector<std::shared_ptr<Chunk>> snippets; // earlier REPL inputs whose constants may still be in use
+	std::shared_ptr<const Program> program; // owns the constants of the code this VM runs, when it is an isolate
+	std::vector<std::unique_ptr<VM>> workers; // run the kernels of the parallel natives, one per worker thread
+	std::vector<Chunk*> workerCode; // the function table the workers have copies of
+	std::unique_ptr<Scheduler> scheduler; // made by the first coroutine or I/O native
+#ifdef VM_OPCODE_STATS
+	OpcodeStats opcodeStats;
+#endif
 	
 
-	InterpretResult interpret(std::string source) {
+	VM() {
+		stack = std::make_unique<Value[]>(STACK_MAX);
+		stackBase = stack.get();
+		stackTop = stackBase;
 		initNativeFunctions(&vm_native_functions);
-		Chunk chunk = Chunk(1);
-		vm_functions["main"]= std::make_shared<Chunk>(0);
-		const char* source_c_str = source.c_str();
-		Compiler compiler = Compiler(source_c_str, &vm_functions, &vm_native_functions);
+	}
+
+	InterpretResult interpret(std::string_view source) {
+		if (!compileScript(source)) {
+			return INTERPRET_COMPILE_ERROR;
+		}
+		InterpretResult result = runMain();
+#ifdef VM_OPCODE_STATS
+		opcodeStats.print();
+#endif
+		return result;
+	}
+
+	// Compiles source once for any number of VMs, on any threads, to run with
+	// loadProgram. This VM is loaded with it too. Null, after the errors have
+	// been printed, if it does not compile.
+	std::shared_ptr<const Program> compileProgram(std::string_view source) {
+		if (!compileScript(source)) {
+			return nullptr;
+		}
+		std::shared_ptr<Program> program = std::make_shared<Program>();
+		for (Chunk* chunk : vm_function_table) {
+			program->functions.push_back(vm_functions[chunk->function.funcName]);
+		}
+		program->globals = vm_global_names;
+		program->registers = useRegisters;
+		loadProgram(program);
+		return program;
+	}
+
+	// Makes this VM an isolate of program, with every global undefined, ready
+	// for runMain.
+	void loadProgram(std::shared_ptr<const Program> program) {
+		this->program = program;
+		vm_functions.clear();
+		vm_function_table.clear();
+		for (const std::shared_ptr<const Chunk>& chunk : program->functions) {
+			loadCopy(chunk.get());
+		}
+		vm_global_names = program->globals;
+		useRegisters = program->registers;
+		resetGlobals();
+	}
+
+	void loadCopy(const Chunk* chunk) {
+		std::shared_ptr<Chunk> copy = chunk->runnableCopy();
+		vm_functions[copy->function.funcName] = copy;
+		vm_function_table.push_back(copy.get());
+	}
+
+	// The VMs of the first count workers, each with its own copy of this VM's
+	// functions and of its globals as they are now. Strings in globals are
+	// copied into the worker's heap; arrays are not copied and read as nil.
+	std::vector<VM*> prepareWorkers(int count) {
+		bool changed = workerCode != vm_function_table;
+		if (changed) {
+			workers.clear();
+			workerCode = vm_function_table;
+		}
+		std::vector<VM*> prepared;
+		for (int i = 0; i < count; i++) {
+			if (i == (int)workers.size()) {
+				workers.push_back(std::make_unique<VM>());
+				workers[i]->useJit = useJit;
+				for (Chunk* chunk : vm_function_table) {
+					workers[i]->loadCopy(chunk);
+				}
+			}
+			VM* worker = workers[i].get();
+			if (worker->vm_global_names.size() != vm_global_names.size()) {
+				worker->vm_global_names = vm_global_names;
+			}
+			worker->vm_globals.assign(vm_globals.size(), Value());
+			for (size_t slot = 0; slot < vm_globals.size(); slot++) {
+				Value value = vm_globals[slot];
+				if (value.isString()) {
+					value = Value(worker->allocateString(value.returnString()));
+				}
+				else if (value.isArray()) {
+					value = Value();
+				}
+				worker->vm_globals[slot] = value;
+			}
+			prepared.push_back(worker);
+		}
+		return prepared;
+	}
+
+	// Makes every global undefined, so the next runMain runs the script from
+	// the start, on the code already quickened and compiled by earlier runs.
+	void resetGlobals() {
+		vm_globals.assign(vm_global_names.size(), Value::undefined());
+	}
+
+	// Loads the script from the bytecode cache when there is a valid one and
+	// compiles it otherwise.
+	bool compileScript(std::string_view source) {
+		// -stats reports on compilation, so it always compiles
+		bool useCache = !bytecodeCache.empty() && !printOptimizerStats;
+		uint64_t sourceHash = useCache ? hashSource(source, optimizationLevel, useRegisters) : 0;
+		if (useCache && loadBytecodeCache(this, bytecodeCache, sourceHash)) {
+			return true;
+		}
+		int warnings = 0;
+		if (!compileMain(source, &warnings)) {
+			return false;
+		}
+		// a cached run would not repeat the warnings
+		if (useCache && warnings == 0) {
+			writeBytecodeCache(this, bytecodeCache, sourceHash);
+		}
+		return true;
+	}
+
+	// One input of an interactive session. The input is compiled on its own
+	// as the new main chunk, against the functions and globals every earlier
+	// input left behind, so the work per input does not grow with the session.
+	// Errors leave the session usable: a failed compile defines nothing and a
+	// runtime error keeps whatever globals were assigned before it.
+	InterpretResult interpretSnippet(std::string_view source) {
+		if (!compileMain(source, nullptr)) {
+			return INTERPRET_COMPILE_ERROR;
+		}
+		// globals may still hold the snippet's string constants once it is done
+		Chunk* main = vm_function_table[0];
+		for (Value& constant : main->constants) {
+			if (constant.isString()) {
+				snippets.push_back(vm_functions["main"]);
+				break;
+			}
+		}
+		return runMain();
+	}
+
+	// Compiles source into a fresh main chunk. Functions it declares are added
+	// to the function table, and taken out again if the compile fails.
+	bool compileMain(std::string_view source, int* warnings) {
+		std::shared_ptr<Chunk> main = std::make_shared<Chunk>(0);
+		main->function = FunctionObject("main", 0);
+		vm_functions["main"] = main;
+		if (vm_function_table.empty()) {
+			vm_function_table.push_back(main.get());
+		}
+		vm_function_table[0] = main.get();
+		size_t functionCount = vm_function_table.size();
+		Compiler compiler = Compiler(source, &vm_functions, &vm_function_table, &vm_native_functions, &vm_global_names);
+		compiler.optimizationLevel = optimizationLevel;
+		compiler.registerBackend = useRegisters;
+		compiler.threads = compileThreads;
 		bool compilation_result = compiler.compile();
-		this->chunk = vm_functions["main"].get();
-		this->chunk->function.funcName="main";
-		this->ip = 0;
-		std::string name = "main";
-		vm_stackFrames.push_back(std::make_unique<StackFrame>(name,this->stack.size(), 0));
-		//disassembleChunk(vm_functions["recursive"].get());
-		InterpretResult result = run();
-		if (result != INTERPRET_OK) {
-			return result;
+		if (printOptimizerStats) {
+			compiler.optimizerStats.print();
+		}
+		if (warnings) {
+			*warnings = compiler.warnings;
+		}
+		vm_globals.resize(vm_global_names.size(), Value::undefined());
+		if (!compilation_result) {
+			while (vm_function_table.size() > functionCount) {
+				vm_functions.erase(vm_function_table.back()->function.funcName);
+				vm_function_table.pop_back();
+			}
+		}
+		return compilation_result;
+	}
+
+	// Runs the main chunk in a frame of its own on top of the stack, and pops
+	// that frame again however the chunk finishes.
+	InterpretResult runMain() {
+		vm_globals.resize(vm_global_names.size(), Value::undefined());
+		Chunk* main = vm_function_table[0];
+		Value* base = stackTop;
+		frameCount = 1;
+		frames[0].chunk = main;
+		frames[0].ip = main->opcodes.data();
+		frames[0].pc = main->registerCode.data();
+		frames[0].slots = base;
+		InterpretResult result = INTERPRET_RUNTIME_ERROR;
+		if (checkStackSpace(base, main)) {
+			result = useRegisters && hasRegisterCode() ? runRegisters() : run();
+		}
+		frameCount = 0;
+		stackTop = base;
+		if (scheduler) {
+			scheduler->finish();
 		}
+		return result;
 	}
 
 	void runtimeError() {
@@ -68,338 +294,1033 @@ public:
 		runtimeError(args...);
 	}
 
-	void destroyStackFrame() {
-		int stack_offset = (vm_stackFrames.end() - 1)->get()->stack_start_offset;
-		int ip_offset = (vm_stackFrames.end() - 1)->get()->ip_offset;
-		vm_stackFrames.pop_back();
-		stack.erase(stack.begin() + stack_offset , stack.end());
-		this->ip = ip_offset;
+	StringObject* allocateString(std::string string) {
+		if (heap.bytesAllocated > nextGC) {
+			collectGarbage();
+		}
+		return heap.allocateString(std::move(string));
+	}
+
+	ArrayObject* allocateArray(std::vector<double> values) {
+		if (heap.bytesAllocated > nextGC) {
+			collectGarbage();
+		}
+		return heap.allocateArray(std::move(values));
+	}
+
+	// Takes over an object allocated outside any heap, such as one received
+	// from another isolate.
+	Object* adoptObject(Object* object) {
+		if (heap.bytesAllocated > nextGC) {
+			collectGarbage();
+		}
+		heap.adopt(object);
+		return object;
 	}
 
-	InterpretResult run() {	
-		int size = chunk->opcodes.size();
-		while (ip < size) {
-			int opcode = chunk->opcodes[this->ip];
-			switch (opcode)
+	// Strings and arrays hold no references to other objects, so marking is
+	// just flagging every object reachable from the stacks and the globals.
+	void collectGarbage() {
+		for (Value* slot = stackBase; slot < stackTop; slot++) {
+			markValue(*slot);
+		}
+		if (scheduler) {
+			scheduler->mark();
+		}
+		for (Value& global : vm_globals) {
+			markValue(global);
+		}
+		heap.sweep();
+		nextGC = heap.bytesAllocated * 2 > GC_INITIAL_THRESHOLD ? heap.bytesAllocated * 2 : GC_INITIAL_THRESHOLD;
+	}
+
+	// Addition for operands that are not both numbers: string concatenation or
+	// a type error. Both operands must already be reachable by the collector.
+	bool addValues(Value a, Value b, Value* result) {
+		if (a.isString() && b.isString()) {
+			*result = Value(allocateString(a.returnString() + b.returnString()));
+			return true;
+		}
+		if (a.isNumber() && b.isNumber()) {
+			*result = Value(a.returnDouble() + b.returnDouble());
+			return true;
+		}
+		runtimeError("Cannot perform addition between given types");
+		return false;
+	}
+
+	void markValue(Value value) {
+		if (value.isObject() && !value.returnObject()->isConstant) {
+			value.returnObject()->isMarked = 1;
+		}
+	}
+
+	// Runs until the main script returns or, for a call made from machine
+	// code, until the frame count drops below entryDepth again.
+	InterpretResult run(int entryDepth = 1) {
+#ifdef VM_COMPUTED_GOTO
+		static void* dispatch_table[] = {
+#define VM_LABEL_ADDRESS(op, operands) &&label_##op,
+			OPCODE_LIST(VM_LABEL_ADDRESS)
+#undef VM_LABEL_ADDRESS
+		};
+#endif
+		CallFrame* frame = &frames[frameCount - 1];
+		Chunk* chunk = frame->chunk;
+		uint8_t* ip = frame->ip;
+		Value* slots = frame->slots;
+		// the stack top lives in a register while running; this->stackTop is
+		// only brought up to date before anything else may look at the stack
+		Value* sp = this->stackTop;
+		int operand;
+
+#define PUSH(value) (*sp++ = (value))
+#define POP() (*--sp)
+#define DROP() (sp--)
+#define PEEK(distance) (sp[-1 - (distance)])
+#define STORE_STACK() (this->stackTop = sp)
+#define CHECK_NUMBER_OPERANDS() \
+	if (!PEEK(0).isNumber() || !PEEK(1).isNumber()) { \
+		runtimeError("Operands must be numbers"); \
+		return INTERPRET_RUNTIME_ERROR; \
+	}
+#define READ_BYTE() (*ip++)
+#define READ_SHORT() (ip += 2, (uint16_t)((ip[-2] << 8) | ip[-1]))
+#define IP_OFFSET() ((int)(ip - chunk->opcodes.data()))
+#define QUICKEN(op) (ip[-1] = (op))
+#define BOTH_NUMBERS() (PEEK(0).isNumber() && PEEK(1).isNumber())
+#define COMPARE_AND_JUMP(op, jumpWhen) { \
+	uint16_t offset = READ_SHORT(); \
+	CHECK_NUMBER_OPERANDS(); \
+	bool result = PEEK(1).returnDouble() op PEEK(0).returnDouble(); \
+	sp -= 2; \
+	if (result == jumpWhen) ip += offset; \
+	VM_NEXT(); \
+}
+#define LOAD_FRAME() \
+	frame = &frames[frameCount - 1]; \
+	chunk = frame->chunk; \
+	ip = frame->ip; \
+	slots = frame->slots
+// Hands the current frame to its machine code, starting at start. The frame
+// either returns there or comes back deoptimized, possibly running another
+// chunk after a tail call, and the interpreter carries on where it stopped.
+#define RUN_JIT(start) { \
+	STORE_STACK(); \
+	int status = chunk->jitEntry(slots, vm_globals.data(), this, sp, start); \
+	if (status == JIT_ERROR) return INTERPRET_RUNTIME_ERROR; \
+	if (status == JIT_RETURNED) { \
+		if (frameCount == 1) { \
+			this->stackTop = slots; \
+			return INTERPRET_OK; \
+		} \
+		sp = slots + 1; \
+		frameCount--; \
+		if (frameCount < entryDepth) { \
+			STORE_STACK(); \
+			return INTERPRET_OK; \
+		} \
+		LOAD_FRAME(); \
+		VM_NEXT(); \
+	} \
+	LOAD_FRAME(); \
+	sp = this->stackTop; \
+}
+
+		for (;;) {
+			VM_DISPATCH()
 			{
-			case OP_RETURN:
-				ip += 1;
-				if (chunk->function.funcName != "main") {
-					destroyStackFrame();
-					stack.push_back(Value());
-					this->chunk = vm_functions[(vm_stackFrames.end() - 1)->get()->function_name].get();
-					this->chunk->function.funcName = (vm_stackFrames.end() - 1)->get()->function_name;
-					size = this->chunk->opcodes.size();
+			VM_CASE(OP_RETURN):
+				if (frameCount == 1) {
+					frame->ip = ip;
+					STORE_STACK();
+					return INTERPRET_OK;
 				}
-				break;
+				sp = slots;
+				PUSH(Value());
+				frameCount--;
+				if (frameCount < entryDepth) {
+					STORE_STACK();
+					return INTERPRET_OK;
+				}
+				LOAD_FRAME();
+				VM_NEXT();
 
-			case OP_RETURN_VALUE: {
-				ip += 1;
-				Value returnValue = stack.back();
-				destroyStackFrame();
-				this->chunk = vm_functions[(vm_stackFrames.end() - 1)->get()->function_name].get();
-				this->chunk->function.funcName = (vm_stackFrames.end() - 1)->get()->function_name;
-				stack.emplace_back(returnValue);
-				size = this->chunk->opcodes.size();
-				break;
+			VM_CASE(OP_RETURN_VALUE): {
+				Value returnValue = PEEK(0);
+				sp = slots;
+				PUSH(returnValue);
+				frameCount--;
+				if (frameCount < entryDepth) {
+					STORE_STACK();
+					return INTERPRET_OK;
+				}
+				LOAD_FRAME();
+				VM_NEXT();
 			}
 
-			case OP_CONSTANT:
-				stack.emplace_back(chunk->constants[chunk->opcodes[this->ip + 1]]);
-				ip += 2;
-				break;
+			VM_CASE(OP_CONSTANT_LONG):
+				operand = READ_SHORT();
+				goto constant;
+			VM_CASE(OP_CONSTANT):
+				operand = READ_BYTE();
+			constant:
+				PUSH(chunk->constants[operand]);
+				VM_NEXT();
 
-			case OP_NEGATE: {
-				if (!std::holds_alternative<double>(stack.back().value)) {
+			VM_CASE(OP_NEGATE): {
+				if (!PEEK(0).isNumber()) {
 					runtimeError("Operand must be a double");
 					return INTERPRET_RUNTIME_ERROR;
 				}
+				PEEK(0) = Value(-(PEEK(0).returnDouble()));
+				VM_NEXT();
+			}
 
-				double val = -(stack.back().returnDouble());
-				stack.pop_back();
-				stack.push_back(Value(val));
-				ip += 1;
-				break;
+			// The generic arithmetic and comparison handlers quicken themselves
+			// into a type specialized opcode for the operands they see. The
+			// specialized handlers only check their guard; on a miss they put the
+			// generic opcode back and run it, so the site can settle on new types.
+			VM_CASE(OP_ADD):
+			add: {
+				Value b = PEEK(0);
+				Value a = PEEK(1);
+				if (a.isNumber() && b.isNumber()) {
+					QUICKEN(OP_ADD_NUM);
+					DROP();
+					PEEK(0) = Value(a.returnDouble() + b.returnDouble());
+					VM_NEXT();
+				}
+				if (a.isString() && b.isString()) {
+					QUICKEN(OP_ADD_STR);
+					goto add_str;
+				}
+				runtimeError("Cannot perform addition between given types");
+				return INTERPRET_RUNTIME_ERROR;
 			}
 
-			case OP_ADD: {
-				if (stack.back().value.index() != (stack.end() - 2)->value.index()) {
-					runtimeError("Cannot perform addition between given types");
-					ip += 1;
-					return INTERPRET_RUNTIME_ERROR;
-					break;
-				};
-				switch (stack.back().value.index()) {
-				case 0: {
-					runtimeError("Operation not permitted between given types");
-					ip += 1;
-					return INTERPRET_RUNTIME_ERROR;
-					break;
-				}
-				case 1: {
-					double val1 = stack.back().returnDouble();
-					stack.pop_back();
-					double val2 = stack.back().returnDouble();
-					stack.pop_back();
-					stack.emplace_back(Value(val1 + val2));
-					ip += 1;
-					break;
-				}
-				case 2: {
-					std::string val1 = stack.back().returnString(); stack.pop_back();
-					std::string val2 = stack.back().returnString(); stack.pop_back();
-					stack.emplace_back(Value(val2 + val1));
-					ip += 1;
-					break;
-					}
-				} 
-				break;
+			VM_CASE(OP_ADD_NUM):
+				if (!BOTH_NUMBERS()) {
+					QUICKEN(OP_ADD);
+					goto add;
+				}
+				PEEK(1) = Value(PEEK(1).returnDouble() + PEEK(0).returnDouble());
+				DROP();
+				VM_NEXT();
+
+			VM_CASE(OP_ADD_STR):
+				if (!PEEK(0).isString() || !PEEK(1).isString()) {
+					QUICKEN(OP_ADD);
+					goto add;
+				}
+			add_str: {
+				// operands stay on the stack until the result is allocated so a collection cannot free them
+				STORE_STACK();
+				StringObject* result = allocateString(PEEK(1).returnString() + PEEK(0).returnString());
+				DROP();
+				PEEK(0) = Value(result);
+				VM_NEXT();
 			}
-			case OP_SUB: {
-				double val1 = -stack.back().returnDouble();
-				stack.pop_back();
-				double val2 = -stack.back().returnDouble();
-				stack.pop_back();
-				stack.emplace_back(std::move(Value(val1 - val2)));
-				ip += 1;
-				break;
+
+			VM_CASE(OP_SUB):
+			sub: {
+				CHECK_NUMBER_OPERANDS();
+				QUICKEN(OP_SUB_NUM);
+				double val1 = POP().returnDouble();
+				double val2 = PEEK(0).returnDouble();
+				PEEK(0) = Value(val2 - val1);
+				VM_NEXT();
 			}
 
-			case OP_MUL: {
-				double val1 = -stack.back().returnDouble();
-				stack.pop_back();
-				double val2 = -stack.back().returnDouble();
-				stack.pop_back();
-				stack.push_back(Value(val1 * val2));
-				ip += 1;
-				break;
+			VM_CASE(OP_SUB_NUM):
+				if (!BOTH_NUMBERS()) {
+					QUICKEN(OP_SUB);
+					goto sub;
+				}
+				PEEK(1) = Value(PEEK(1).returnDouble() - PEEK(0).returnDouble());
+				DROP();
+				VM_NEXT();
+
+			VM_CASE(OP_MUL):
+			mul: {
+				CHECK_NUMBER_OPERANDS();
+				QUICKEN(OP_MUL_NUM);
+				double val1 = POP().returnDouble();
+				double val2 = PEEK(0).returnDouble();
+				PEEK(0) = Value(val1 * val2);
+				VM_NEXT();
 			}
 
-			case OP_DIV: {
-				double val1 = -stack.back().returnDouble();
-				stack.pop_back();
-				double val2 = -stack.back().returnDouble();
-				if (val1 != 0) {
-					stack.pop_back();
-					stack.push_back(Value(val2 / val1));
-					ip += 1;
+			VM_CASE(OP_MUL_NUM):
+				if (!BOTH_NUMBERS()) {
+					QUICKEN(OP_MUL);
+					goto mul;
 				}
-				else {
-					std::cout << "Error division by zero at line " << chunk->lines[ip];
+				PEEK(1) = Value(PEEK(1).returnDouble() * PEEK(0).returnDouble());
+				DROP();
+				VM_NEXT();
+
+			VM_CASE(OP_DIV):
+			div: {
+				CHECK_NUMBER_OPERANDS();
+				QUICKEN(OP_DIV_NUM);
+				double val1 = POP().returnDouble();
+				double val2 = PEEK(0).returnDouble();
+				if (val1 == 0) {
+					std::cout << "Error division by zero at line " << chunk->getLine(IP_OFFSET() - 1);
 					return INTERPRET_RUNTIME_ERROR;
 				}
-				break;
+				PEEK(0) = Value(val2 / val1);
+				VM_NEXT();
 			}
 
-			case OP_NIL: {
-				stack.push_back(Value("nil"));
-				ip++;
-			
-				break;
+			VM_CASE(OP_DIV_NUM): {
+				if (!BOTH_NUMBERS()) {
+					QUICKEN(OP_DIV);
+					goto div;
+				}
+				double divisor = POP().returnDouble();
+				if (divisor == 0) {
+					std::cout << "Error division by zero at line " << chunk->getLine(IP_OFFSET() - 1);
+					return INTERPRET_RUNTIME_ERROR;
+				}
+				PEEK(0) = Value(PEEK(0).returnDouble() / divisor);
+				VM_NEXT();
 			}
 
-			case OP_TRUE: {
-				bool val = 1;
-				stack.push_back(Value(val));
-				ip++;
-			
-				break;
-			}
+			VM_CASE(OP_NIL):
+				PUSH(Value());
+				VM_NEXT();
 
-			case OP_FALSE: {
-				bool val = 0;
-				stack.push_back(Value(val));
-				ip++;
-				
-				break;
-			}
+			VM_CASE(OP_TRUE):
+				PUSH(Value(true));
+				VM_NEXT();
 
-			case OP_NOT: {
-				if (std::holds_alternative<bool>(stack.back().value)) {
-					bool val = stack.back().returnBool();
-					stack.pop_back();
-					stack.push_back(Value(!val));
-					ip++;
-					break;
-				}
-				else if (std::holds_alternative<double>(stack.back().value)) {
-					bool val = stack.back().returnDouble();
-					stack.pop_back();
-					stack.push_back(Value(!val));
-					ip++;
-					break;
-				}
-				else if (stack.back().isNill) {
-					bool val = 1;
-					stack.pop_back();
-					stack.push_back(Value(val));
-					ip++;
-					break;
-				}
-				else {
+			VM_CASE(OP_FALSE):
+				PUSH(Value(false));
+				VM_NEXT();
+
+			VM_CASE(OP_NOT):
+				if (PEEK(0).isString()) {
 					runtimeError("Error encountered in Not operator");
-					ip++;
 					return INTERPRET_RUNTIME_ERROR;
-					break;
 				}
-			}
-			case OP_EQUAL: {
-				Value a = stack.back(); stack.pop_back();
-				Value b = stack.back(); stack.pop_back();
-				stack.push_back(Value(a.ValuesEqual(b)));
-				ip++;
-				break;
+				PEEK(0) = Value(PEEK(0).isFalsey());
+				VM_NEXT();
+
+			VM_CASE(OP_EQUAL):
+			equal: {
+				if (BOTH_NUMBERS()) QUICKEN(OP_EQUAL_NUM);
+				Value a = POP();
+				PEEK(0) = Value(a.ValuesEqual(PEEK(0)));
+				VM_NEXT();
 			}
 
-			case OP_GREATER: {
-				Value a = stack.back(); stack.pop_back();
-				Value b = stack.back(); stack.pop_back();
-				bool val = a.returnDouble() < b.returnDouble();
-				stack.push_back(std::move(Value(val)));
-				ip++;
-				break;
+			VM_CASE(OP_EQUAL_NUM):
+				if (!BOTH_NUMBERS()) {
+					QUICKEN(OP_EQUAL);
+					goto equal;
+				}
+				PEEK(1) = Value(PEEK(1).returnDouble() == PEEK(0).returnDouble());
+				DROP();
+				VM_NEXT();
+
+			VM_CASE(OP_GREATER):
+			greater: {
+				CHECK_NUMBER_OPERANDS();
+				QUICKEN(OP_GREATER_NUM);
+				Value a = POP();
+				Value b = PEEK(0);
+				PEEK(0) = Value(b.returnDouble() > a.returnDouble());
+				VM_NEXT();
 			}
 
-			case OP_LESS: {
-				Value a = stack.back(); stack.pop_back();
-				Value b = stack.back(); stack.pop_back();
-				bool val = a.returnDouble() > b.returnDouble();
-				stack.emplace_back(std::move(Value(val)));
-				ip++;
-				break;
+			VM_CASE(OP_GREATER_NUM):
+				if (!BOTH_NUMBERS()) {
+					QUICKEN(OP_GREATER);
+					goto greater;
+				}
+				PEEK(1) = Value(PEEK(1).returnDouble() > PEEK(0).returnDouble());
+				DROP();
+				VM_NEXT();
+
+			VM_CASE(OP_LESS):
+			less: {
+				CHECK_NUMBER_OPERANDS();
+				QUICKEN(OP_LESS_NUM);
+				Value a = POP();
+				Value b = PEEK(0);
+				PEEK(0) = Value(b.returnDouble() < a.returnDouble());
+				VM_NEXT();
 			}
 
-			case OP_PRINT: {
-				Value value = stack.back(); stack.pop_back();
+			VM_CASE(OP_LESS_NUM):
+				if (!BOTH_NUMBERS()) {
+					QUICKEN(OP_LESS);
+					goto less;
+				}
+				PEEK(1) = Value(PEEK(1).returnDouble() < PEEK(0).returnDouble());
+				DROP();
+				VM_NEXT();
+
+			VM_CASE(OP_PRINT): {
+				Value value = POP();
 				value.printValue();
-				printf("\n");
-				ip++;
-				break;
+				std::cout << "\n";
+				VM_NEXT();
 			}
 
-			case OP_POP: {
-				stack.pop_back();
-				ip++;
-				break;
+			VM_CASE(OP_POP):
+				DROP();
+				VM_NEXT();
+
+			VM_CASE(OP_DEFINE_GLOBAL_LONG):
+				operand = READ_SHORT();
+				goto define_global;
+			VM_CASE(OP_DEFINE_GLOBAL):
+				operand = READ_BYTE();
+			define_global:
+				vm_globals[operand] = POP();
+				VM_NEXT();
+
+			VM_CASE(OP_GET_GLOBAL_LONG):
+				operand = READ_SHORT();
+				goto get_global;
+			VM_CASE(OP_GET_GLOBAL):
+				operand = READ_BYTE();
+			get_global: {
+				Value global = vm_globals[operand];
+				if (global.isUndefined()) {
+					runtimeError("Unidenfied variable name ", vm_global_names.names[operand]);
+					return INTERPRET_RUNTIME_ERROR;
+				}
+				PUSH(global);
+				VM_NEXT();
+			}
+
+			VM_CASE(OP_SET_GLOBAL_LONG):
+				operand = READ_SHORT();
+				goto set_global;
+			VM_CASE(OP_SET_GLOBAL):
+				operand = READ_BYTE();
+			set_global:
+				vm_globals[operand] = PEEK(0);
+				VM_NEXT();
+
+			VM_CASE(OP_GET_LOCAL_LONG):
+				operand = READ_SHORT();
+				goto get_local;
+			VM_CASE(OP_GET_LOCAL):
+				operand = READ_BYTE();
+			get_local:
+				PUSH(slots[operand]);
+				VM_NEXT();
+
+			VM_CASE(OP_SET_LOCAL_LONG):
+				operand = READ_SHORT();
+				goto set_local;
+			VM_CASE(OP_SET_LOCAL):
+				operand = READ_BYTE();
+			set_local:
+				slots[operand] = PEEK(0);
+				VM_NEXT();
+
+			VM_CASE(OP_JUMP_IF_FALSE): {
+				uint16_t offset = READ_SHORT();
+				if (PEEK(0).isFalsey()) ip += offset;
+				VM_NEXT();
+			}
+
+			VM_CASE(OP_JUMP): {
+				uint16_t offset = READ_SHORT();
+				ip += offset;
+				VM_NEXT();
+			}
+
+			VM_CASE(OP_LOOP): {
+				uint16_t offset = READ_SHORT();
+				ip -= offset;
+#ifdef VM_JIT
+				if (chunk->jitEntry == nullptr) profileLoop(chunk);
+				// on-stack replacement: the machine code takes over this frame at the loop header
+				if (chunk->jitEntry != nullptr) RUN_JIT(chunk->jit->address(IP_OFFSET()));
+#endif
+				VM_NEXT();
 			}
 
-			case OP_DEFINE_GLOBAL: {
-				std::string name = chunk->constants[chunk->opcodes[this->ip + 1]].returnString();
-				vm_globals[name] = stack.back();
-				stack.pop_back();
+			// Superinstructions fused by fuseSuperinstructions. Each one does the
+			// work of the sequence it replaced in a single dispatch; two byte
+			// operands are two separate one byte indexes.
+			VM_CASE(OP_GET_LOCAL_CONSTANT):
+				PUSH(slots[ip[0]]);
+				PUSH(chunk->constants[ip[1]]);
 				ip += 2;
-				break;
+				VM_NEXT();
+
+			VM_CASE(OP_GET_GLOBAL_CONSTANT): {
+				Value global = vm_globals[ip[0]];
+				if (global.isUndefined()) {
+					runtimeError("Unidenfied variable name ", vm_global_names.names[ip[0]]);
+					return INTERPRET_RUNTIME_ERROR;
+				}
+				PUSH(global);
+				PUSH(chunk->constants[ip[1]]);
+				ip += 2;
+				VM_NEXT();
 			}
 
-			case OP_GET_GLOBAL: {
-				std::string name = chunk->constants[chunk->opcodes[this->ip + 1]].returnString();
-				Value value;
-				try {
-					stack.emplace_back(std::move(vm_globals.at(name)));
+			VM_CASE(OP_ADD_LOCAL_LOCAL): {
+				Value a = slots[ip[0]];
+				Value b = slots[ip[1]];
+				ip += 2;
+				if (a.isNumber() && b.isNumber()) {
+					PUSH(Value(a.returnDouble() + b.returnDouble()));
+					VM_NEXT();
 				}
-				catch (const std::out_of_range& e) {
-					runtimeError("Unidenfied variable name ", name);
+				STORE_STACK();
+				Value result;
+				if (!addValues(a, b, &result)) return INTERPRET_RUNTIME_ERROR;
+				PUSH(result);
+				VM_NEXT();
+			}
+
+			VM_CASE(OP_INCREMENT_LOCAL): {
+				Value* local = &slots[ip[0]];
+				Value constant = chunk->constants[ip[1]];
+				ip += 2;
+				if (local->isNumber() && constant.isNumber()) {
+					*local = Value(local->returnDouble() + constant.returnDouble());
+					VM_NEXT();
+				}
+				STORE_STACK();
+				if (!addValues(*local, constant, local)) return INTERPRET_RUNTIME_ERROR;
+				VM_NEXT();
+			}
+
+			VM_CASE(OP_INCREMENT_GLOBAL): {
+				Value* global = &vm_globals[ip[0]];
+				Value constant = chunk->constants[ip[1]];
+				if (global->isUndefined()) {
+					runtimeError("Unidenfied variable name ", vm_global_names.names[ip[0]]);
 					return INTERPRET_RUNTIME_ERROR;
 				}
 				ip += 2;
-				break;
+				if (global->isNumber() && constant.isNumber()) {
+					*global = Value(global->returnDouble() + constant.returnDouble());
+					VM_NEXT();
+				}
+				STORE_STACK();
+				if (!addValues(*global, constant, global)) return INTERPRET_RUNTIME_ERROR;
+				VM_NEXT();
 			}
 
-			case OP_SET_GLOBAL: {
-				std::string name = chunk->constants[chunk->opcodes[this->ip + 1]].returnString();
-				vm_globals[name] = stack.back();
-				ip += 2;
-				break;
+			VM_CASE(OP_SET_LOCAL_POP):
+				slots[READ_BYTE()] = POP();
+				VM_NEXT();
+
+			VM_CASE(OP_SET_GLOBAL_POP):
+				vm_globals[READ_BYTE()] = POP();
+				VM_NEXT();
+
+			VM_CASE(OP_JUMP_IF_LESS): COMPARE_AND_JUMP(<, true)
+			VM_CASE(OP_JUMP_IF_NOT_LESS): COMPARE_AND_JUMP(<, false)
+			VM_CASE(OP_JUMP_IF_GREATER): COMPARE_AND_JUMP(>, true)
+			VM_CASE(OP_JUMP_IF_NOT_GREATER): COMPARE_AND_JUMP(>, false)
+
+			VM_CASE(OP_JUMP_IF_EQUAL):
+			VM_CASE(OP_JUMP_IF_NOT_EQUAL): {
+				bool jumpWhen = ip[-1] == OP_JUMP_IF_EQUAL;
+				uint16_t offset = READ_SHORT();
+				bool result = PEEK(1).ValuesEqual(PEEK(0));
+				sp -= 2;
+				if (result == jumpWhen) ip += offset;
+				VM_NEXT();
 			}
 
-			case OP_GET_LOCAL: {
-				int slot = chunk->opcodes[++ip] + (vm_stackFrames.end() - 1)->get()->stack_start_offset;
-				stack.push_back(stack[slot]);
-				ip += 1;
-				break;
+			VM_CASE(OP_CALL_LONG):
+				operand = READ_SHORT();
+				goto call;
+			VM_CASE(OP_CALL):
+				operand = READ_BYTE();
+			call: {
+				Chunk* callee = vm_function_table[operand];
+				if (frameCount == FRAMES_MAX) {
+					runtimeError("StackFrame overflow");
+					return INTERPRET_RUNTIME_ERROR;
+				}
+				// the arguments already on the stack become the callee's first slots
+				Value* calleeSlots = sp - callee->function.arity;
+				if (!checkStackSpace(calleeSlots, callee)) {
+					return INTERPRET_RUNTIME_ERROR;
+				}
+				frame->ip = ip;
+				frame = &frames[frameCount++];
+				frame->chunk = callee;
+				frame->ip = callee->opcodes.data();
+				frame->slots = calleeSlots;
+				chunk = callee;
+				ip = frame->ip;
+				slots = frame->slots;
+#ifdef VM_JIT
+				if (callee->jitEntry == nullptr) profileCall(callee);
+				if (callee->jitEntry != nullptr) RUN_JIT(nullptr);
+#endif
+				VM_NEXT();
+			}
+			VM_CASE(OP_TAIL_CALL_LONG):
+				operand = READ_SHORT();
+				goto tail_call;
+			VM_CASE(OP_TAIL_CALL):
+				operand = READ_BYTE();
+			tail_call: {
+				Chunk* callee = vm_function_table[operand];
+				if (!tailCall(frame, callee, sp)) {
+					return INTERPRET_RUNTIME_ERROR;
+				}
+				chunk = callee;
+				ip = frame->ip;
+				sp = slots + callee->function.arity;
+#ifdef VM_JIT
+				if (callee->jitEntry == nullptr) profileCall(callee);
+				if (callee->jitEntry != nullptr) RUN_JIT(nullptr);
+#endif
+				VM_NEXT();
+			}
+			VM_CASE(OP_CALL_NATIVE): {
+				NativeFunction& native = vm_native_functions[READ_BYTE()];
+				// arguments are replaced by the result, like a script call
+				Value* arguments = sp - native.arguments;
+				STORE_STACK();
+				Value result = native.function(this, native.arguments, arguments);
+				sp = arguments;
+				PUSH(result);
+				VM_NEXT();
+			}
+#ifndef VM_COMPUTED_GOTO
+			default:
+				runtimeError("Unknown Instruction Encountered");
+				return INTERPRET_RUNTIME_ERROR;
+#endif
+			}
+		}
+#undef READ_BYTE
+#undef READ_SHORT
+#undef IP_OFFSET
+#undef LOAD_FRAME
+#undef RUN_JIT
+#undef QUICKEN
+#undef BOTH_NUMBERS
+#undef COMPARE_AND_JUMP
+#undef PUSH
+#undef POP
+#undef DROP
+#undef PEEK
+#undef STORE_STACK
+#undef CHECK_NUMBER_OPERANDS
+		return INTERPRET_OK;
+	}
+
+	// The register VM only runs when every function could be translated,
+	// otherwise the whole script falls back to the stack VM.
+	bool hasRegisterCode() {
+		for (Chunk* chunk : vm_function_table) {
+			if (chunk->registerCode.empty()) return false;
+		}
+		return true;
+	}
+
+	// Register VM. Frames share the value stack with the stack VM, register n
+	// being slot n of the frame, and stackTop stays at the end of the current
+	// frame's registers so a collection sees all of them.
+	InterpretResult runRegisters() {
+#ifdef VM_COMPUTED_GOTO
+		static void* dispatch_table[] = {
+#define VM_LABEL_ADDRESS(op) &&label_##op,
+			REG_OPCODE_LIST(VM_LABEL_ADDRESS)
+#undef VM_LABEL_ADDRESS
+		};
+#endif
+		CallFrame* frame = &frames[frameCount - 1];
+		Chunk* chunk = frame->chunk;
+		const RegInstruction* pc = frame->pc;
+		Value* regs = frame->slots;
+		Value* constants = chunk->constants.data();
+		const RegInstruction* i;
+		stackTop = regs + chunk->registerCount;
+
+#ifdef VM_OPCODE_STATS
+#define REG_COUNT() opcodeStats.registerDispatches++
+#else
+#define REG_COUNT() ((void)0)
+#endif
+#ifdef VM_COMPUTED_GOTO
+#define REG_DISPATCH() REG_COUNT(); i = pc++; goto *dispatch_table[i->opcode];
+#define REG_NEXT() do { REG_COUNT(); i = pc++; goto *dispatch_table[i->opcode]; } while (0)
+#else
+#define REG_DISPATCH() REG_COUNT(); i = pc++; switch (i->opcode)
+#define REG_NEXT() break
+#endif
+#define RK(x) ((x) & REG_CONSTANT ? constants[(x) & ~REG_CONSTANT] : regs[x])
+#define CHECK_NUMBERS(b, c) \
+	if (!(b).isNumber() || !(c).isNumber()) { \
+		runtimeError("Operands must be numbers"); \
+		return INTERPRET_RUNTIME_ERROR; \
+	}
+#define REG_COMPARE_AND_JUMP(op, jumpWhen) { \
+	Value b = RK(i->b); \
+	Value c = RK(i->c); \
+	CHECK_NUMBERS(b, c); \
+	if ((b.returnDouble() op c.returnDouble()) == jumpWhen) pc = chunk->registerCode.data() + i->a; \
+	REG_NEXT(); \
+}
+#define LOAD_FRAME() \
+	frame = &frames[frameCount - 1]; \
+	chunk = frame->chunk; \
+	pc = frame->pc; \
+	regs = frame->slots; \
+	constants = chunk->constants.data(); \
+	stackTop = regs + chunk->registerCount
+
+		for (;;) {
+			REG_DISPATCH()
+			{
+			VM_CASE(REG_MOVE):
+				regs[i->a] = regs[i->b];
+				REG_NEXT();
+
+			VM_CASE(REG_LOADK):
+				regs[i->a] = constants[i->b];
+				REG_NEXT();
+
+			VM_CASE(REG_GET_GLOBAL): {
+				Value global = vm_globals[i->b];
+				if (global.isUndefined()) {
+					runtimeError("Unidenfied variable name ", vm_global_names.names[i->b]);
+					return INTERPRET_RUNTIME_ERROR;
+				}
+				regs[i->a] = global;
+				REG_NEXT();
 			}
 
-			case OP_SET_LOCAL: {
-				uint8_t slot = chunk->opcodes[++ip] + (vm_stackFrames.end() - 1)->get()->stack_start_offset;
-				this->stack[slot] = stack.back();
-				ip += 1;
-				break;
+			VM_CASE(REG_SET_GLOBAL):
+			VM_CASE(REG_DEFINE_GLOBAL):
+				vm_globals[i->a] = RK(i->b);
+				REG_NEXT();
+
+			VM_CASE(REG_ADD): {
+				Value b = RK(i->b);
+				Value c = RK(i->c);
+				if (b.isNumber() && c.isNumber()) {
+					regs[i->a] = Value(b.returnDouble() + c.returnDouble());
+					REG_NEXT();
+				}
+				// both operands are in registers or constants, so a collection keeps them
+				if (!addValues(b, c, &regs[i->a])) return INTERPRET_RUNTIME_ERROR;
+				REG_NEXT();
 			}
 
-			case OP_JUMP_IF_FALSE: {
-				ip += 3;
-				uint16_t offset = (uint16_t)((chunk->opcodes[ip - 2] << 8) | chunk->opcodes[ip - 1]);
-				if (stack.back().returnBool() == false) ip += offset;
-				break;
+			VM_CASE(REG_SUB): {
+				Value b = RK(i->b);
+				Value c = RK(i->c);
+				CHECK_NUMBERS(b, c);
+				regs[i->a] = Value(b.returnDouble() - c.returnDouble());
+				REG_NEXT();
 			}
 
-			case OP_JUMP: {
-				ip += 3;
-				uint16_t offset = (uint16_t)((chunk->opcodes[ip - 2] << 8) | chunk->opcodes[ip - 1]);
-				ip += offset;
-				break;
+			VM_CASE(REG_MUL): {
+				Value b = RK(i->b);
+				Value c = RK(i->c);
+				CHECK_NUMBERS(b, c);
+				regs[i->a] = Value(b.returnDouble() * c.returnDouble());
+				REG_NEXT();
 			}
-			case OP_LOOP: {
-				ip += 3;
-				uint16_t offset = (uint16_t)((chunk->opcodes[ip - 2] << 8) | chunk->opcodes[ip - 1]);
-				ip -= offset;
-				break;
+
+			VM_CASE(REG_DIV): {
+				Value b = RK(i->b);
+				Value c = RK(i->c);
+				CHECK_NUMBERS(b, c);
+				if (c.returnDouble() == 0) {
+					std::cout << "Error division by zero at line " << chunk->registerLines[pc - chunk->registerCode.data() - 1];
+					return INTERPRET_RUNTIME_ERROR;
+				}
+				regs[i->a] = Value(b.returnDouble() / c.returnDouble());
+				REG_NEXT();
 			}
-			case OP_CALL: {
-				int offset = chunk->opcodes[ip + 1];
-				std::string name_function = this->chunk->constants[offset].returnString();
-				if (vm_native_functions.count(name_function) != 0) {
-					NativeFn function = vm_native_functions.at(name_function).function;
-					Value* arguments = stack.size() == 0 ? NULL : &stack.back() - vm_native_functions.at(name_function).arguments+1;
-					stack.emplace_back(function(vm_native_functions.at(name_function).arguments, arguments));
-					ip += 2;
-					break;
-				}
-				else {
-					int arity = vm_functions[name_function].get()->function.arity;
-					if (!checkStackFrameOverflow()) {
-						runtimeError("StackFrame overflow");
-						return INTERPRET_RUNTIME_ERROR;
-						break;
-					}
-					if (vm_stackFrames.size() > 2) {
-						vm_stackFrames.emplace_back(std::make_unique<StackFrame>(name_function, stack.size() - vm_stackFrames[1].get()->stack_start_offset - arity, ip + 2));
-					}
-					else {
-						vm_stackFrames.emplace_back(std::make_unique<StackFrame>(name_function, stack.size() - vm_stackFrames.back().get()->stack_start_offset - arity, ip + 2));
-					}
-					ip = 0;
-					this->chunk = vm_functions[name_function].get();
-					size = this->chunk->opcodes.size();
-					break;
+
+			VM_CASE(REG_EQUAL):
+				regs[i->a] = Value(RK(i->b).ValuesEqual(RK(i->c)));
+				REG_NEXT();
+
+			VM_CASE(REG_GREATER): {
+				Value b = RK(i->b);
+				Value c = RK(i->c);
+				CHECK_NUMBERS(b, c);
+				regs[i->a] = Value(b.returnDouble() > c.returnDouble());
+				REG_NEXT();
+			}
+
+			VM_CASE(REG_LESS): {
+				Value b = RK(i->b);
+				Value c = RK(i->c);
+				CHECK_NUMBERS(b, c);
+				regs[i->a] = Value(b.returnDouble() < c.returnDouble());
+				REG_NEXT();
+			}
+
+			VM_CASE(REG_NOT): {
+				Value b = RK(i->b);
+				if (b.isString()) {
+					runtimeError("Error encountered in Not operator");
+					return INTERPRET_RUNTIME_ERROR;
 				}
+				regs[i->a] = Value(b.isFalsey());
+				REG_NEXT();
 			}
+
+			VM_CASE(REG_NEGATE): {
+				Value b = RK(i->b);
+				if (!b.isNumber()) {
+					runtimeError("Operand must be a double");
+					return INTERPRET_RUNTIME_ERROR;
+				}
+				regs[i->a] = Value(-b.returnDouble());
+				REG_NEXT();
+			}
+
+			VM_CASE(REG_PRINT):
+				RK(i->a).printValue();
+				std::cout << "\n";
+				REG_NEXT();
+
+			VM_CASE(REG_JUMP):
+				pc = chunk->registerCode.data() + i->a;
+				REG_NEXT();
+
+			VM_CASE(REG_JUMP_IF_FALSE):
+				if (regs[i->b].isFalsey()) pc = chunk->registerCode.data() + i->a;
+				REG_NEXT();
+
+			VM_CASE(REG_JUMP_IF_LESS): REG_COMPARE_AND_JUMP(<, true)
+			VM_CASE(REG_JUMP_IF_NOT_LESS): REG_COMPARE_AND_JUMP(<, false)
+			VM_CASE(REG_JUMP_IF_GREATER): REG_COMPARE_AND_JUMP(>, true)
+			VM_CASE(REG_JUMP_IF_NOT_GREATER): REG_COMPARE_AND_JUMP(>, false)
+
+			VM_CASE(REG_JUMP_IF_EQUAL):
+			VM_CASE(REG_JUMP_IF_NOT_EQUAL):
+				if (RK(i->b).ValuesEqual(RK(i->c)) == (i->opcode == REG_JUMP_IF_EQUAL)) pc = chunk->registerCode.data() + i->a;
+				REG_NEXT();
+
+			VM_CASE(REG_CALL): {
+				Chunk* callee = vm_function_table[i->b];
+				if (frameCount == FRAMES_MAX) {
+					runtimeError("StackFrame overflow");
+					return INTERPRET_RUNTIME_ERROR;
+				}
+				// the arguments already in R(a) up become the callee's first registers
+				Value* calleeRegs = regs + i->a;
+				if (calleeRegs + callee->registerCount > stackBase + STACK_MAX) {
+					runtimeError("Stack overflow");
+					return INTERPRET_RUNTIME_ERROR;
+				}
+				frame->pc = pc;
+				frame = &frames[frameCount++];
+				frame->chunk = callee;
+				frame->pc = callee->registerCode.data();
+				frame->slots = calleeRegs;
+				LOAD_FRAME();
+				REG_NEXT();
+			}
+
+			VM_CASE(REG_TAIL_CALL): {
+				Chunk* callee = vm_function_table[i->b];
+				if (regs + callee->registerCount > stackBase + STACK_MAX) {
+					runtimeError("Stack overflow");
+					return INTERPRET_RUNTIME_ERROR;
+				}
+				for (int argument = 0; argument < callee->function.arity; argument++) {
+					regs[argument] = regs[i->a + argument];
+				}
+				frame->chunk = callee;
+				frame->pc = callee->registerCode.data();
+				LOAD_FRAME();
+				REG_NEXT();
+			}
+
+			VM_CASE(REG_CALL_NATIVE): {
+				NativeFunction& native = vm_native_functions[i->b];
+				regs[i->a] = native.function(this, native.arguments, regs + i->a);
+				REG_NEXT();
+			}
+
+			VM_CASE(REG_RETURN):
+				if (frameCount == 1) {
+					frame->pc = pc;
+					stackTop = regs;
+					return INTERPRET_OK;
+				}
+				regs[0] = Value();
+				frameCount--;
+				LOAD_FRAME();
+				REG_NEXT();
+
+			VM_CASE(REG_RETURN_VALUE):
+				regs[0] = RK(i->a);
+				frameCount--;
+				LOAD_FRAME();
+				REG_NEXT();
+#ifndef VM_COMPUTED_GOTO
 			default:
 				runtimeError("Unknown Instruction Encountered");
 				return INTERPRET_RUNTIME_ERROR;
-				break;
+#endif
 			}
 		}
+#undef REG_COUNT
+#undef REG_DISPATCH
+#undef REG_NEXT
+#undef RK
+#undef CHECK_NUMBERS
+#undef REG_COMPARE_AND_JUMP
+#undef LOAD_FRAME
 		return INTERPRET_OK;
 	}
 
+	void push(Value value) {
+		*stackTop++ = value;
+	}
+
+	Value pop() {
+		return *--stackTop;
+	}
+
+	Value& peek(int distance) {
+		return stackTop[-1 - distance];
+	}
+
+	// Each chunk knows the deepest its own frame can grow, so one check when a
+	// frame is entered covers every push made while it runs.
+	bool checkStackSpace(Value* slots, Chunk* callee) {
+		if (slots + callee->maxStack > stackBase + STACK_MAX) {
+			runtimeError("Stack overflow");
+			return 0;
+		}
+		return 1;
+	}
+
+	// return f(...): the callee takes over the caller's frame, its arguments
+	// moved down to the frame base, so tail recursion runs in constant space.
+	bool tailCall(CallFrame* frame, Chunk* callee, Value* sp) {
+		if (!checkStackSpace(frame->slots, callee)) {
+			return false;
+		}
+		Value* arguments = sp - callee->function.arity;
+		for (int i = 0; i < callee->function.arity; i++) {
+			frame->slots[i] = arguments[i];
+		}
+		frame->chunk = callee;
+		frame->ip = callee->opcodes.data();
+		return true;
+	}
+
+	// Calls callee with arguments from outside the run loop (a native calling
+	// a script function) and runs it to completion on top of whatever frames
+	// are running. False after a runtime error.
+	bool callFunction(Chunk* callee, const Value* arguments, Value* result) {
+		int depth = frameCount;
+		Value* base = stackTop;
+		if (frameCount == 0) {
+			// a frame under the callee, so its return is not taken for the end of the script
+			frames[0].chunk = vm_function_table[0];
+			frames[0].slots = base;
+			frameCount = 1;
+		}
+		bool ok = false;
+		if (frameCount == FRAMES_MAX) {
+			runtimeError("StackFrame overflow");
+		}
+		else if (checkStackSpace(base, callee)) {
+			for (int i = 0; i < callee->function.arity; i++) {
+				base[i] = arguments[i];
+			}
+			CallFrame* frame = &frames[frameCount++];
+			frame->chunk = callee;
+			frame->ip = callee->opcodes.data();
+			frame->slots = base;
+			stackTop = base + callee->function.arity;
+			int status = JIT_DEOPTIMIZED;
+#ifdef VM_JIT
+			if (callee->jitEntry == nullptr) profileCall(callee);
+			if (callee->jitEntry != nullptr) {
+				status = callee->jitEntry(base, vm_globals.data(), this, stackTop, nullptr);
+			}
+#endif
+			ok = status == JIT_RETURNED || (status == JIT_DEOPTIMIZED && run(frameCount) == INTERPRET_OK);
+			*result = base[0];
+		}
+		frameCount = depth;
+		stackTop = base;
+		return ok;
+	}
+
+#ifdef VM_JIT
+	void profileCall(Chunk* callee) {
+		if (!useJit || callee->callCount >= JIT_CALL_THRESHOLD || ++callee->callCount < JIT_CALL_THRESHOLD) return;
+		compileHot(callee);
+	}
+
+	void profileLoop(Chunk* chunk) {
+		if (!useJit || chunk->loopCount >= JIT_LOOP_THRESHOLD || ++chunk->loopCount < JIT_LOOP_THRESHOLD) return;
+		compileHot(chunk);
+	}
+
+	// Either counter can get here first; a chunk is only compiled once.
+	void compileHot(Chunk* chunk) {
+		if (chunk->jitAttempted) return;
+		chunk->jitAttempted = true;
+		chunk->jit = jitCompile(this, chunk);
+		if (chunk->jit) chunk->jitEntry = chunk->jit->entry;
+	}
+
+	// OP_CALL in machine code. Runs the callee to completion, compiled or
+	// interpreted, and leaves its result in place of the arguments.
+	bool callFromJit(Value* sp, int function) {
+		Chunk* callee = vm_function_table[function];
+		if (frameCount == FRAMES_MAX) {
+			runtimeError("StackFrame overflow");
+			return false;
+		}
+		Value* calleeSlots = sp - callee->function.arity;
+		if (!checkStackSpace(calleeSlots, callee)) {
+			return false;
+		}
+		CallFrame* frame = &frames[frameCount++];
+		frame->chunk = callee;
+		frame->ip = callee->opcodes.data();
+		frame->slots = calleeSlots;
+		stackTop = sp;
+		if (callee->jitEntry == nullptr) profileCall(callee);
+		if (callee->jitEntry != nullptr) {
+			int status = callee->jitEntry(calleeSlots, vm_globals.data(), this, sp, nullptr);
+			if (status == JIT_ERROR) return false;
+			if (status == JIT_RETURNED) {
+				frameCount--;
+				stackTop = calleeSlots + 1;
+				return true;
+			}
+		}
+		return run(frameCount) == INTERPRET_OK;
+	}
+#endif
+
 	void stack_trace() {
-		if (stack.size() == 0) {
+		if (stackTop == stackBase) {
 			std::cout << "Stack Empty" << "\n";
 			return;
 		}
-		for (auto it = stack.begin(); it < stack.end(); ++it) {
-			(it->printValue());
+		for (Value* slot = stackBase; slot < stackTop; slot++) {
+			slot->printValue();
 		}
 		std::cout << "\n";
 		
 	}
-
-
-	bool checkStackFrameOverflow() {
-		if (vm_stackFrames.size() > FRAMES_MAX) {
-			return 0;
-		}
-		return 1;
-	}
 };
\ No newline at end of file
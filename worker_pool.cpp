@@ -0,0 +1,107 @@
+#include "worker_pool.h"
+#include <algorithm>
+
+int parallelThreads = std::thread::hardware_concurrency();
+
+ParallelLoop::ParallelLoop(size_t size, size_t grain, int workers, std::function<void(int, size_t, size_t)> body)
+{
+	this->body = std::move(body);
+	this->grain = grain;
+	this->workers = workers;
+	size_t pieces = (size + grain - 1) / grain;
+	partitions = std::make_unique<LoopPartition[]>(workers);
+	for (int i = 0; i < workers; i++) {
+		partitions[i].next.store(std::min(size, pieces * i / workers * grain), std::memory_order_relaxed);
+		partitions[i].end = std::min(size, pieces * (i + 1) / workers * grain);
+	}
+}
+
+void ParallelLoop::work(int worker)
+{
+	for (int i = 0; i < workers; i++) {
+		LoopPartition& partition = partitions[(worker + i) % workers];
+		for (;;) {
+			size_t begin = partition.next.fetch_add(grain, std::memory_order_relaxed);
+			if (begin >= partition.end) break;
+			body(worker, begin, std::min(begin + grain, partition.end));
+		}
+	}
+}
+
+WorkerPool::WorkerPool(int threads)
+{
+	for (int i = 0; i < threads; i++) {
+		this->threads.emplace_back(&WorkerPool::runThread, this);
+	}
+}
+
+WorkerPool::~WorkerPool()
+{
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		stopping = true;
+	}
+	wake.notify_all();
+	for (std::thread& thread : threads) {
+		thread.join();
+	}
+}
+
+void WorkerPool::runThread()
+{
+	std::unique_lock<std::mutex> lock(mutex);
+	for (;;) {
+		wake.wait(lock, [this] { return stopping || !waiting.empty(); });
+		if (stopping) return;
+		ParallelLoop* loop = waiting.front();
+		int worker = loop->joined++;
+		if (loop->joined == loop->workers) {
+			waiting.pop_front();
+		}
+		loop->running++;
+		lock.unlock();
+		loop->work(worker);
+		lock.lock();
+		loop->running--;
+		finished.notify_all();
+	}
+}
+
+void WorkerPool::run(ParallelLoop* loop)
+{
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		waiting.push_back(loop);
+	}
+	wake.notify_all();
+	loop->work(0);
+	// every element has been taken by now; pool threads that have not joined
+	// yet are not needed, the ones that have may still be finishing theirs
+	std::unique_lock<std::mutex> lock(mutex);
+	auto position = std::find(waiting.begin(), waiting.end(), loop);
+	if (position != waiting.end()) {
+		waiting.erase(position);
+	}
+	finished.wait(lock, [loop] { return loop->running == 0; });
+}
+
+int parallelWorkers(size_t size)
+{
+	if (size < PARALLEL_MIN_ELEMENTS || parallelThreads <= 1) {
+		return 1;
+	}
+	size_t grains = (size + PARALLEL_GRAIN - 1) / PARALLEL_GRAIN;
+	return (int)std::min<size_t>(parallelThreads, grains);
+}
+
+void parallelFor(size_t size, size_t grain, int workers, std::function<void(int, size_t, size_t)> body)
+{
+	ParallelLoop loop(size, grain, workers, std::move(body));
+	if (workers == 1) {
+		loop.work(0);
+		return;
+	}
+	// the calling thread is a worker too, so the pool has one thread fewer
+	static WorkerPool pool(std::max(parallelThreads - 1, 1));
+	pool.run(&loop);
+}
@@ -0,0 +1,77 @@
+#pragma once
+#ifndef clox_worker_pool_h
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// The threads behind the parallel natives (parallelMap, parallelFilter,
+// parallelReduce, parallelSum and parallelSort).
+// A loop over size elements is split into one partition per worker. Each
+// worker takes grain elements at a time from its own partition and, once that
+// is used up, steals from the others' in the same way, so workers that finish
+// early take over what is left of the slow ones. Every piece taken starts at a
+// multiple of grain, whatever the number of workers, so results combined
+// piece by piece do not depend on it. The thread that
+// starts a loop is worker 0 and works on it too; pool threads that are free
+// join in as the other workers. Loops started from several isolates at once
+// share the pool.
+
+// Smaller inputs run on the calling thread alone.
+#define PARALLEL_MIN_ELEMENTS 10000
+#define PARALLEL_GRAIN 1024
+
+class LoopPartition {
+public:
+	alignas(64) std::atomic<size_t> next;
+	size_t end;
+};
+
+class ParallelLoop {
+public:
+	// body(worker, begin, end) runs the elements [begin, end)
+	std::function<void(int, size_t, size_t)> body;
+	std::unique_ptr<LoopPartition[]> partitions;
+	size_t grain;
+	int workers;
+	int joined = 1; // worker 0 is the thread that started the loop
+	int running = 0; // pool threads inside work()
+
+	ParallelLoop(size_t size, size_t grain, int workers, std::function<void(int, size_t, size_t)> body);
+	void work(int worker);
+};
+
+class WorkerPool {
+public:
+	std::vector<std::thread> threads;
+	std::mutex mutex;
+	std::condition_variable wake; // a loop wants more workers, or the pool stops
+	std::condition_variable finished; // a pool thread left a loop
+	std::deque<ParallelLoop*> waiting; // loops that have workers to spare
+	bool stopping = false;
+
+	WorkerPool(int threads);
+	~WorkerPool();
+	void runThread();
+	// Runs loop with as many pool threads as are free and returns once every
+	// element is done.
+	void run(ParallelLoop* loop);
+};
+
+// Threads the pool starts with, one per core unless set before the first loop.
+extern int parallelThreads;
+
+// The number of workers a loop over size elements taken PARALLEL_GRAIN at a
+// time runs with, 1 when it should run serially.
+int parallelWorkers(size_t size);
+
+// Runs body over [0, size) in pieces of grain elements with workers workers,
+// the calling thread being worker 0.
+void parallelFor(size_t size, size_t grain, int workers, std::function<void(int, size_t, size_t)> body);
+
+#endif // !clox_worker_pool_h